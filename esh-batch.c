@@ -0,0 +1,228 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * Splitting of argument lists that exceed ARG_MAX.
+ *
+ * 'batch [-j N] cmd args...' marks a command as batchable, as does
+ * naming it in ESH_BATCHABLE.  If the argv of a batchable command is
+ * too long for a single exec, the command's process becomes a
+ * supervisor that runs cmd several times, each time with the leading
+ * options of cmd followed by as many of the remaining arguments as
+ * fit, at most N at a time.  The supervisor is the only process of
+ * the job the shell knows about, and its exit status is that of the
+ * first run that failed.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "esh.h"
+#include "esh-sys-utils.h"
+
+/* Room left for the auxiliary vector and the program's file name */
+#define EXEC_HEADROOM 4096
+
+/* Return the number of words of a NULL-terminated array */
+static int
+count_words(char **v)
+{
+        int n = 0;
+        while (v[n])
+                n++;
+        return n;
+}
+
+/* Return true if name is listed in ESH_BATCHABLE */
+static bool
+is_batchable(const char *name)
+{
+        const char *list = esh_var_get("ESH_BATCHABLE");
+        if (list == NULL)
+                return false;
+
+        size_t len = strlen(name);
+        while (*list) {
+                size_t n = strcspn(list, " :");
+                if (n == len && !strncmp(list, name, len))
+                        return true;
+                list += n;
+                list += strspn(list, " :");
+        }
+        return false;
+}
+
+/* Remove the first n words of cmd */
+static void
+drop_words(struct esh_command *cmd, int n)
+{
+        int i;
+        for (i = 0; i < n; i++)
+                free(cmd->argv[i]);
+        memmove(cmd->argv, cmd->argv + n,
+                (count_words(cmd->argv + n) + 1) * sizeof *cmd->argv);
+
+        struct esh_deferred_word *word;
+        for (word = cmd->deferred; word; word = word->next)
+                word->index -= n;
+}
+
+/* Handle a 'batch [-j N]' prefix of cmd, or mark cmd as batchable if
+ * it is named in ESH_BATCHABLE.  Return false on a usage error. */
+bool
+esh_command_batch_prefix(struct esh_command *cmd)
+{
+        if (strcmp(cmd->argv[0], "batch")) {
+                if (is_batchable(cmd->argv[0]))
+                        cmd->batch_jobs = 1;
+                return true;
+        }
+
+        int jobs = 1, skip = 1;
+        if (cmd->argv[1] && !strncmp(cmd->argv[1], "-j", 2)) {
+                char *arg = cmd->argv[1][2] ? cmd->argv[1] + 2 : cmd->argv[2];
+                char *end = NULL;
+                if (arg)
+                        jobs = strtol(arg, &end, 10);
+                if (arg == NULL || *end || jobs < 1) {
+                        fprintf(stderr, "batch: -j expects a positive number\n");
+                        return false;
+                }
+                skip += cmd->argv[1][2] ? 1 : 2;
+        }
+
+        if (cmd->argv[skip] == NULL) {
+                fprintf(stderr, "usage: batch [-j N] command [args...]\n");
+                return false;
+        }
+        drop_words(cmd, skip);
+        cmd->batch_jobs = jobs;
+        return true;
+}
+
+/* Return the number of bytes a string array takes up for execve */
+static size_t
+strings_size(char **v, int n)
+{
+        size_t size = 0;
+        int i;
+        for (i = 0; i < n; i++)
+                size += strlen(v[i]) + 1 + sizeof *v;
+        return size;
+}
+
+/* Turn a wait status into an exit status */
+static int
+exit_status(int status)
+{
+        return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+/* Wait for one run; remember the first failure in *result */
+static void
+reap_one(int *result)
+{
+        int status;
+        while (wait(&status) == -1) {
+                if (errno != EINTR)
+                        return;
+        }
+        if (*result == 0)
+                *result = exit_status(status);
+}
+
+/* Report that argv[0] could not be run and exit as sh does: 127 if it
+ * was not found, 126 otherwise */
+static void
+exec_failed(char **argv)
+{
+        int error = errno;
+        esh_sys_error("%s: ", argv[0]);
+        exit(error == ENOENT ? 127 : 126);
+}
+
+/* Exec cmd in the calling process, which the shell forked for it.
+ * A batchable command whose argv is too long is run in parts instead,
+ * after which the process exits. */
+void
+esh_command_exec(struct esh_command *cmd)
+{
+        char **argv = cmd->argv;
+        char **envp = esh_vars_envp();
+        int argc = count_words(argv);
+
+        long arg_max = sysconf(_SC_ARG_MAX);
+        size_t limit = arg_max == -1 ? 0 : arg_max - EXEC_HEADROOM
+                       - strings_size(envp, count_words(envp));
+
+        if (cmd->batch_jobs == 0 || arg_max == -1
+            || strings_size(argv, argc) + 2 * sizeof *argv <= limit) {
+                execvpe(argv[0], argv, envp);
+                exec_failed(argv);
+        }
+
+        /* The leading options are repeated in every run */
+        int prefix = 1;
+        while (prefix < argc && argv[prefix][0] == '-' && argv[prefix][1]) {
+                if (!strcmp(argv[prefix++], "--"))
+                        break;
+        }
+        size_t prefix_size = strings_size(argv, prefix) + 2 * sizeof *argv;
+
+        /* The runs are our children, not the shell's */
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+
+        char **run = malloc((argc + 1) * sizeof *run);
+        memcpy(run, argv, prefix * sizeof *run);
+
+        int next = prefix, running = 0, result = 0, part = 0;
+        while (next < argc) {
+                size_t size = prefix_size;
+                int n = prefix;
+                while (next < argc) {
+                        size_t word = strings_size(argv + next, 1);
+                        if (n > prefix && size + word > limit)
+                                break;
+                        size += word;
+                        run[n++] = argv[next++];
+                }
+                run[n] = NULL;
+
+                if (size > limit) {
+                        fprintf(stderr, "%s: argument too long even for batch: %.40s...\n",
+                                argv[0], run[n - 1]);
+                        result = 1;
+                        break;
+                }
+
+                if (running == cmd->batch_jobs) {
+                        reap_one(&result);
+                        running--;
+                }
+
+                pid_t pid = fork();
+                if (pid == -1) {
+                        esh_sys_error("batch: fork: ");
+                        result = 1;
+                        break;
+                }
+                if (pid == 0) {
+                        /* with cpus=auto, each part gets a CPU of its own */
+                        if (cmd->pipeline->sched)
+                                esh_sched_apply(cmd->pipeline->sched, part);
+                        execvpe(run[0], run, envp);
+                        exec_failed(run);
+                }
+                running++;
+                part++;
+        }
+
+        while (running-- > 0)
+                reap_one(&result);
+        exit(result);
+}
@@ -0,0 +1,145 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * esh-client: run a command line in a running 'esh --server SOCKET'.
+ *
+ *     esh-client SOCKET -c COMMAND
+ *
+ * behaves like 'esh -c COMMAND': the command runs in the client's
+ * directory and environment, on its standard input, output and error,
+ * and the client exits with the command's status.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "esh-server.h"
+
+extern char **environ;
+
+/* The request's strings */
+static char *strings;
+static size_t strings_len, strings_capacity;
+
+static void
+add_string(const char *s)
+{
+        size_t len = strlen(s) + 1;
+        if (strings_len + len > strings_capacity) {
+                strings_capacity = 2 * (strings_len + len);
+                strings = realloc(strings, strings_capacity);
+                if (strings == NULL) {
+                        perror("esh-client");
+                        exit(2);
+                }
+        }
+        memcpy(strings + strings_len, s, len);
+        strings_len += len;
+}
+
+static bool
+write_full(int fd, const char *buf, size_t len)
+{
+        while (len > 0) {
+                ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n == -1)
+                        return false;
+                buf += n;
+                len -= n;
+        }
+        return true;
+}
+
+int
+main(int ac, char *av[])
+{
+        if (ac < 4 || strcmp(av[2], "-c")) {
+                fprintf(stderr, "usage: %s SOCKET -c COMMAND\n", av[0]);
+                return 2;
+        }
+
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+        if (snprintf(address.sun_path, sizeof address.sun_path, "%s", av[1])
+            >= (int) sizeof address.sun_path) {
+                fprintf(stderr, "%s: %s: socket path too long\n", av[0], av[1]);
+                return 2;
+        }
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1 || connect(fd, (struct sockaddr *) &address, sizeof address) == -1) {
+                fprintf(stderr, "%s: %s: %s\n", av[0], av[1], strerror(errno));
+                return 2;
+        }
+
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof cwd) == NULL) {
+                perror("esh-client: getcwd");
+                return 2;
+        }
+        add_string(cwd);
+        int i;
+        for (i = 2; i < ac; i++)
+                add_string(av[i]);
+        add_string("");
+        char **env;
+        for (env = environ; *env; env++)
+                add_string(*env);
+
+        if (strings_len > ESH_SERVER_MAX_REQUEST) {
+                fprintf(stderr, "%s: request too long\n", av[0]);
+                return 2;
+        }
+
+        struct esh_server_request req = {
+                .magic = ESH_SERVER_MAGIC,
+                .length = strings_len,
+        };
+        int fds[3] = { 0, 1, 2 };
+        union {
+                char buf[CMSG_SPACE(sizeof fds)];
+                struct cmsghdr align;
+        } control;
+        struct iovec iov = { .iov_base = &req, .iov_len = sizeof req };
+        struct msghdr msg = {
+                .msg_iov = &iov, .msg_iovlen = 1,
+                .msg_control = control.buf, .msg_controllen = sizeof control.buf,
+        };
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+
+        ssize_t n;
+        while ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+                continue;
+        if (n == -1 || !write_full(fd, (char *) &req + n, sizeof req - n)
+            || !write_full(fd, strings, strings_len)) {
+                fprintf(stderr, "%s: sending request: %s\n", av[0], strerror(errno));
+                return 2;
+        }
+
+        int32_t status;
+        size_t got = 0;
+        while (got < sizeof status) {
+                n = read(fd, (char *) &status + got, sizeof status - got);
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n <= 0) {
+                        fprintf(stderr, "%s: the server did not report a status\n", av[0]);
+                        return 2;
+                }
+                got += n;
+        }
+        return status;
+}
@@ -0,0 +1,417 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * Tab completion.
+ *
+ * In command position, words complete to builtins, to names plugins
+ * registered through shell.register_completion, and to the executables
+ * on PATH.  Words starting with % complete to job specs.  Anything
+ * else falls back to readline's file name completion.
+ *
+ * The executables are kept in a trie that a background thread builds
+ * when the shell starts or PATH changes, and then keeps up to date by
+ * watching the PATH directories with inotify, so that no keypress
+ * needs to scan a directory.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <readline/readline.h>
+
+#include "esh.h"
+#include "esh-sys-utils.h"
+
+/* Defined in esh.c */
+extern struct esh_shell shell;
+
+/* PATH directories beyond the 64th share the last bit */
+#define MAX_DIR_BITS 64
+
+/* Executables are the nodes whose 'dirs' is not 0 */
+struct trie_node {
+        unsigned char c;
+        uint64_t dirs;                  /* Bit i: found in PATH directory i */
+        struct trie_node *child;        /* First child */
+        struct trie_node *sibling;      /* Next sibling, in increasing c */
+};
+
+/* The state shared with the indexing thread, protected by 'lock' */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trie_node *trie;
+static char *requested_path;    /* PATH to index, or NULL */
+static int wake_fds[2] = { -1, -1 };
+
+/* Main thread only */
+static char *indexed_path;      /* PATH last handed to the thread */
+static char **names;            /* Registered command names */
+static size_t names_count;
+
+/* Indexing thread only */
+static int inotify_fd = -1;
+static int *watches;            /* Watch descriptor of each PATH directory */
+static char **dirs;
+static int dir_count;
+
+static struct trie_node *
+trie_child(struct trie_node *node, unsigned char c, bool create)
+{
+        struct trie_node **p = &node->child;
+        while (*p && (*p)->c < c)
+                p = &(*p)->sibling;
+        if (*p && (*p)->c == c)
+                return *p;
+        if (!create)
+                return NULL;
+
+        struct trie_node *n = calloc(1, sizeof *n);
+        n->c = c;
+        n->sibling = *p;
+        *p = n;
+        return n;
+}
+
+static struct trie_node *
+trie_find(struct trie_node *root, const char *name, bool create)
+{
+        struct trie_node *node = root;
+        for (; node && *name; name++)
+                node = trie_child(node, *name, create);
+        return node;
+}
+
+static void
+trie_free(struct trie_node *node)
+{
+        while (node) {
+                struct trie_node *next = node->sibling;
+                trie_free(node->child);
+                free(node);
+                node = next;
+        }
+}
+
+static uint64_t
+dir_bit(int i)
+{
+        return (uint64_t) 1 << (i < MAX_DIR_BITS ? i : MAX_DIR_BITS - 1);
+}
+
+/* Return true if dir/name is an executable regular file */
+static bool
+is_executable(int dirfd, const char *name)
+{
+        struct stat st;
+        return fstatat(dirfd, name, &st, 0) == 0 && S_ISREG(st.st_mode)
+               && faccessat(dirfd, name, X_OK, 0) == 0;
+}
+
+/* Add the executables in directory i to root */
+static void
+scan_dir(struct trie_node *root, int i)
+{
+        DIR *d = opendir(dirs[i]);
+        if (d == NULL)
+                return;
+
+        struct dirent *ent;
+        while ((ent = readdir(d)) != NULL) {
+                if (ent->d_name[0] == '.')
+                        continue;
+                if (ent->d_type != DT_REG && ent->d_type != DT_LNK
+                    && ent->d_type != DT_UNKNOWN)
+                        continue;
+                if (is_executable(dirfd(d), ent->d_name))
+                        trie_find(root, ent->d_name, true)->dirs |= dir_bit(i);
+        }
+        closedir(d);
+}
+
+/* Index the directories of 'path' and start watching them */
+static void
+rebuild(char *path)
+{
+        int i;
+        if (inotify_fd != -1)
+                close(inotify_fd);
+        for (i = 0; i < dir_count; i++)
+                free(dirs[i]);
+        free(dirs);
+        free(watches);
+
+        inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        dir_count = 0;
+        dirs = malloc((strlen(path) + 1) * sizeof *dirs);
+        watches = malloc((strlen(path) + 1) * sizeof *watches);
+
+        char *save, *dir;
+        for (dir = strtok_r(path, ":", &save); dir; dir = strtok_r(NULL, ":", &save)) {
+                dirs[dir_count] = strdup(dir);
+                watches[dir_count] = inotify_fd == -1 ? -1
+                        : inotify_add_watch(inotify_fd, dir, IN_CREATE | IN_DELETE
+                                            | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB);
+                dir_count++;
+        }
+
+        struct trie_node *root = calloc(1, sizeof *root);
+        for (i = 0; i < dir_count; i++)
+                scan_dir(root, i);
+
+        pthread_mutex_lock(&lock);
+        struct trie_node *old = trie;
+        trie = root;
+        pthread_mutex_unlock(&lock);
+        trie_free(old);
+}
+
+/* Apply the changes inotify reported to the trie */
+static void
+apply_events(void)
+{
+        char buf[8192] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        ssize_t n;
+
+        while ((n = read(inotify_fd, buf, sizeof buf)) > 0) {
+                char *p;
+                for (p = buf; p < buf + n; ) {
+                        struct inotify_event *ev = (struct inotify_event *) p;
+                        p += sizeof *ev + ev->len;
+
+                        int i;
+                        for (i = 0; i < dir_count && watches[i] != ev->wd; i++)
+                                continue;
+                        if (i == dir_count || ev->len == 0 || ev->name[0] == '.')
+                                continue;
+
+                        bool present = false;
+                        if (ev->mask & (IN_CREATE | IN_MOVED_TO | IN_ATTRIB)) {
+                                int dirfd = open(dirs[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                                present = dirfd != -1 && is_executable(dirfd, ev->name);
+                                if (dirfd != -1)
+                                        close(dirfd);
+                        }
+
+                        pthread_mutex_lock(&lock);
+                        struct trie_node *node = trie_find(trie, ev->name, present);
+                        if (node && present)
+                                node->dirs |= dir_bit(i);
+                        else if (node)
+                                node->dirs &= ~dir_bit(i);
+                        pthread_mutex_unlock(&lock);
+                }
+        }
+}
+
+static void *
+index_thread(void *arg)
+{
+        for (;;) {
+                pthread_mutex_lock(&lock);
+                char *path = requested_path;
+                requested_path = NULL;
+                pthread_mutex_unlock(&lock);
+
+                if (path) {
+                        rebuild(path);
+                        free(path);
+                }
+
+                struct pollfd fds[2] = {
+                        { .fd = wake_fds[0], .events = POLLIN },
+                        { .fd = inotify_fd, .events = POLLIN },
+                };
+                if (poll(fds, inotify_fd == -1 ? 1 : 2, -1) == -1 && errno != EINTR)
+                        return NULL;
+
+                if (fds[0].revents & POLLIN) {
+                        char c;
+                        while (read(wake_fds[0], &c, 1) == 1)
+                                continue;
+                }
+                if (inotify_fd != -1 && (fds[1].revents & POLLIN))
+                        apply_events();
+        }
+        return NULL;
+}
+
+/* Have the thread index PATH again if it changed */
+static void
+check_path(void)
+{
+        const char *path = getenv("PATH");
+        if (path == NULL)
+                path = "";
+        if (indexed_path && !strcmp(indexed_path, path))
+                return;
+
+        free(indexed_path);
+        indexed_path = strdup(path);
+
+        pthread_mutex_lock(&lock);
+        free(requested_path);
+        requested_path = strdup(path);
+        pthread_mutex_unlock(&lock);
+
+        if (write(wake_fds[1], "", 1) == -1 && errno != EAGAIN)
+                esh_sys_error("completion: ");
+}
+
+/* The matches of the word being completed */
+static char **matches;
+static size_t matches_count, matches_capacity;
+
+static void
+add_match(const char *word)
+{
+        if (matches_count == matches_capacity) {
+                matches_capacity = matches_capacity ? 2 * matches_capacity : 64;
+                matches = realloc(matches, matches_capacity * sizeof *matches);
+        }
+        matches[matches_count++] = strdup(word);
+}
+
+/* Add the executables below node, whose name so far is word[0..len) */
+static void
+collect(struct trie_node *node, char *word, size_t len, size_t size)
+{
+        for (node = node->child; node; node = node->sibling) {
+                if (len + 2 > size)
+                        return;
+                word[len] = node->c;
+                word[len + 1] = '\0';
+                if (node->dirs)
+                        add_match(word);
+                collect(node, word, len + 1, size);
+        }
+}
+
+static void
+find_commands(const char *text)
+{
+        size_t i, len = strlen(text);
+        for (i = 0; i < names_count; i++)
+                if (!strncmp(names[i], text, len))
+                        add_match(names[i]);
+
+        pthread_mutex_lock(&lock);
+        struct trie_node *node = trie_find(trie, text, false);
+        if (node) {
+                char word[PATH_MAX];
+                snprintf(word, sizeof word, "%s", text);
+                if (node->dirs && *text)
+                        add_match(word);
+                collect(node, word, strlen(word), sizeof word);
+        }
+        pthread_mutex_unlock(&lock);
+}
+
+static void
+find_jobs(const char *text)
+{
+        bool was_blocked = esh_signal_block(SIGCHLD);
+        struct list *jobs = shell.get_jobs();
+        struct list_elem *e;
+        for (e = list_begin(jobs); e != list_end(jobs); e = list_next(e)) {
+                struct esh_pipeline *pipe = list_entry(e, struct esh_pipeline, elem);
+                char spec[16];
+                snprintf(spec, sizeof spec, "%%%d", pipe->jid);
+                if (!strncmp(spec, text, strlen(text)))
+                        add_match(spec);
+        }
+        if (!was_blocked)
+                esh_signal_unblock(SIGCHLD);
+}
+
+static bool completing_command;
+
+static char *
+generate(const char *text, int state)
+{
+        static size_t next;
+        if (state == 0) {
+                while (matches_count > 0)
+                        free(matches[--matches_count]);
+                next = 0;
+                if (*text == '%')
+                        find_jobs(text);
+                else if (completing_command)
+                        find_commands(text);
+        }
+        return next < matches_count ? strdup(matches[next++]) : NULL;
+}
+
+/* Return true if the word at 'start' is where a command name goes */
+static bool
+is_command_position(int start)
+{
+        int i = start - 1;
+        while (i >= 0 && (rl_line_buffer[i] == ' ' || rl_line_buffer[i] == '\t'))
+                i--;
+        return i < 0 || strchr("|;&(`", rl_line_buffer[i]) != NULL;
+}
+
+static char **
+attempt_completion(const char *text, int start, int end)
+{
+        completing_command = is_command_position(start) && strchr(text, '/') == NULL;
+        if (!completing_command && *text != '%')
+                return NULL;
+
+        if (completing_command)
+                check_path();
+
+        /* with no match, readline completes file names */
+        return rl_completion_matches(text, generate);
+}
+
+/* Make 'name' available to completion as a command name */
+void
+esh_complete_register(const char *name)
+{
+        size_t i;
+        for (i = 0; i < names_count; i++)
+                if (!strcmp(names[i], name))
+                        return;
+
+        names = realloc(names, (names_count + 1) * sizeof *names);
+        names[names_count++] = strdup(name);
+}
+
+/* Install the completion function and start indexing PATH */
+void
+esh_complete_init(void)
+{
+        rl_attempted_completion_function = attempt_completion;
+
+        if (pipe2(wake_fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+                esh_sys_error("completion: pipe: ");
+                return;
+        }
+
+        /* signals are for the main thread */
+        sigset_t all, saved;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &saved);
+
+        pthread_t thread;
+        int rc = pthread_create(&thread, NULL, index_thread, NULL);
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+        if (rc != 0) {
+                errno = rc;
+                esh_sys_error("completion: pthread_create: ");
+                return;
+        }
+        pthread_detach(thread);
+        check_path();
+}
@@ -0,0 +1,411 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * The control socket.
+ *
+ * While 'set -o control' is on, the shell listens on a Unix domain
+ * socket, $ESH_CONTROL_SOCKET or ${XDG_RUNTIME_DIR:-/tmp}/esh-<pid>.sock,
+ * through which processes of the same user can manage its jobs.
+ * Each request is a line, and each response is one line that starts
+ * with "ok" or "error":
+ *
+ *     jobs                 ok [{"jid": 1, ...}]    (as 'jobs --json')
+ *     signal JOB SIGNAL    ok                      JOB is N or %N,
+ *                                                  SIGNAL a name or number
+ *     stats                ok {"pid": ..., ...}
+ *     run PIPELINE         ok JID                  runs it in the background;
+ *                                                  builtins are refused
+ *
+ * Connections are served by the shell's event loop, from the main
+ * thread, so requests see the job table as the shell does.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <readline/readline.h>
+
+#include "esh.h"
+#include "esh-sys-utils.h"
+
+/* Defined in esh.c */
+extern struct esh_shell shell;
+
+#define MAX_CLIENTS 32
+#define REQUEST_MAX 4096        /* Longer requests close the connection */
+
+struct client {
+        int fd;                 /* -1 if the slot is free */
+        size_t len;             /* Bytes of the unfinished request in buf */
+        char buf[REQUEST_MAX];
+};
+
+static struct client clients[MAX_CLIENTS];
+static int listen_fd = -1;
+static struct sockaddr_un address;
+static pid_t owner;             /* Process that created the socket */
+
+static struct timespec started;
+static unsigned long connections, requests, rejected;
+
+static void
+close_client(struct client *c)
+{
+        esh_event_remove(c->fd);
+        close(c->fd);
+        c->fd = -1;
+}
+
+/* Send a response line.  Clients must read their responses; one whose
+ * socket buffer is full is disconnected rather than block the shell. */
+static bool
+respond(struct client *c, const char *fmt, ...)
+{
+        char *line;
+        va_list ap;
+        va_start(ap, fmt);
+        int len = vasprintf(&line, fmt, ap);
+        va_end(ap);
+        if (len == -1)
+                return false;
+
+        ssize_t n = send(c->fd, line, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        free(line);
+        if (n != len) {
+                close_client(c);
+                return false;
+        }
+        return true;
+}
+
+static bool
+request_jobs(struct client *c)
+{
+        char *json;
+        size_t size;
+        FILE *out = open_memstream(&json, &size);
+        if (out == NULL)
+                return respond(c, "error %s\n", strerror(errno));
+
+        bool was_blocked = esh_signal_block(SIGCHLD);
+        esh_jobs_print_json(out, shell.get_jobs());
+        if (!was_blocked)
+                esh_signal_unblock(SIGCHLD);
+        fclose(out);
+
+        /* one line per response */
+        char *p;
+        for (p = json; *p; p++)
+                if (*p == '\n')
+                        *p = ' ';
+        while (p > json && p[-1] == ' ')
+                *--p = '\0';
+
+        bool ok = respond(c, "ok %s\n", json);
+        free(json);
+        return ok;
+}
+
+static const struct {
+        const char *name;
+        int sig;
+} signal_names[] = {
+        { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT },
+        { "KILL", SIGKILL }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 },
+        { "TERM", SIGTERM }, { "CONT", SIGCONT }, { "STOP", SIGSTOP },
+        { "TSTP", SIGTSTP }, { NULL, 0 }
+};
+
+/* Return the signal called name, with or without SIG, or by number,
+ * or -1 */
+static int
+parse_signal(const char *name)
+{
+        char *end;
+        long n = strtol(name, &end, 10);
+        if (*name && *end == '\0')
+                return n > 0 && n < NSIG ? n : -1;
+
+        if (!strncasecmp(name, "SIG", 3))
+                name += 3;
+        int i;
+        for (i = 0; signal_names[i].name; i++)
+                if (!strcasecmp(name, signal_names[i].name))
+                        return signal_names[i].sig;
+        return -1;
+}
+
+static bool
+request_signal(struct client *c, char *args)
+{
+        char *job = strtok(args, " \t");
+        char *name = strtok(NULL, " \t");
+        if (job == NULL || name == NULL)
+                return respond(c, "error usage: signal JOB SIGNAL\n");
+
+        int sig = parse_signal(name);
+        if (sig == -1)
+                return respond(c, "error %s: unknown signal\n", name);
+
+        char *end;
+        long jid = strtol(job[0] == '%' ? job + 1 : job, &end, 10);
+
+        bool was_blocked = esh_signal_block(SIGCHLD);
+        struct esh_pipeline *pipe = *end ? NULL : shell.get_job_from_jid(jid);
+        int rc = -1;
+        if (pipe) {
+                rc = kill(-pipe->pgrp, sig);
+                /* as bg would; the reaper does not see stopped jobs continue */
+                if (rc == 0 && sig == SIGCONT && pipe->status == STOPPED)
+                        pipe->status = BACKGROUND;
+        }
+        if (!was_blocked)
+                esh_signal_unblock(SIGCHLD);
+
+        if (pipe == NULL)
+                return respond(c, "error %s: no such job\n", job);
+        if (rc == -1)
+                return respond(c, "error %s\n", strerror(errno));
+        return respond(c, "ok\n");
+}
+
+static bool
+request_stats(struct client *c)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        int count[4] = { 0, 0, 0, 0 };
+        bool was_blocked = esh_signal_block(SIGCHLD);
+        struct list *jobs = shell.get_jobs();
+        struct list_elem *e;
+        for (e = list_begin(jobs); e != list_end(jobs); e = list_next(e))
+                count[list_entry(e, struct esh_pipeline, elem)->status]++;
+        if (!was_blocked)
+                esh_signal_unblock(SIGCHLD);
+
+        int clients_open = 0, i;
+        for (i = 0; i < MAX_CLIENTS; i++)
+                clients_open += clients[i].fd != -1;
+
+        return respond(c, "ok {\"pid\": %d, \"uptime\": %.3f, \"jobs\": %d, "
+                       "\"running\": %d, \"stopped\": %d, \"clients\": %d, "
+                       "\"connections\": %lu, \"rejected\": %lu, \"requests\": %lu}\n",
+                       (int) getpid(),
+                       (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1e9,
+                       count[FOREGROUND] + count[BACKGROUND] + count[STOPPED],
+                       count[BACKGROUND], count[STOPPED], clients_open,
+                       connections, rejected, requests);
+}
+
+static bool
+request_run(struct client *c, char *line)
+{
+        struct esh_command_line *cline = shell.parse_command_line(line);
+        if (cline == NULL)
+                return respond(c, "error syntax error\n");
+        if (list_size(&cline->pipes) != 1) {
+                bool empty = list_empty(&cline->pipes);
+                esh_command_line_free(cline);
+                return respond(c, empty ? "error empty command\n" : "error more than one job\n");
+        }
+        struct esh_pipeline *pipeline = list_entry(list_pop_front(&cline->pipes),
+                                                   struct esh_pipeline, elem);
+        esh_command_line_free(cline);
+
+        /* the job announcement goes above the line being edited */
+        bool editing = RL_ISSTATE(RL_STATE_READCMD);
+        if (editing)
+                rl_clear_visible_line();
+        struct esh_pipeline *job = esh_pipeline_run_job(pipeline);
+        fflush(stdout);
+        if (editing)
+                rl_forced_update_display();
+
+        if (job == NULL) {
+                esh_pipeline_free(pipeline);
+                return respond(c, "error no job launched\n");
+        }
+        return respond(c, "ok %d\n", job->jid);
+}
+
+/* Serve one request line; return false if the client was closed */
+static bool
+serve_request(struct client *c, char *line)
+{
+        requests++;
+        while (isspace((unsigned char) *line))
+                line++;
+
+        char *args = line + strcspn(line, " \t");
+        if (*args)
+                *args++ = '\0';
+
+        if (!strcmp(line, "jobs"))
+                return request_jobs(c);
+        if (!strcmp(line, "signal"))
+                return request_signal(c, args);
+        if (!strcmp(line, "stats"))
+                return request_stats(c);
+        if (!strcmp(line, "run"))
+                return request_run(c, args);
+        return respond(c, "error %s: unknown request\n", line);
+}
+
+static void
+client_readable(int fd, void *arg)
+{
+        struct client *c = arg;
+        ssize_t n = recv(fd, c->buf + c->len, sizeof c->buf - c->len, MSG_DONTWAIT);
+        if (n == -1 && (errno == EAGAIN || errno == EINTR))
+                return;
+        if (n <= 0) {
+                close_client(c);
+                return;
+        }
+        c->len += n;
+
+        char *start = c->buf, *nl;
+        while ((nl = memchr(start, '\n', c->buf + c->len - start)) != NULL) {
+                *nl = '\0';
+                if (nl > start && nl[-1] == '\r')
+                        nl[-1] = '\0';
+                if (!serve_request(c, start))
+                        return;
+                start = nl + 1;
+        }
+
+        c->len -= start - c->buf;
+        memmove(c->buf, start, c->len);
+        if (c->len == sizeof c->buf) {
+                respond(c, "error request too long\n");
+                if (c->fd != -1)
+                        close_client(c);
+        }
+}
+
+static void
+accept_client(int fd, void *arg)
+{
+        int cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (cfd == -1)
+                return;
+
+        /* the socket file's mode is not enough on every system */
+        struct ucred cred;
+        socklen_t len = sizeof cred;
+        if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1
+            || (cred.uid != getuid() && cred.uid != 0)) {
+                rejected++;
+                close(cfd);
+                return;
+        }
+
+        int i;
+        for (i = 0; i < MAX_CLIENTS && clients[i].fd != -1; i++)
+                continue;
+        if (i == MAX_CLIENTS || !esh_event_add(cfd, client_readable, &clients[i])) {
+                rejected++;
+                send(cfd, "error too many clients\n", 23, MSG_DONTWAIT | MSG_NOSIGNAL);
+                close(cfd);
+                return;
+        }
+
+        connections++;
+        clients[i].fd = cfd;
+        clients[i].len = 0;
+}
+
+static void
+close_socket(void)
+{
+        if (listen_fd == -1 || owner != getpid())
+                return;
+
+        int i;
+        for (i = 0; i < MAX_CLIENTS; i++)
+                if (clients[i].fd != -1)
+                        close_client(&clients[i]);
+        esh_event_remove(listen_fd);
+        close(listen_fd);
+        unlink(address.sun_path);
+        listen_fd = -1;
+}
+
+static bool
+open_socket(void)
+{
+        const char *path = esh_var_get("ESH_CONTROL_SOCKET");
+        const char *dir = getenv("XDG_RUNTIME_DIR");
+        address.sun_family = AF_UNIX;
+        int len = path && *path
+                ? snprintf(address.sun_path, sizeof address.sun_path, "%s", path)
+                : snprintf(address.sun_path, sizeof address.sun_path, "%s/esh-%d.sock",
+                           dir && *dir ? dir : "/tmp", (int) getpid());
+        if (len >= (int) sizeof address.sun_path) {
+                fprintf(stderr, "control: %s: socket path too long\n", address.sun_path);
+                return false;
+        }
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (fd == -1) {
+                esh_sys_error("control: socket: ");
+                return false;
+        }
+
+        /* a socket left behind by a shell that crashed, but not a
+         * file or the socket of a shell that is still running */
+        if (!esh_remove_stale_socket("control", address.sun_path)) {
+                close(fd);
+                return false;
+        }
+
+        mode_t mask = umask(0077);
+        int rc = bind(fd, (struct sockaddr *) &address, sizeof address);
+        umask(mask);
+        if (rc == -1 || listen(fd, SOMAXCONN) == -1) {
+                esh_sys_error("control: %s: ", address.sun_path);
+                close(fd);
+                return false;
+        }
+        if (!esh_event_add(fd, accept_client, NULL)) {
+                close(fd);
+                unlink(address.sun_path);
+                return false;
+        }
+
+        listen_fd = fd;
+        owner = getpid();
+        return true;
+}
+
+/* Open or close the control socket according to the control option */
+void
+esh_control_sync(void)
+{
+        static bool initialized;
+        if (!initialized) {
+                int i;
+                for (i = 0; i < MAX_CLIENTS; i++)
+                        clients[i].fd = -1;
+                clock_gettime(CLOCK_MONOTONIC, &started);
+                atexit(close_socket);
+                initialized = true;
+        }
+
+        bool wanted = esh_option_get("control");
+        if (!wanted)
+                close_socket();
+        else if (listen_fd == -1 && !open_socket())
+                esh_option_set("control", false);
+}
@@ -0,0 +1,293 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * Coprocesses.
+ *
+ *     coproc NAME cmd [| cmd ...]
+ *
+ * starts the pipeline as a background job whose standard input and
+ * output are pipes held by the shell, so that a long-lived server such
+ * as bc can answer many requests:
+ *
+ *     sendline NAME words...         writes the words and a newline
+ *     readline-from [-t SECONDS] NAME [VAR]
+ *                                     reads a line, into VAR or stdout
+ *
+ * As in bash, ${NAME[0]} and ${NAME[1]} are the descriptors the shell
+ * reads from and writes to, and NAME_PID is the pid of the last
+ * command.  The job is in the job table like any other; once it has
+ * ended and its output is read to the end, the coprocess is forgotten.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "esh.h"
+#include "esh-sys-utils.h"
+
+struct coproc {
+        struct coproc *next;
+        char *name;
+        int to_fd;              /* Write end of the job's stdin */
+        int from_fd;            /* Read end of the job's stdout */
+        char buf[4096];         /* Read from from_fd, not yet returned */
+        size_t len;
+};
+
+static struct coproc *coprocs;
+
+/* The coprocess being started by esh_coproc_prepare */
+static struct coproc *starting;
+static int child_in = -1, child_out = -1;
+
+static struct coproc *
+find(const char *name)
+{
+        struct coproc *c;
+        for (c = coprocs; c; c = c->next)
+                if (!strcmp(c->name, name))
+                        return c;
+        return NULL;
+}
+
+/* Close c's descriptors and remove it */
+static void
+forget(struct coproc *c)
+{
+        struct coproc **p;
+        for (p = &coprocs; *p != c; p = &(*p)->next)
+                continue;
+        *p = c->next;
+
+        char pid_name[strlen(c->name) + sizeof "_PID"];
+        snprintf(pid_name, sizeof pid_name, "%s_PID", c->name);
+        esh_var_unset(c->name);
+        esh_var_unset(pid_name);
+
+        close(c->to_fd);
+        close(c->from_fd);
+        free(c->name);
+        free(c);
+}
+
+/* Turn a pipeline that starts with 'coproc NAME' into a coprocess:
+ * remove the prefix, connect its ends to new pipes and make it a
+ * background job.  Return false on a usage error. */
+bool
+esh_coproc_prepare(struct esh_pipeline *pipeline)
+{
+        struct esh_command *first = list_entry(list_front(&pipeline->commands),
+                                               struct esh_command, elem);
+        struct esh_command *last = list_entry(list_back(&pipeline->commands),
+                                              struct esh_command, elem);
+        char **argv = first->argv;
+
+        if (argv[1] == NULL || argv[2] == NULL) {
+                fprintf(stderr, "usage: coproc NAME command [args...]\n");
+                return false;
+        }
+        if (argv[1][strspn(argv[1], "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                    "abcdefghijklmnopqrstuvwxyz0123456789_")] != '\0') {
+                fprintf(stderr, "coproc: %s: not a valid name\n", argv[1]);
+                return false;
+        }
+
+        int in[2], out[2];
+        if (esh_pipe_cloexec(in) == -1) {
+                esh_sys_error("coproc: pipe: ");
+                return false;
+        }
+        if (esh_pipe_cloexec(out) == -1) {
+                esh_sys_error("coproc: pipe: ");
+                close(in[0]);
+                close(in[1]);
+                return false;
+        }
+
+        starting = calloc(1, sizeof *starting);
+        starting->name = argv[1];
+        starting->to_fd = in[1];
+        starting->from_fd = out[0];
+        child_in = in[0];
+        child_out = out[1];
+
+        int argc = 0;
+        while (argv[argc])
+                argc++;
+        free(argv[0]);
+        memmove(argv, argv + 2, (argc - 1) * sizeof *argv);
+
+        /* before the user's own redirections, which may override them */
+        struct esh_redirect *r = esh_redirect_create(0, ESH_REDIRECT_DUP, NULL, child_in);
+        r->next = first->redirects;
+        first->redirects = r;
+        r = esh_redirect_create(1, ESH_REDIRECT_DUP, NULL, child_out);
+        r->next = last->redirects;
+        last->redirects = r;
+
+        pipeline->bg_job = true;
+        return true;
+}
+
+/* Called once the pipeline prepared by esh_coproc_prepare is launched */
+void
+esh_coproc_launched(struct esh_pipeline *pipeline)
+{
+        close(child_in);
+        close(child_out);
+        child_in = child_out = -1;
+
+        struct coproc *old = find(starting->name);
+        if (old)
+                forget(old);
+        starting->next = coprocs;
+        coprocs = starting;
+
+        char fds[32];
+        snprintf(fds, sizeof fds, "%d %d", starting->from_fd, starting->to_fd);
+        esh_var_set(starting->name, fds);
+
+        char pid_name[strlen(starting->name) + sizeof "_PID"], pid[16];
+        struct esh_command *last = list_entry(list_back(&pipeline->commands),
+                                              struct esh_command, elem);
+        snprintf(pid_name, sizeof pid_name, "%s_PID", starting->name);
+        snprintf(pid, sizeof pid, "%d", last->pid);
+        esh_var_set(pid_name, pid);
+        starting = NULL;
+}
+
+/* Write all of buf to fd; a coprocess that is gone gives EPIPE rather
+ * than SIGPIPE */
+static bool
+write_all(int fd, const char *buf, size_t len)
+{
+        bool was_blocked = esh_signal_block(SIGPIPE);
+        bool ok = true;
+        while (len > 0) {
+                ssize_t n = write(fd, buf, len);
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n == -1) {
+                        ok = false;
+                        break;
+                }
+                buf += n;
+                len -= n;
+        }
+
+        if (!ok && errno == EPIPE) {
+                sigset_t pipe;
+                struct timespec now = { 0, 0 };
+                sigemptyset(&pipe);
+                sigaddset(&pipe, SIGPIPE);
+                sigtimedwait(&pipe, NULL, &now);
+                errno = EPIPE;
+        }
+        if (!was_blocked)
+                esh_signal_unblock(SIGPIPE);
+        return ok;
+}
+
+/* The sendline builtin: 'sendline NAME words...'.  Return its exit
+ * status. */
+int
+esh_coproc_sendline(char **argv)
+{
+        if (argv[1] == NULL) {
+                fprintf(stderr, "usage: sendline NAME [words...]\n");
+                return 2;
+        }
+        struct coproc *c = find(argv[1]);
+        if (c == NULL) {
+                fprintf(stderr, "sendline: %s: no such coprocess\n", argv[1]);
+                return 1;
+        }
+
+        char *line;
+        size_t len;
+        FILE *f = open_memstream(&line, &len);
+        int i;
+        for (i = 2; argv[i]; i++)
+                fprintf(f, i > 2 ? " %s" : "%s", argv[i]);
+        fputc('\n', f);
+        fclose(f);
+
+        bool ok = write_all(c->to_fd, line, len);
+        free(line);
+        if (!ok) {
+                esh_sys_error("sendline: %s: ", argv[1]);
+                return 1;
+        }
+        return 0;
+}
+
+/* The readline-from builtin: 'readline-from [-t SECONDS] NAME [VAR]'.
+ * Return its exit status: 1 at end of file, 142 on timeout. */
+int
+esh_coproc_readline(char **argv)
+{
+        int timeout_ms = -1;
+        argv++;
+        if (*argv && !strcmp(*argv, "-t") && argv[1]) {
+                timeout_ms = atof(argv[1]) * 1000;
+                argv += 2;
+        }
+        if (argv[0] == NULL) {
+                fprintf(stderr, "usage: readline-from [-t SECONDS] NAME [VAR]\n");
+                return 2;
+        }
+        struct coproc *c = find(argv[0]);
+        if (c == NULL) {
+                fprintf(stderr, "readline-from: %s: no such coprocess\n", argv[0]);
+                return 1;
+        }
+
+        char *newline;
+        while ((newline = memchr(c->buf, '\n', c->len)) == NULL) {
+                /* a line longer than the buffer is returned in parts */
+                if (c->len == sizeof c->buf)
+                        break;
+
+                struct pollfd pfd = { .fd = c->from_fd, .events = POLLIN };
+                int ready = poll(&pfd, 1, timeout_ms);
+                if (ready == -1 && errno == EINTR)
+                        continue;
+                if (ready == 0)
+                        return 142;
+
+                ssize_t n = read(c->from_fd, c->buf + c->len, sizeof c->buf - c->len);
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n == -1)
+                        esh_sys_error("readline-from: %s: ", argv[0]);
+                if (n <= 0) {
+                        /* what is left is the last line */
+                        if (c->len > 0)
+                                break;
+                        forget(c);
+                        return 1;
+                }
+                c->len += n;
+        }
+
+        size_t len = newline ? (size_t) (newline - c->buf) : c->len;
+        char *line = strndup(c->buf, len);
+        if (newline)
+                len++;
+        memmove(c->buf, c->buf + len, c->len - len);
+        c->len -= len;
+
+        if (argv[1])
+                esh_var_set(argv[1], line);
+        else {
+                printf("%s\n", line);
+                fflush(stdout);
+        }
+        free(line);
+        return 0;
+}
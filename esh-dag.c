@@ -0,0 +1,543 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * Dependency graphs of jobs.
+ *
+ *     dag [-j N] [-k] FILE
+ *
+ * reads a make-like description of named jobs from FILE, or from the
+ * standard input if FILE is -:
+ *
+ *     # comment
+ *     gen:
+ *             ./gen.sh > tables.c
+ *     build: gen
+ *             cc -c tables.c
+ *             cc -o prog main.c tables.o
+ *
+ * Each job runs its indented command lines one after another, as if
+ * they were typed with '&' but waited for; a line that fails fails the
+ * job.  Jobs whose dependencies have succeeded are started as soon as
+ * fewer than N (by default, the number of processors) are running, as
+ * quiet background jobs, which the control socket lists and can signal.
+ * A job that stops cannot be resumed while dag holds the prompt, so it
+ * is killed, which fails it.  After
+ * the first failure no new job is started, unless -k is given, in which
+ * case only the jobs that depend on a failed one are skipped.  ^C kills
+ * the jobs that are running.  At the end, the time of each job and the
+ * critical path, the chain of dependencies that took longest, are
+ * printed.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esh.h"
+#include "esh-sys-utils.h"
+
+/* Defined in esh.c */
+extern struct esh_shell shell;
+
+enum node_state { WAITING, RUNNING, SUCCEEDED, FAILED, SKIPPED };
+
+struct node {
+        char *name;
+        char **lines;                   /* Command lines, run in order */
+        int nlines;
+        int *deps;                      /* Indices of the jobs it needs */
+        int ndeps;
+
+        enum node_state state;
+        int next_line;                  /* Next of 'lines' to run */
+        struct esh_command_line *cline; /* Pipelines of the line being
+                                           run that are not launched yet */
+        struct esh_pipeline *job;       /* Job being waited for, or NULL */
+        bool killed;                    /* The job was killed for stopping */
+        int status;                     /* Of the last pipeline that ran */
+        struct timespec start, end;
+};
+
+struct dag {
+        struct node *nodes;
+        int count;
+};
+
+static volatile sig_atomic_t interrupted;
+
+static void
+interrupt_handler(int sig)
+{
+        interrupted = 1;
+}
+
+static double
+seconds(const struct timespec *from, const struct timespec *to)
+{
+        return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static int
+find_node(struct dag *dag, const char *name)
+{
+        int i;
+        for (i = 0; i < dag->count; i++)
+                if (!strcmp(dag->nodes[i].name, name))
+                        return i;
+        return -1;
+}
+
+static void
+dag_free(struct dag *dag)
+{
+        int i, j;
+        for (i = 0; i < dag->count; i++) {
+                struct node *n = &dag->nodes[i];
+                free(n->name);
+                for (j = 0; j < n->nlines; j++)
+                        free(n->lines[j]);
+                free(n->lines);
+                free(n->deps);
+                if (n->cline)
+                        esh_command_line_free(n->cline);
+        }
+        free(dag->nodes);
+}
+
+/* The names of the dependencies of each job, kept while reading */
+struct dep_names {
+        char **names;
+        int count;
+};
+
+/* Read the description in f into dag.  Return false, after saying
+ * why, if it is not valid. */
+static bool
+dag_read(struct dag *dag, FILE *f, const char *file)
+{
+        struct dep_names *deps = NULL;
+        char *line = NULL;
+        size_t size = 0;
+        int lineno = 0;
+        bool ok = true;
+
+        while (ok && getline(&line, &size, f) != -1) {
+                lineno++;
+                line[strcspn(line, "\n")] = '\0';
+
+                char *p = line;
+                while (isspace((unsigned char) *p))
+                        p++;
+                if (*p == '\0' || *p == '#')
+                        continue;
+
+                /* an indented line belongs to the last job */
+                if (p != line) {
+                        if (dag->count == 0) {
+                                fprintf(stderr, "dag: %s:%d: command line outside a job\n",
+                                        file, lineno);
+                                ok = false;
+                                break;
+                        }
+                        struct node *n = &dag->nodes[dag->count - 1];
+                        n->lines = realloc(n->lines, (n->nlines + 1) * sizeof *n->lines);
+                        n->lines[n->nlines++] = strdup(p);
+                        continue;
+                }
+
+                char *colon = strchr(p, ':');
+                if (colon == NULL) {
+                        fprintf(stderr, "dag: %s:%d: expected 'name: dependencies'\n",
+                                file, lineno);
+                        ok = false;
+                        break;
+                }
+                *colon = '\0';
+                char *name = strtok(p, " \t");
+                if (name == NULL || strtok(NULL, " \t") != NULL) {
+                        fprintf(stderr, "dag: %s:%d: a job needs a single name\n",
+                                file, lineno);
+                        ok = false;
+                        break;
+                }
+                if (find_node(dag, name) != -1) {
+                        fprintf(stderr, "dag: %s:%d: job '%s' is defined twice\n",
+                                file, lineno, name);
+                        ok = false;
+                        break;
+                }
+
+                dag->nodes = realloc(dag->nodes, (dag->count + 1) * sizeof *dag->nodes);
+                deps = realloc(deps, (dag->count + 1) * sizeof *deps);
+                memset(&dag->nodes[dag->count], 0, sizeof *dag->nodes);
+                memset(&deps[dag->count], 0, sizeof *deps);
+                dag->nodes[dag->count].name = strdup(name);
+
+                struct dep_names *d = &deps[dag->count];
+                char *dep;
+                for (dep = strtok(colon + 1, " \t"); dep; dep = strtok(NULL, " \t")) {
+                        d->names = realloc(d->names, (d->count + 1) * sizeof *d->names);
+                        d->names[d->count++] = strdup(dep);
+                }
+                dag->count++;
+        }
+        free(line);
+        if (ok && dag->count == 0) {
+                fprintf(stderr, "dag: %s: no jobs\n", file);
+                ok = false;
+        }
+
+        /* the dependencies may be defined after the jobs that need them */
+        int i, j;
+        for (i = 0; i < dag->count; i++) {
+                struct node *n = &dag->nodes[i];
+                n->deps = malloc(deps[i].count * sizeof *n->deps);
+                for (j = 0; j < deps[i].count; j++) {
+                        int k = find_node(dag, deps[i].names[j]);
+                        if (ok && k == -1) {
+                                fprintf(stderr, "dag: %s: job '%s' needs unknown job '%s'\n",
+                                        file, n->name, deps[i].names[j]);
+                                ok = false;
+                        }
+                        n->deps[n->ndeps++] = k;
+                        free(deps[i].names[j]);
+                }
+                free(deps[i].names);
+        }
+        free(deps);
+        return ok;
+}
+
+/* Return false, after naming a job on it, if dag has a cycle */
+static bool
+dag_check_acyclic(struct dag *dag)
+{
+        /* remove the jobs whose dependencies are all removed until none is */
+        bool removed[dag->count];
+        int i, j, left = dag->count;
+        memset(removed, 0, sizeof removed);
+
+        bool progress = true;
+        while (left > 0 && progress) {
+                progress = false;
+                for (i = 0; i < dag->count; i++) {
+                        if (removed[i])
+                                continue;
+                        for (j = 0; j < dag->nodes[i].ndeps; j++)
+                                if (!removed[dag->nodes[i].deps[j]])
+                                        break;
+                        if (j == dag->nodes[i].ndeps) {
+                                removed[i] = true;
+                                left--;
+                                progress = true;
+                        }
+                }
+        }
+        for (i = 0; i < dag->count; i++)
+                if (!removed[i]) {
+                        fprintf(stderr, "dag: job '%s' is on a dependency cycle\n",
+                                dag->nodes[i].name);
+                        return false;
+                }
+        return true;
+}
+
+static void
+finish(struct node *n, enum node_state state)
+{
+        n->state = state;
+        clock_gettime(CLOCK_MONOTONIC, &n->end);
+        if (state == FAILED)
+                fprintf(stderr, "dag: job '%s' failed with status %d\n", n->name, n->status);
+}
+
+/* Move n on as far as it can go without waiting: collect the job it
+ * was waiting for, launch its next pipelines, and finish it when its
+ * last line is done.  SIGCHLD is blocked. */
+static void
+advance(struct node *n)
+{
+        while (n->state == RUNNING) {
+                if (n->job) {
+                        /* dag holds the prompt, so fg cannot resume a job
+                         * that stopped, as one reading the terminal does:
+                         * it is killed, which fails the node */
+                        if (n->job->stages_running > 0
+                            && n->job->stages_stopped == n->job->stages_running && !n->killed) {
+                                fprintf(stderr, "dag: job '%s' stopped; killing it\n", n->name);
+                                killpg(n->job->pgrp, SIGTERM);
+                                killpg(n->job->pgrp, SIGCONT);
+                                n->killed = true;
+                        }
+                        if (n->job->stages_running > 0)
+                                return;
+                        n->status = esh_pipeline_exit_status(n->job);
+                        n->job = NULL;
+                        n->killed = false;
+                }
+
+                if (n->cline && !list_empty(&n->cline->pipes)) {
+                        struct esh_pipeline *pipe = list_entry(list_pop_front(&n->cline->pipes),
+                                                               struct esh_pipeline, elem);
+                        if ((pipe->connector == ESH_CONNECT_AND && n->status != 0)
+                            || (pipe->connector == ESH_CONNECT_OR && n->status == 0)) {
+                                esh_pipeline_free(pipe);
+                                continue;
+                        }
+                        pipe->bg_job = true;
+                        pipe->quiet = true;
+                        if (esh_pipeline_run(pipe, &n->status))
+                                n->job = pipe;
+                        else
+                                esh_pipeline_free(pipe);
+                        esh_signal_block(SIGCHLD);
+                        continue;
+                }
+
+                if (n->cline) {
+                        esh_command_line_free(n->cline);
+                        n->cline = NULL;
+                        if (n->status != 0) {
+                                finish(n, FAILED);
+                                return;
+                        }
+                }
+                if (n->next_line == n->nlines) {
+                        finish(n, SUCCEEDED);
+                        return;
+                }
+
+                n->status = 0;
+                n->cline = shell.parse_command_line(n->lines[n->next_line++]);
+                if (n->cline == NULL) {
+                        n->status = 2;
+                        finish(n, FAILED);
+                        return;
+                }
+        }
+}
+
+/* Kill the jobs of the running nodes */
+static void
+kill_running(struct dag *dag)
+{
+        int i;
+        for (i = 0; i < dag->count; i++) {
+                struct esh_pipeline *job = dag->nodes[i].job;
+                if (dag->nodes[i].state == RUNNING && job && job->pgrp > 0) {
+                        killpg(job->pgrp, SIGTERM);
+                        killpg(job->pgrp, SIGCONT);
+                }
+        }
+}
+
+/* Run the jobs of dag, at most max_running at a time.  Return true
+ * if all of them succeeded. */
+static bool
+dag_run(struct dag *dag, int max_running, bool keep_going)
+{
+        sigset_t mask;
+        sigprocmask(SIG_SETMASK, NULL, &mask);
+        sigdelset(&mask, SIGCHLD);
+
+        struct sigaction sa = { .sa_handler = interrupt_handler }, saved;
+        sigemptyset(&sa.sa_mask);
+        interrupted = 0;
+        sigaction(SIGINT, &sa, &saved);
+
+        bool stopping = false;
+        int i, j;
+        for (;;) {
+                if (interrupted && !stopping) {
+                        fprintf(stderr, "\ndag: interrupted\n");
+                        kill_running(dag);
+                        stopping = true;
+                }
+
+                /* start what can be started, until nothing changes */
+                int running;
+                bool progress;
+                do {
+                        progress = false;
+                        running = 0;
+                        for (i = 0; i < dag->count; i++) {
+                                struct node *n = &dag->nodes[i];
+                                if (n->state == RUNNING) {
+                                        advance(n);
+                                        progress |= n->state != RUNNING;
+                                }
+                                if (n->state == FAILED && !keep_going)
+                                        stopping = true;
+                                running += n->state == RUNNING;
+                        }
+
+                        for (i = 0; i < dag->count && !stopping; i++) {
+                                struct node *n = &dag->nodes[i];
+                                if (n->state != WAITING)
+                                        continue;
+
+                                bool ready = true, doomed = false;
+                                for (j = 0; j < n->ndeps; j++) {
+                                        enum node_state dep = dag->nodes[n->deps[j]].state;
+                                        ready &= dep == SUCCEEDED;
+                                        doomed |= dep == FAILED || dep == SKIPPED;
+                                }
+                                if (doomed) {
+                                        n->state = SKIPPED;
+                                        progress = true;
+                                } else if (ready && running < max_running) {
+                                        n->state = RUNNING;
+                                        clock_gettime(CLOCK_MONOTONIC, &n->start);
+                                        running++;
+                                        progress = true;
+                                }
+                        }
+                } while (progress);
+
+                if (running == 0)
+                        break;
+                esh_event_wait(&mask);
+                /* an event handler may have run commands that unblocked it */
+                esh_signal_block(SIGCHLD);
+        }
+
+        sigaction(SIGINT, &saved, NULL);
+
+        bool ok = !stopping;
+        for (i = 0; i < dag->count; i++)
+                ok &= dag->nodes[i].state == SUCCEEDED;
+        return ok;
+}
+
+/* Print how long each job took and the critical path */
+static void
+dag_report(struct dag *dag, const struct timespec *start, int max_running)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        /* the longest chain ending with each job, in dependency order */
+        double duration[dag->count], chain[dag->count];
+        int via[dag->count], order[dag->count];
+        bool done[dag->count];
+        int i, j, k, n = 0;
+        memset(done, 0, sizeof done);
+        while (n < dag->count) {
+                for (i = 0; i < dag->count; i++) {
+                        if (done[i])
+                                continue;
+                        for (j = 0; j < dag->nodes[i].ndeps; j++)
+                                if (!done[dag->nodes[i].deps[j]])
+                                        break;
+                        if (j < dag->nodes[i].ndeps)
+                                continue;
+
+                        struct node *node = &dag->nodes[i];
+                        bool ran = node->state == SUCCEEDED || node->state == FAILED;
+                        duration[i] = ran ? seconds(&node->start, &node->end) : 0;
+                        chain[i] = duration[i];
+                        via[i] = -1;
+                        for (j = 0; j < node->ndeps; j++) {
+                                k = node->deps[j];
+                                if (duration[i] + chain[k] > chain[i]) {
+                                        chain[i] = duration[i] + chain[k];
+                                        via[i] = k;
+                                }
+                        }
+                        done[i] = true;
+                        order[n++] = i;
+                }
+        }
+
+        static const char *states[] = { "not run", "running", "ok", "failed", "skipped" };
+        printf("dag: %d jobs, at most %d at a time, %.3f s\n", dag->count, max_running,
+               seconds(start, &now));
+        for (i = 0; i < n; i++) {
+                struct node *node = &dag->nodes[order[i]];
+                printf("  %-20s %9.3f s  %s", node->name, duration[order[i]],
+                       states[node->state]);
+                if (node->state == FAILED)
+                        printf(" (%d)", node->status);
+                printf("\n");
+        }
+
+        int last = -1;
+        for (i = 0; i < dag->count; i++)
+                if (last == -1 || chain[i] > chain[last])
+                        last = i;
+        if (last == -1)
+                return;
+
+        /* the path is found backwards */
+        int path[dag->count], len = 0;
+        for (i = last; i != -1; i = via[i])
+                path[len++] = i;
+        printf("critical path %.3f s:", chain[last]);
+        for (i = len - 1; i >= 0; i--)
+                printf(i < len - 1 ? " -> %s" : " %s", dag->nodes[path[i]].name);
+        printf("\n");
+        fflush(stdout);
+}
+
+static int
+usage(void)
+{
+        fprintf(stderr, "usage: dag [-j N] [-k] FILE\n");
+        return 2;
+}
+
+/* The dag builtin: 'dag [-j N] [-k] FILE'.  Return its exit status. */
+int
+esh_dag_builtin(char **argv)
+{
+        int max_running = sysconf(_SC_NPROCESSORS_ONLN);
+        bool keep_going = false;
+
+        for (argv++; *argv && (*argv)[0] == '-' && (*argv)[1] != '\0'; argv++) {
+                if (!strcmp(*argv, "-k")) {
+                        keep_going = true;
+                } else if (!strcmp(*argv, "-j") && argv[1]) {
+                        max_running = atoi(*++argv);
+                        if (max_running < 1)
+                                return usage();
+                } else {
+                        return usage();
+                }
+        }
+        if (argv[0] == NULL || argv[1] != NULL)
+                return usage();
+        if (max_running < 1)
+                max_running = 1;
+
+        FILE *f = strcmp(argv[0], "-") ? fopen(argv[0], "re") : stdin;
+        if (f == NULL) {
+                esh_sys_error("dag: %s: ", argv[0]);
+                return 1;
+        }
+
+        struct dag dag = { NULL, 0 };
+        bool ok = dag_read(&dag, f, argv[0]);
+        if (f != stdin)
+                fclose(f);
+        if (!ok || !dag_check_acyclic(&dag)) {
+                dag_free(&dag);
+                return 2;
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool was_blocked = esh_signal_block(SIGCHLD);
+        ok = dag_run(&dag, max_running, keep_going);
+        if (!was_blocked)
+                esh_signal_unblock(SIGCHLD);
+
+        dag_report(&dag, &start, max_running);
+        int status = interrupted ? 130 : ok ? 0 : 1;
+        dag_free(&dag);
+        return status;
+}
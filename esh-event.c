@@ -0,0 +1,142 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * The shell's event loop.
+ *
+ * Descriptors registered here are served from the main thread while
+ * readline waits for input: readline's rl_getc_function waits for the
+ * terminal and for all registered descriptors at once, and calls the
+ * handlers of those that are ready.  Handlers may therefore use any
+ * shell state, as long as they block SIGCHLD around job list access.
+ * They are also served while the shell waits for a foreground job.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <readline/readline.h>
+
+#include "esh.h"
+
+#define MAX_EVENT_FDS 64
+
+struct event_source {
+        int fd;
+        esh_event_handler handler;
+        void *arg;
+};
+
+static struct event_source sources[MAX_EVENT_FDS];
+static int nsources;
+static pid_t owner;             /* Subshells inherit the sources, not the duty */
+
+/* Call handler(fd, arg) from the main loop whenever fd is readable.
+ * Return false if too many descriptors are registered. */
+bool
+esh_event_add(int fd, esh_event_handler handler, void *arg)
+{
+        /* a subshell that has sources of its own forgets those it inherited */
+        if (owner != getpid())
+                nsources = 0;
+        if (nsources == MAX_EVENT_FDS)
+                return false;
+        sources[nsources].fd = fd;
+        sources[nsources].handler = handler;
+        sources[nsources].arg = arg;
+        nsources++;
+        owner = getpid();
+        return true;
+}
+
+/* Stop watching fd */
+void
+esh_event_remove(int fd)
+{
+        int i;
+        for (i = 0; i < nsources; i++) {
+                if (sources[i].fd == fd) {
+                        sources[i] = sources[--nsources];
+                        return;
+                }
+        }
+}
+
+/* Wait for the registered descriptors and 'extra_fd', if not -1, with
+ * the signal mask 'mask', if not NULL, and run the handlers of those
+ * that are ready.  Return as esh_event_poll. */
+static int
+wait_and_dispatch(int extra_fd, const struct timespec *timeout, const sigset_t *mask)
+{
+        struct pollfd fds[MAX_EVENT_FDS + 1];
+        int i, n = 0;
+
+        for (i = 0; i < nsources && owner == getpid(); i++) {
+                fds[n].fd = sources[i].fd;
+                fds[n++].events = POLLIN;
+        }
+        if (extra_fd != -1) {
+                fds[n].fd = extra_fd;
+                fds[n++].events = POLLIN;
+        }
+
+        if (ppoll(fds, n, timeout, mask) == -1)
+                return errno == EINTR ? -1 : 0;
+
+        /* a handler may add or remove sources, so look each one up again */
+        for (i = 0; i < (extra_fd != -1 ? n - 1 : n); i++) {
+                if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                        continue;
+
+                int j;
+                for (j = 0; j < nsources && sources[j].fd != fds[i].fd; j++)
+                        continue;
+                if (j < nsources)
+                        sources[j].handler(sources[j].fd, sources[j].arg);
+        }
+        return extra_fd != -1 && (fds[n - 1].revents & (POLLIN | POLLHUP | POLLERR));
+}
+
+/* Wait up to timeout_ms (-1: forever) for the registered descriptors
+ * and 'extra_fd', if not -1, and run the handlers of those that are
+ * ready.  Return 1 if extra_fd is readable, 0 if not, and -1 if the
+ * wait was interrupted by a signal. */
+int
+esh_event_poll(int extra_fd, int timeout_ms)
+{
+        struct timespec timeout = { timeout_ms / 1000, timeout_ms % 1000 * 1000000 };
+        return wait_and_dispatch(extra_fd, timeout_ms < 0 ? NULL : &timeout, NULL);
+}
+
+/* Wait for the registered descriptors or for a signal, with the signal
+ * mask 'mask' in effect while waiting, and run the handlers of those
+ * that are ready.  Used to wait for foreground jobs: a SIGCHLD that
+ * 'mask' lets through ends the wait, and cannot be lost between the
+ * check for the job's state and the wait. */
+void
+esh_event_wait(const sigset_t *mask)
+{
+        wait_and_dispatch(-1, NULL, mask);
+}
+
+/* readline's rl_getc_function: serve events until the terminal has
+ * input.  While rl_event_hook is set, readline calls this only once
+ * input is ready, so the hook has to serve the events itself. */
+int
+esh_event_getc(FILE *stream)
+{
+        for (;;) {
+                int ready = esh_event_poll(fileno(stream), -1);
+                if (ready == 1)
+                        break;
+
+                /* readline handles its own signals, such as SIGWINCH,
+                 * in rl_getc */
+                if (ready == -1 && rl_pending_signal())
+                        break;
+        }
+        return rl_getc(stream);
+}
@@ -0,0 +1,491 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * Expansion of words whose value is only known when a command
+ * is launched: command substitutions and process substitutions.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "esh.h"
+#include "esh-sys-utils.h"
+
+/* Characters that separate the words of a substitution's output */
+#define ESH_IFS " \t\n"
+
+/* A growable, NULL-terminated argv under construction */
+struct argv_builder {
+        char **argv;
+        size_t argc;
+        size_t capacity;
+};
+
+static void
+argv_push(struct argv_builder *b, char *word)
+{
+        if (b->argc == b->capacity) {
+                b->capacity = b->capacity ? 2 * b->capacity : 8;
+                b->argv = realloc(b->argv, b->capacity * sizeof *b->argv);
+        }
+        b->argv[b->argc++] = word;
+}
+
+/* A word being put together from pieces */
+struct field {
+        char *text;
+        size_t len;
+        size_t capacity;
+};
+
+static void
+field_append(struct field *f, const char *text, size_t len)
+{
+        if (f->len + len + 1 > f->capacity) {
+                f->capacity = 2 * (f->len + len + 1);
+                f->text = realloc(f->text, f->capacity);
+        }
+        memcpy(f->text + f->len, text, len);
+        f->len += len;
+        f->text[f->len] = '\0';
+}
+
+/* Push the field onto b, if it is not empty, and start a new one */
+static void
+field_push(struct argv_builder *b, struct field *f)
+{
+        if (f->len > 0)
+                argv_push(b, strndup(f->text, f->len));
+        f->len = 0;
+}
+
+/* Read fd until end of file into a malloc'd, NUL-terminated buffer */
+static char *
+read_all(int fd)
+{
+        size_t capacity = 4096, len = 0;
+        char *buf = malloc(capacity);
+
+        for (;;) {
+                ssize_t n = read(fd, buf + len, capacity - len - 1);
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        esh_sys_error("read from command substitution: ");
+                        break;
+                }
+                if (n == 0)
+                        break;
+
+                len += n;
+                if (len + 1 == capacity) {
+                        capacity *= 2;
+                        buf = realloc(buf, capacity);
+                }
+        }
+        buf[len] = '\0';
+        return buf;
+}
+
+/* Builtins that only print, through stdio, and change nothing in the
+ * shell: a substitution of one of these can run in the shell.  Any
+ * other builtin, such as cd, set or fg, must run in a subshell, as
+ * every command of a substitution does. */
+static const char **printing_builtins;
+static size_t nprinting_builtins;
+
+void
+esh_register_printing_builtin(const char *name)
+{
+        printing_builtins = realloc(printing_builtins,
+                                    (nprinting_builtins + 1) * sizeof *printing_builtins);
+        printing_builtins[nprinting_builtins++] = strdup(name);
+}
+
+static bool
+is_printing_builtin(const char *name)
+{
+        static const char *const shell_builtins[] = { "jobs", "history", NULL };
+        const char *const *b;
+        for (b = shell_builtins; *b; b++)
+                if (!strcmp(name, *b))
+                        return true;
+
+        size_t i;
+        for (i = 0; i < nprinting_builtins; i++)
+                if (!strcmp(name, printing_builtins[i]))
+                        return true;
+        return false;
+}
+
+/* If cline consists of a single builtin command that only prints, run
+ * it in the shell with stdout captured in memory, which requires
+ * neither a fork nor a pipe.  Return NULL if cline is not one. */
+static char *
+substitute_builtin(struct esh_command_line *cline)
+{
+        if (list_size(&cline->pipes) != 1)
+                return NULL;
+
+        struct esh_pipeline *pipe = list_entry(list_front(&cline->pipes),
+                                               struct esh_pipeline, elem);
+        if (pipe->bg_job || list_size(&pipe->commands) != 1)
+                return NULL;
+
+        struct esh_command *cmd = list_entry(list_front(&pipe->commands),
+                                             struct esh_command, elem);
+        if (cmd->iored_input || cmd->iored_output || cmd->redirects)
+                return NULL;
+
+        if (!esh_command_expand(cmd) || cmd->argv[0] == NULL || cmd->deferred)
+                return NULL;
+
+        if (!is_printing_builtin(cmd->argv[0]))
+                return NULL;
+
+        char *buf = NULL;
+        size_t len = 0;
+        FILE *capture = open_memstream(&buf, &len);
+        if (capture == NULL)
+                return NULL;
+
+        fflush(stdout);
+        FILE *saved_stdout = stdout;
+        stdout = capture;
+        bool handled = esh_command_run_builtin(cmd);
+        stdout = saved_stdout;
+        fclose(capture);
+
+        if (!handled) {
+                free(buf);
+                return NULL;
+        }
+        return buf;
+}
+
+/* Run cline in a subshell whose stdout is a pipe, and collect
+ * everything written to it. */
+static char *
+substitute_subshell(struct esh_command_line *cline)
+{
+        /* only the subshell's stdout may refer to the write end */
+        int fds[2];
+        if (esh_pipe_cloexec(fds) == -1) {
+                esh_sys_error("pipe: ");
+                return NULL;
+        }
+
+        bool was_blocked = esh_signal_block(SIGCHLD);
+        fflush(stdout);
+
+        pid_t pid = fork();
+        if (pid == -1) {
+                esh_sys_error("fork: ");
+                close(fds[0]);
+                close(fds[1]);
+                if (!was_blocked)
+                        esh_signal_unblock(SIGCHLD);
+                return NULL;
+        }
+
+        if (pid == 0) {
+                /* The shell cannot resume a subshell stopped while it
+                 * is waiting for its output, so do not let it stop. */
+                signal(SIGTSTP, SIG_IGN);
+                if (dup2(fds[1], 1) < 0)
+                        esh_sys_fatal_error("dup2 error");
+
+                esh_job_control = false;
+                esh_command_line_run(cline);
+                fflush(stdout);
+                exit(EXIT_SUCCESS);
+        }
+
+        /* The subshell shares our process group, and thus the terminal:
+         * ^C must end the substitution, not the shell. */
+        void (*saved_sigint)(int) = signal(SIGINT, SIG_IGN);
+        close(fds[1]);
+        char *buf = read_all(fds[0]);
+        close(fds[0]);
+
+        int status;
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+                continue;
+        signal(SIGINT, saved_sigint);
+
+        if (!was_blocked)
+                esh_signal_unblock(SIGCHLD);
+        return buf;
+}
+
+/* Run the command line 'text' and return its output, with trailing
+ * newlines removed, in a malloc'd buffer. */
+char *
+esh_command_substitute(char *text)
+{
+        struct esh_command_line *cline = esh_parse_command_line(text);
+        if (cline == NULL)
+                return NULL;
+
+        char *out = substitute_builtin(cline);
+        if (out == NULL)
+                out = substitute_subshell(cline);
+        esh_command_line_free(cline);
+
+        if (out) {
+                size_t len = strlen(out);
+                while (len > 0 && out[len - 1] == '\n')
+                        out[--len] = '\0';
+        }
+        return out;
+}
+
+/* Expand the word 'text', in which command substitutions, $(...) or
+ * `...`, may be surrounded by other text, onto b.  The output of a
+ * substitution is split into words at blanks; its first and last words
+ * are joined to the text before and after it, so that --prefix=$(pwd)
+ * is a single word.  Return false if a substitution failed. */
+static bool
+expand_substitutions(struct argv_builder *b, const char *text)
+{
+        struct field f = { NULL, 0, 0 };
+        const char *p = text;
+        bool ok = true;
+
+        while (*p && ok) {
+                /* the text up to the next substitution, with its $NAMEs */
+                size_t len = 0;
+                while (p[len] && p[len] != '`' && !(p[len] == '$' && p[len + 1] == '('))
+                        len++;
+                if (len > 0) {
+                        char *literal = strndup(p, len);
+                        char *value = esh_vars_expand(literal);
+                        field_append(&f, value, strlen(value));
+                        free(value);
+                        free(literal);
+                        p += len;
+                }
+                if (*p == '\0')
+                        break;
+
+                /* the substitution; the lexer made sure it is closed */
+                const char *body = p + (*p == '$' ? 2 : 1), *end = body;
+                if (*p == '`') {
+                        end = strchr(body, '`');
+                } else {
+                        int depth = 1;
+                        for (; depth > 0; end++)
+                                depth += *end == '(' ? 1 : *end == ')' ? -1 : 0;
+                        end--;
+                }
+                char *command = strndup(body, end - body);
+                char *out = esh_command_substitute(command);
+                free(command);
+                p = end + 1;
+
+                if (out == NULL) {
+                        ok = false;
+                        break;
+                }
+                const char *o;
+                for (o = out; *o; o++)
+                        if (strchr(ESH_IFS, *o))
+                                field_push(b, &f);
+                        else
+                                field_append(&f, o, 1);
+                free(out);
+        }
+
+        if (ok)
+                field_push(b, &f);
+        free(f.text);
+        return ok;
+}
+
+/* Expand the variables of a redirection's file name or here-string,
+ * which the parser kept as typed.  Only a here-string may be empty. */
+static bool
+expand_target(char **target, bool may_be_empty)
+{
+        if (*target == NULL || strchr(*target, '$') == NULL)
+                return true;
+
+        char *value = esh_vars_expand(*target);
+        if (*value == '\0' && !may_be_empty) {
+                fprintf(stderr, "Missing name for redirect.\n");
+                free(value);
+                return false;
+        }
+        free(*target);
+        *target = value;
+        return true;
+}
+
+/* Replace the command substitutions and the words with variables of
+ * cmd by their expansion, and expand the variables of its
+ * redirections.  Process substitutions are kept, at their new position
+ * in argv, until the command's pipeline is launched.  Return false if
+ * an expansion failed. */
+bool
+esh_command_expand(struct esh_command *cmd)
+{
+        if (!expand_target(&cmd->iored_input, false)
+            || !expand_target(&cmd->iored_output, false))
+                return false;
+        struct esh_redirect *r;
+        for (r = cmd->redirects; r; r = r->next)
+                if (!expand_target(&r->target, r->mode == ESH_REDIRECT_HERESTRING))
+                        return false;
+
+        if (cmd->deferred == NULL)
+                return true;
+
+        struct argv_builder b = { NULL, 0, 0 };
+        struct esh_deferred_word *kept = NULL, **kept_tail = &kept;
+        bool ok = true;
+        int i;
+
+        for (i = 0; cmd->argv[i]; i++) {
+                struct esh_deferred_word *word = cmd->deferred;
+                if (word == NULL || word->index != i) {
+                        argv_push(&b, cmd->argv[i]);
+                        continue;
+                }
+                cmd->deferred = word->next;
+
+                if (word->kind == ESH_WORD_PROCESS_INPUT
+                    || word->kind == ESH_WORD_PROCESS_OUTPUT) {
+                        word->index = b.argc;
+                        word->next = NULL;
+                        *kept_tail = word;
+                        kept_tail = &word->next;
+                        argv_push(&b, cmd->argv[i]);
+                        continue;
+                }
+
+                if (word->kind == ESH_WORD_PARAMETERS) {
+                        /* a word made of unset variables is no word at all */
+                        char *value = esh_vars_expand(cmd->argv[i]);
+                        if (*value)
+                                argv_push(&b, value);
+                        else
+                                free(value);
+                        free(cmd->argv[i]);
+                        free(word);
+                        continue;
+                }
+
+                if (ok)
+                        ok = expand_substitutions(&b, cmd->argv[i]);
+                free(cmd->argv[i]);
+                free(word);
+        }
+        argv_push(&b, NULL);
+
+        free(cmd->argv);
+        cmd->argv = b.argv;
+        cmd->deferred = kept;
+        return ok;
+}
+
+/* Start one process substitution of cmd.  The subshell is placed into
+ * the pipeline's process group, so that job control reaches it. */
+static bool
+start_procsub(struct esh_command *cmd, struct esh_deferred_word *word)
+{
+        struct esh_pipeline *pipeline = cmd->pipeline;
+        char *text = cmd->argv[word->index];
+        bool reads = word->kind == ESH_WORD_PROCESS_INPUT;
+
+        struct esh_command_line *cline = esh_parse_command_line(text);
+        if (cline == NULL)
+                return false;
+
+        /* Only cmd may inherit the shell's end; the launcher clears
+         * FD_CLOEXEC in cmd's child alone. */
+        int fds[2];
+        if (esh_pipe_cloexec(fds) == -1) {
+                esh_sys_error("pipe: ");
+                esh_command_line_free(cline);
+                return false;
+        }
+        /* <(...) writes into the pipe and cmd reads it, >(...) the reverse */
+        int shell_end = reads ? fds[0] : fds[1];
+        int subshell_end = reads ? fds[1] : fds[0];
+
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == -1) {
+                esh_sys_error("fork: ");
+                close(fds[0]);
+                close(fds[1]);
+                esh_command_line_free(cline);
+                return false;
+        }
+
+        if (pid == 0) {
+                if (esh_job_control
+                    && setpgid(0, pipeline->pgrp == -1 ? 0 : pipeline->pgrp) < 0)
+                        esh_sys_fatal_error("setpgid error");
+
+                if (dup2(subshell_end, reads ? 1 : 0) < 0)
+                        esh_sys_fatal_error("dup2 error");
+
+                /* Do not hold other substitutions' pipes open, or their
+                 * readers would never see end of file. */
+                struct list_elem *e = list_begin(&pipeline->procsubs);
+                for (; e != list_end(&pipeline->procsubs); e = list_next(e)) {
+                        struct esh_procsub *other = list_entry(e, struct esh_procsub, elem);
+                        close(other->fd);
+                }
+                close(shell_end);
+
+                esh_job_control = false;
+                esh_command_line_run(cline);
+                fflush(stdout);
+                exit(EXIT_SUCCESS);
+        }
+
+        if (pipeline->pgrp == -1)
+                pipeline->pgrp = pid;
+        if (esh_job_control && setpgid(pid, pipeline->pgrp) < 0 && errno != EACCES)
+                esh_sys_fatal_error("setpgid error");
+
+        close(subshell_end);
+        esh_command_line_free(cline);
+
+        struct esh_procsub *procsub = malloc(sizeof *procsub);
+        procsub->text = text;
+        procsub->pid = pid;
+        procsub->fd = shell_end;
+        procsub->consumer = cmd;
+        procsub->stopped = false;
+        list_push_back(&pipeline->procsubs, &procsub->elem);
+
+        char path[32];
+        snprintf(path, sizeof path, "/dev/fd/%d", shell_end);
+        cmd->argv[word->index] = strdup(path);
+        return true;
+}
+
+/* Start the process substitutions of cmd in the process group of its
+ * pipeline, setting the pipeline's pgrp if it is still -1. */
+bool
+esh_command_start_procsubs(struct esh_command *cmd)
+{
+        bool ok = true;
+
+        while (cmd->deferred) {
+                struct esh_deferred_word *word = cmd->deferred;
+                cmd->deferred = word->next;
+
+                if (ok)
+                        ok = start_procsub(cmd, word);
+                free(word);
+        }
+        return ok;
+}
@@ -0,0 +1,463 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * Pathname expansion of *, ?, [...] and ** in command words.
+ *
+ * Directories are read with getdents64(2) and their listings are kept
+ * in a small cache that is validated against the directory's mtime, so
+ * that loops over the same large directories do not read them again.
+ * Setting ESH_GLOB_CACHE=0 turns the cache off.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "esh.h"
+#include "esh-sys-utils.h"
+
+/* Most directory listings kept in the cache */
+#define DIR_CACHE_MAX 64
+
+/* Layout of the records returned by getdents64(2) */
+struct linux_dirent64 {
+        ino64_t        d_ino;
+        off64_t        d_off;
+        unsigned short d_reclen;
+        unsigned char  d_type;
+        char           d_name[];
+};
+
+struct dir_entry {
+        char *name;
+        unsigned char type;     /* DT_* as reported by getdents64 */
+};
+
+/* The listing of one directory */
+struct dir_listing {
+        struct list_elem elem;  /* Link element in dir_cache, most recent first */
+        char *path;
+        dev_t dev;              /* The directory 'path' named when it was read; */
+        ino_t ino;              /* relative paths name others after a chdir */
+        struct timespec mtime;  /* mtime of the directory when it was read */
+        bool cacheable;         /* False if it changed while it was read */
+        struct dir_entry *entries;
+        size_t count;
+};
+
+static struct list dir_cache;
+static size_t dir_cache_size;
+
+/* A growable array of matching paths */
+struct glob_results {
+        char **paths;
+        size_t count;
+        size_t capacity;
+};
+
+static void
+results_push(struct glob_results *r, char *path)
+{
+        if (r->count == r->capacity) {
+                r->capacity = r->capacity ? 2 * r->capacity : 16;
+                r->paths = realloc(r->paths, r->capacity * sizeof *r->paths);
+        }
+        r->paths[r->count++] = path;
+}
+
+static void
+listing_free(struct dir_listing *listing)
+{
+        size_t i;
+        for (i = 0; i < listing->count; i++)
+                free(listing->entries[i].name);
+        free(listing->entries);
+        free(listing->path);
+        free(listing);
+}
+
+/* Read directory 'path' with getdents64.  Return NULL if it cannot
+ * be opened. */
+static struct dir_listing *
+read_listing(const char *path, struct stat *st)
+{
+        int fd = esh_open_cloexec(path, O_RDONLY | O_DIRECTORY, 0);
+        if (fd == -1)
+                return NULL;
+
+        struct dir_listing *listing = calloc(1, sizeof *listing);
+        listing->path = strdup(path);
+        listing->dev = st->st_dev;
+        listing->ino = st->st_ino;
+        listing->mtime = st->st_mtim;
+
+        size_t capacity = 0;
+        char buf[32768];
+        for (;;) {
+                long n = syscall(SYS_getdents64, fd, buf, sizeof buf);
+                if (n <= 0)
+                        break;
+
+                long off;
+                for (off = 0; off < n; ) {
+                        struct linux_dirent64 *d = (struct linux_dirent64 *) (buf + off);
+                        off += d->d_reclen;
+
+                        if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+                                continue;
+
+                        if (listing->count == capacity) {
+                                capacity = capacity ? 2 * capacity : 64;
+                                listing->entries = realloc(listing->entries,
+                                                   capacity * sizeof *listing->entries);
+                        }
+                        listing->entries[listing->count].name = strdup(d->d_name);
+                        listing->entries[listing->count++].type = d->d_type;
+                }
+        }
+        close(fd);
+
+        /* An mtime that is not safely in the past may not yet reflect a
+         * change made in the same clock tick as this read, so such a
+         * listing is used once and not cached. */
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        listing->cacheable = now.tv_sec > st->st_mtim.tv_sec + 1;
+        return listing;
+}
+
+static bool
+cache_enabled(void)
+{
+        const char *setting = esh_var_get("ESH_GLOB_CACHE");
+        return setting == NULL || strcmp(setting, "0");
+}
+
+/* Return the listing of directory 'path', from the cache if it has
+ * not been modified since.  The caller must release it with
+ * listing_put. */
+static struct dir_listing *
+listing_get(const char *path)
+{
+        struct stat st;
+        if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+                return NULL;
+
+        if (dir_cache.head.next == NULL)
+                list_init(&dir_cache);
+
+        struct list_elem *e;
+        for (e = list_begin(&dir_cache); e != list_end(&dir_cache); e = list_next(e)) {
+                struct dir_listing *listing = list_entry(e, struct dir_listing, elem);
+                if (strcmp(listing->path, path))
+                        continue;
+
+                list_remove(e);
+                dir_cache_size--;
+                if (listing->dev == st.st_dev && listing->ino == st.st_ino
+                    && listing->mtime.tv_sec == st.st_mtim.tv_sec
+                    && listing->mtime.tv_nsec == st.st_mtim.tv_nsec)
+                        return listing;
+
+                listing_free(listing);
+                break;
+        }
+        return read_listing(path, &st);
+}
+
+/* Return a listing to the cache, evicting the least recently used */
+static void
+listing_put(struct dir_listing *listing)
+{
+        if (!listing->cacheable || !cache_enabled()) {
+                listing_free(listing);
+                return;
+        }
+
+        list_push_front(&dir_cache, &listing->elem);
+        if (++dir_cache_size > DIR_CACHE_MAX) {
+                struct list_elem *e = list_pop_back(&dir_cache);
+                listing_free(list_entry(e, struct dir_listing, elem));
+                dir_cache_size--;
+        }
+}
+
+/* Return true if s contains an unescaped glob metacharacter */
+static bool
+has_magic(const char *s)
+{
+        return strpbrk(s, "*?[") != NULL;
+}
+
+/* Match the bracket expression at *pp against c, advancing *pp past
+ * it.  Return -1 if it is not a complete bracket expression. */
+static int
+match_bracket(const char **pp, char c)
+{
+        const char *p = *pp + 1;
+        bool negate = *p == '!' || *p == '^';
+        bool matched = false;
+
+        if (negate)
+                p++;
+        /* a ] right after [ or [! is an ordinary character */
+        const char *first = p;
+        for (; *p && (*p != ']' || p == first); p++) {
+                if (p[1] == '-' && p[2] && p[2] != ']') {
+                        if (c >= p[0] && c <= p[2])
+                                matched = true;
+                        p += 2;
+                } else if (*p == c) {
+                        matched = true;
+                }
+        }
+        if (*p != ']')
+                return -1;
+
+        *pp = p + 1;
+        return matched != negate;
+}
+
+/* Match a file name against a single-component pattern */
+static bool
+match(const char *p, const char *s)
+{
+        const char *star_p = NULL, *star_s = NULL;
+
+        /* leading dots must be matched explicitly */
+        if (*s == '.' && *p != '.')
+                return false;
+
+        while (*s) {
+                if (*p == '*') {
+                        star_p = ++p;
+                        star_s = s;
+                        continue;
+                }
+
+                if (*p == '[') {
+                        const char *q = p;
+                        int r = match_bracket(&q, *s);
+                        if (r == 1) {
+                                p = q;
+                                s++;
+                                continue;
+                        }
+                        if (r == -1 && *s == '[') {
+                                p++;
+                                s++;
+                                continue;
+                        }
+                } else if (*p && (*p == '?' || *p == *s)) {
+                        p++;
+                        s++;
+                        continue;
+                }
+
+                /* mismatch: let the last * absorb one more character */
+                if (star_p == NULL)
+                        return false;
+                p = star_p;
+                s = ++star_s;
+        }
+
+        while (*p == '*')
+                p++;
+        return *p == '\0';
+}
+
+/* Join directory and name into a malloc'd path */
+static char *
+join(const char *dir, const char *name)
+{
+        char *path;
+        if (*dir == '\0')
+                path = strdup(name);
+        else if (!strcmp(dir, "/"))
+                asprintf(&path, "/%s", name);
+        else
+                asprintf(&path, "%s/%s", dir, name);
+        return path;
+}
+
+/* Return true if entry 'e' of directory 'dir' is a directory.
+ * With 'follow' false, symbolic links to directories do not count. */
+static bool
+is_dir(const char *dir, struct dir_entry *e, bool follow)
+{
+        if (e->type == DT_DIR)
+                return true;
+        if (e->type != DT_UNKNOWN && (e->type != DT_LNK || !follow))
+                return false;
+
+        struct stat st;
+        char *path = join(dir, e->name);
+        int rc = follow ? stat(path, &st) : lstat(path, &st);
+        free(path);
+        return rc == 0 && S_ISDIR(st.st_mode);
+}
+
+/* Expand components comp[0..n) of a pattern below directory 'dir'
+ * ("" for the current directory), adding the matches to r. */
+static void
+expand(const char *dir, char **comp, int n, struct glob_results *r)
+{
+        if (n == 0) {
+                results_push(r, strdup(*dir ? dir : "."));
+                return;
+        }
+
+        if (!has_magic(comp[0])) {
+                char *path = join(dir, comp[0]);
+                struct stat st;
+                if (n > 1)
+                        expand(path, comp + 1, n - 1, r);
+                else if (lstat(path, &st) == 0)
+                        results_push(r, strdup(path));
+                free(path);
+                return;
+        }
+
+        struct dir_listing *listing = listing_get(*dir ? dir : ".");
+        if (listing == NULL)
+                return;
+
+        size_t i;
+        if (!strcmp(comp[0], "**")) {
+                /* ** matches zero or more directories; symbolic links
+                 * are not followed, so that loops end */
+                expand(dir, comp + 1, n - 1, r);
+                for (i = 0; i < listing->count; i++) {
+                        struct dir_entry *e = &listing->entries[i];
+                        if (e->name[0] == '.' || !is_dir(*dir ? dir : ".", e, false))
+                                continue;
+
+                        char *path = join(dir, e->name);
+                        expand(path, comp, n, r);
+                        free(path);
+                }
+        } else {
+                for (i = 0; i < listing->count; i++) {
+                        struct dir_entry *e = &listing->entries[i];
+                        if (!match(comp[0], e->name))
+                                continue;
+                        if (n > 1 && !is_dir(*dir ? dir : ".", e, true))
+                                continue;
+
+                        char *path = join(dir, e->name);
+                        if (n > 1)
+                                expand(path, comp + 1, n - 1, r);
+                        else
+                                results_push(r, strdup(path));
+                        free(path);
+                }
+        }
+        listing_put(listing);
+}
+
+static int
+compare_paths(const void *a, const void *b)
+{
+        return strcmp(*(char **) a, *(char **) b);
+}
+
+/* Expand one pattern, adding the sorted matches to r */
+static void
+glob_word(const char *pattern, struct glob_results *r)
+{
+        char *copy = strdup(pattern);
+        char **comp = malloc((strlen(pattern) / 2 + 2) * sizeof *comp);
+        int n = 0;
+
+        char *save, *tok;
+        for (tok = strtok_r(copy, "/", &save); tok; tok = strtok_r(NULL, "/", &save))
+                comp[n++] = tok;
+        /* a trailing slash only matches directories, and is kept */
+        if (n > 0 && pattern[strlen(pattern) - 1] == '/')
+                comp[n++] = "";
+
+        size_t first = r->count;
+        expand(*pattern == '/' ? "/" : "", comp, n, r);
+        qsort(r->paths + first, r->count - first, sizeof *r->paths, compare_paths);
+
+        free(comp);
+        free(copy);
+}
+
+/* Return the number of bytes execve needs for argv and envp */
+static size_t
+exec_size(char **argv, char **envp)
+{
+        size_t size = 0;
+        for (; *argv; argv++)
+                size += strlen(*argv) + 1 + sizeof *argv;
+        for (; *envp; envp++)
+                size += strlen(*envp) + 1 + sizeof *envp;
+        return size + 2 * sizeof *argv;
+}
+
+/* Replace the words of cmd that contain *, ? or [...] by the sorted
+ * paths they match; words without matches are kept as they are.
+ * Return false if the expanded command would exceed ARG_MAX and
+ * cannot be batched. */
+bool
+esh_command_glob(struct esh_command *cmd)
+{
+        struct glob_results r = { NULL, 0, 0 };
+        char *culprit = NULL;
+        int i;
+
+        for (i = 0; cmd->argv[i]; i++) {
+                /* process substitutions are placeholders, not words;
+                 * their indexes already count the paths pushed so far */
+                struct esh_deferred_word *word;
+                bool deferred = false;
+                for (word = cmd->deferred; word; word = word->next)
+                        if (word->index == (int) r.count)
+                                deferred = true;
+
+                size_t before = r.count;
+                if (!deferred && has_magic(cmd->argv[i]))
+                        glob_word(cmd->argv[i], &r);
+
+                if (r.count == before) {
+                        results_push(&r, cmd->argv[i]);
+                } else {
+                        /* deferred words stay at their index */
+                        for (word = cmd->deferred; word; word = word->next)
+                                if (word->index > (int) before)
+                                        word->index += r.count - before - 1;
+                        if (culprit)
+                                free(cmd->argv[i]);
+                        else
+                                culprit = cmd->argv[i];
+                }
+        }
+        results_push(&r, NULL);
+
+        free(cmd->argv);
+        cmd->argv = r.paths;
+        /* batchable commands are split when they are launched */
+        if (culprit == NULL || cmd->batch_jobs > 0) {
+                free(culprit);
+                return true;
+        }
+
+        size_t size = exec_size(cmd->argv, esh_vars_envp());
+        long arg_max = sysconf(_SC_ARG_MAX);
+        bool ok = arg_max == -1 || size <= (size_t) arg_max;
+        if (!ok)
+                fprintf(stderr, "%s: argument list too long: expanding '%s' "
+                        "gives %zu bytes of arguments and environment, "
+                        "but ARG_MAX is %ld\n",
+                        cmd->argv[0], culprit, size, arg_max);
+        free(culprit);
+        return ok;
+}
@@ -24,6 +24,7 @@ int yylex(void);
 #define INVNUL  "Invalid null command."
 #define AMBINP  "Ambiguous input redirect."
 #define AMBOUT  "Ambiguous output redirect."
+#define UNMSUB  "Unterminated substitution."
 
 #include "esh.h"
 
@@ -35,6 +36,8 @@ struct cmd_helper {
     char *iored_input;
     char *iored_output;
     bool append_to_output;
+    struct esh_deferred_word *deferred; /* words expanded at launch time */
+    struct esh_redirect *redirects;     /* redirections in typed order */
 };
 
 /* Initialize cmd_helper and, optionally, set first argv */
@@ -49,6 +52,35 @@ init_cmd(struct cmd_helper *cmd, char *firstcmd,
     cmd->iored_output = iored_output;
     cmd->iored_input = iored_input;
     cmd->append_to_output = append_to_output;
+    cmd->deferred = NULL;
+    cmd->redirects = NULL;
+}
+
+/* Append a list of redirections to those of cmd */
+static void
+add_redirects(struct cmd_helper *cmd, struct esh_redirect *redirects)
+{
+    struct esh_redirect **tail = &cmd->redirects;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = redirects;
+}
+
+/* Append a word whose expansion is deferred until the command is
+ * launched.  'text' serves as its placeholder in argv. */
+static void
+add_deferred_word(struct cmd_helper *cmd, enum esh_word_kind kind, char *text)
+{
+    struct esh_deferred_word *word = malloc(sizeof *word);
+    word->next = NULL;
+    word->kind = kind;
+    word->index = obstack_object_size(&cmd->words) / sizeof (char *);
+    obstack_ptr_grow(&cmd->words, text);
+
+    struct esh_deferred_word **tail = &cmd->deferred;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = word;
 }
 
 /* print error message */
@@ -72,10 +104,13 @@ make_esh_command(struct cmd_helper *cmd)
         return NULL; 
     }
 
-    return esh_command_create(argv,
-                              cmd->iored_input,
-                              cmd->iored_output,
-                              cmd->append_to_output);
+    struct esh_command *pcmd = esh_command_create(argv,
+                                                  cmd->iored_input,
+                                                  cmd->iored_output,
+                                                  cmd->append_to_output);
+    pcmd->deferred = cmd->deferred;
+    pcmd->redirects = cmd->redirects;
+    return pcmd;
 }
 
 /* Called by parser when command line is complete */
@@ -91,7 +126,10 @@ static void yyunput (int c,char *buf_ptr  ) __attribute__((unused));
   struct cmd_helper command;
   struct esh_pipeline * pipe;
   struct esh_command_line * cmdline;
+  struct esh_redirect * redirect;
   char *word;
+  int fd;
+  struct { int fd, source; } dup;
 }
 
 /* Nonterminals */
@@ -99,10 +137,20 @@ static void yyunput (int c,char *buf_ptr  ) __attribute__((unused));
 %type <command> command
 %type <pipe> pipeline
 %type <cmdline> cmd_list
+%type <redirect> redirect
+%type <word> target
 
 /* Terminals */
 %token <word> WORD
+%token <word> PARAM_WORD
+%token <word> SUBST
+%token <word> PROCSUB_IN PROCSUB_OUT
 %token GREATER_GREATER 
+%token <fd> FD_LESS FD_GREATER FD_GREATER_GREATER FD_LESS_GREATER
+%token <dup> FD_DUP
+%token AMP_GREATER AMP_GREATER_GREATER LESS_LESS_LESS
+%token AMP_AMP BAR_BAR
+%token UNTERMINATED
 
 %%
 cmd_line: cmd_list { cmdline_complete($1); }
@@ -136,6 +184,22 @@ cmd_list:	/* Null Command */ { $$ = esh_command_line_create_empty(); }
 
             list_push_back(&$$->pipes, &$3->elem);
         }
+|		cmd_list AMP_AMP pipeline	{ 
+            /* 'a && b' runs b only if a succeeds */
+            esh_pipeline_finish($3);
+            $3->connector = ESH_CONNECT_AND;
+            $$ = $1;
+            list_push_back(&$$->pipes, &$3->elem);
+        }
+|		cmd_list BAR_BAR pipeline	{ 
+            /* 'a || b' runs b only if a fails */
+            esh_pipeline_finish($3);
+            $3->connector = ESH_CONNECT_OR;
+            $$ = $1;
+            list_push_back(&$$->pipes, &$3->elem);
+        }
+|		cmd_list AMP_AMP error	{ p_error(INVNUL); YYABORT; }
+|		cmd_list BAR_BAR error	{ p_error(INVNUL); YYABORT; }
 
 pipeline: command {
             struct esh_command * pcmd = make_esh_command(&$1);
@@ -165,18 +229,47 @@ pipeline: command {
 command:   WORD { 
             init_cmd(&$$, $1, NULL, NULL, false);
         }
+|		PARAM_WORD {
+            init_cmd(&$$, NULL, NULL, NULL, false);
+            add_deferred_word(&$$, ESH_WORD_PARAMETERS, $1);
+        }
+|		SUBST {
+            init_cmd(&$$, NULL, NULL, NULL, false);
+            add_deferred_word(&$$, ESH_WORD_COMMAND_SUBST, $1);
+        }
 |		input   
 |		output
+|		redirect {
+            init_cmd(&$$, NULL, NULL, NULL, false);
+            add_redirects(&$$, $1);
+        }
 |		command WORD {
             $$ = $1;
             obstack_ptr_grow(&$$.words, $2);
 		}
+|		command PARAM_WORD {
+            $$ = $1;
+            add_deferred_word(&$$, ESH_WORD_PARAMETERS, $2);
+		}
+|		command SUBST {
+            $$ = $1;
+            add_deferred_word(&$$, ESH_WORD_COMMAND_SUBST, $2);
+		}
+|		command PROCSUB_IN {
+            $$ = $1;
+            add_deferred_word(&$$, ESH_WORD_PROCESS_INPUT, $2);
+		}
+|		command PROCSUB_OUT {
+            $$ = $1;
+            add_deferred_word(&$$, ESH_WORD_PROCESS_OUTPUT, $2);
+		}
 |		command input {
             obstack_free(&$2.words, NULL);
             /* Error: ambiguous redirect 'a <b <c' */
             if($1.iored_input)   { p_error(AMBINP); YYABORT; }
             $$ = $1; 
             $$.iored_input = $2.iored_input;
+            add_redirects(&$$, $2.redirects);
 		}
 |		command output {
             obstack_free(&$2.words, NULL);
@@ -185,23 +278,73 @@ command:   WORD {
             $$ = $1; 
             $$.iored_output = $2.iored_output;
             $$.append_to_output = $2.append_to_output;
+            add_redirects(&$$, $2.redirects);
+		}
+|		command redirect {
+            $$ = $1;
+            add_redirects(&$$, $2);
 		}
 
-input:	'<' WORD { 
+input:	'<' target { 
             init_cmd(&$$, NULL, $2, NULL, false);
+            add_redirects(&$$, esh_redirect_create(0, ESH_REDIRECT_INPUT, NULL, -1));
         }
 |		'<' error	  { p_error(MISRED); YYABORT; }
 
-output:	'>' WORD { 
+output:	'>' target { 
             init_cmd(&$$, NULL, NULL, $2, false);
+            add_redirects(&$$, esh_redirect_create(1, ESH_REDIRECT_OUTPUT, NULL, -1));
         }
-|		GREATER_GREATER WORD { 
+|		GREATER_GREATER target { 
             init_cmd(&$$, NULL, NULL, $2, true);
+            add_redirects(&$$, esh_redirect_create(1, ESH_REDIRECT_APPEND, NULL, -1));
         }
 		/* Error: missing redirect */
 |		'>' error 	  { p_error(MISRED); YYABORT; }
 |		GREATER_GREATER error { p_error(MISRED); YYABORT; }
 
+redirect: FD_LESS target {
+            $$ = esh_redirect_create($1, ESH_REDIRECT_INPUT, $2, -1);
+        }
+|		FD_GREATER target {
+            $$ = esh_redirect_create($1, ESH_REDIRECT_OUTPUT, $2, -1);
+        }
+|		FD_GREATER_GREATER target {
+            $$ = esh_redirect_create($1, ESH_REDIRECT_APPEND, $2, -1);
+        }
+|		FD_LESS_GREATER target {
+            $$ = esh_redirect_create($1, ESH_REDIRECT_READWRITE, $2, -1);
+        }
+|		FD_DUP {
+            $$ = esh_redirect_create($1.fd, ESH_REDIRECT_DUP, NULL, $1.source);
+        }
+|		AMP_GREATER target {
+            /* &>file is >file 2>&1 */
+            $$ = esh_redirect_create(1, ESH_REDIRECT_OUTPUT, $2, -1);
+            $$->next = esh_redirect_create(2, ESH_REDIRECT_DUP, NULL, 1);
+        }
+|		AMP_GREATER_GREATER target {
+            $$ = esh_redirect_create(1, ESH_REDIRECT_APPEND, $2, -1);
+            $$->next = esh_redirect_create(2, ESH_REDIRECT_DUP, NULL, 1);
+        }
+|		LESS_LESS_LESS target {
+            $$ = esh_redirect_create(0, ESH_REDIRECT_HERESTRING, $2, -1);
+        }
+		/* Error: missing redirect */
+|		FD_LESS error { p_error(MISRED); YYABORT; }
+|		FD_GREATER error { p_error(MISRED); YYABORT; }
+|		FD_GREATER_GREATER error { p_error(MISRED); YYABORT; }
+|		FD_LESS_GREATER error { p_error(MISRED); YYABORT; }
+|		AMP_GREATER error { p_error(MISRED); YYABORT; }
+|		AMP_GREATER_GREATER error { p_error(MISRED); YYABORT; }
+|		LESS_LESS_LESS error { p_error(MISRED); YYABORT; }
+
+/* The file name or here-string of a redirection; its variables are
+ * expanded when the command is launched, so that it sees $? and
+ * assignments made before on the same line */
+target:	WORD
+|		PARAM_WORD
+
 %%
 static char * inputline;    /* currently processed input line */
 #define YY_INPUT(buf,result,max_size) \
@@ -240,6 +383,7 @@ esh_parse_command_line(char * line)
 {
     inputline = line;
     commandline = NULL;
+    BEGIN(INITIAL);
 
     int error = yyparse();
 
@@ -0,0 +1,443 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * Persistent command history.
+ *
+ * The history file ($ESH_HISTFILE, by default ~/.esh_history) is a
+ * sequence of records, each a header followed by the command line,
+ * padded to a multiple of 8 bytes.  Every record is appended with a
+ * single write to a descriptor opened with O_APPEND, so that several
+ * shells can share the file; a reader that finds a torn record skips
+ * to the next header.
+ *
+ * The file is only read when the history is first used.  It is then
+ * mapped into memory and indexed: an array holds the offset of every
+ * record, and a bloom filter of the trigrams of each block of records
+ * lets Ctrl-R skip blocks that cannot contain the search text.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <readline/readline.h>
+#include <readline/history.h>
+
+#include "esh.h"
+#include "esh-sys-utils.h"
+
+#define HIST_MAGIC 0x48687345u  /* "EshH" */
+#define HIST_MAX_LINE 65536
+
+/* Records per bloom filter, and bits per filter */
+#define BLOCK_RECORDS 32
+#define BLOOM_BITS 4096
+#define BLOOM_WORDS (BLOOM_BITS / 64)
+
+/* Entries handed to readline for the arrow keys, unless ESH_HISTSIZE */
+#define DEFAULT_HISTSIZE 1000
+
+struct hist_record {
+        uint32_t magic;
+        uint32_t length;        /* Bytes of command line, without padding */
+        int64_t start;          /* When the line was run, in seconds */
+        uint32_t duration_ms;   /* How long it ran in the foreground */
+        int32_t status;         /* Exit status of its last foreground job,
+                                   or -1 if unknown */
+};
+
+#define PADDED(n) (((n) + 7) & ~(size_t) 7)
+
+/* The mapped history file and its index */
+static int read_fd = -1;
+static char *map;
+static size_t mapped;           /* Bytes of the file that are mapped */
+static size_t parsed;           /* Bytes of the file that are indexed */
+static uint64_t *offsets;       /* Offset of each record */
+static size_t count, capacity;
+static uint64_t (*blooms)[BLOOM_WORDS];
+
+static int append_fd = -1;
+static bool loaded;             /* The tail was handed to readline */
+
+/* The line being run, recorded once it has finished */
+static char *pending;
+static struct timespec pending_start;
+
+static const char *
+history_path(void)
+{
+        static char *path;
+        const char *var = esh_var_get("ESH_HISTFILE");
+        if (var)
+                return *var ? var : NULL;
+
+        if (path == NULL) {
+                const char *home = esh_var_get("HOME");
+                if (home == NULL)
+                        return NULL;
+                asprintf(&path, "%s/.esh_history", home);
+        }
+        return path;
+}
+
+static uint32_t
+trigram_bit(const char *s)
+{
+        uint32_t h = (unsigned char) s[0] * 0x9e3779b1u
+                   ^ (unsigned char) s[1] * 0x85ebca6bu
+                   ^ (unsigned char) s[2] * 0xc2b2ae35u;
+        return (h ^ h >> 15) % BLOOM_BITS;
+}
+
+static struct hist_record *
+record_at(size_t i)
+{
+        return (struct hist_record *) (map + offsets[i]);
+}
+
+static const char *
+record_text(struct hist_record *r)
+{
+        return (const char *) (r + 1);
+}
+
+/* Add the record at offset off to the index */
+static void
+index_record(size_t off)
+{
+        if (count == capacity) {
+                capacity = capacity ? 2 * capacity : 1024;
+                offsets = realloc(offsets, capacity * sizeof *offsets);
+                blooms = realloc(blooms, capacity / BLOCK_RECORDS * sizeof *blooms);
+        }
+        if (count % BLOCK_RECORDS == 0)
+                memset(blooms[count / BLOCK_RECORDS], 0, sizeof *blooms);
+
+        struct hist_record *r = (struct hist_record *) (map + off);
+        const char *text = record_text(r);
+        uint64_t *bloom = blooms[count / BLOCK_RECORDS];
+        size_t i;
+        for (i = 0; i + 3 <= r->length; i++) {
+                uint32_t bit = trigram_bit(text + i);
+                bloom[bit / 64] |= (uint64_t) 1 << bit % 64;
+        }
+        offsets[count++] = off;
+}
+
+/* Map the part of the history file written since the last call, by
+ * this shell or another one, and index it.  Return false if there is
+ * no history file. */
+static bool
+refresh_index(void)
+{
+        if (read_fd == -1) {
+                const char *path = history_path();
+                if (path == NULL)
+                        return false;
+                read_fd = esh_open_cloexec(path, O_RDONLY, 0);
+                if (read_fd == -1)
+                        return false;
+        }
+
+        struct stat st;
+        if (fstat(read_fd, &st) == -1 || (size_t) st.st_size <= mapped)
+                return true;
+
+        char *newmap = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, read_fd, 0);
+        if (newmap == MAP_FAILED) {
+                esh_sys_error("history: mmap: ");
+                return mapped > 0;
+        }
+        if (map)
+                munmap(map, mapped);
+        map = newmap;
+        mapped = st.st_size;
+
+        while (parsed + sizeof(struct hist_record) <= mapped) {
+                struct hist_record *r = (struct hist_record *) (map + parsed);
+                size_t size = sizeof *r + PADDED(r->length);
+                if (r->magic != HIST_MAGIC || r->length > HIST_MAX_LINE) {
+                        /* a torn record: resynchronize at the next header */
+                        parsed += 8;
+                        continue;
+                }
+                if (parsed + size > mapped)
+                        break;
+                index_record(parsed);
+                parsed += size;
+        }
+        return true;
+}
+
+/* Hand the most recent entries to readline, on first use of the arrow
+ * keys or Ctrl-R, so that starting the shell does not read the file. */
+static void
+load_history(void)
+{
+        if (loaded)
+                return;
+        loaded = true;
+
+        if (!refresh_index())
+                return;
+
+        const char *var = esh_var_get("ESH_HISTSIZE");
+        size_t n = var ? strtoul(var, NULL, 10) : DEFAULT_HISTSIZE;
+        size_t i = count > n ? count - n : 0;
+
+        /* lines typed before the first use are in the file already */
+        clear_history();
+        for (; i < count; i++) {
+                struct hist_record *r = record_at(i);
+                char *line = strndup(record_text(r), r->length);
+                add_history(line);
+                free(line);
+        }
+}
+
+/* Return the index of the newest record before 'before' containing
+ * the text q, or -1 */
+static long
+search(const char *q, long before)
+{
+        size_t qlen = strlen(q);
+        uint32_t bits[64];
+        size_t nbits = 0, k;
+
+        for (k = 0; k + 3 <= qlen && nbits < 64; k++)
+                bits[nbits++] = trigram_bit(q + k);
+
+        long i = before - 1;
+        while (i >= 0) {
+                uint64_t *bloom = blooms[i / BLOCK_RECORDS];
+                for (k = 0; k < nbits; k++)
+                        if (!(bloom[bits[k] / 64] & (uint64_t) 1 << bits[k] % 64))
+                                break;
+
+                if (k < nbits) {
+                        /* no record of this block contains every trigram */
+                        i -= i % BLOCK_RECORDS + 1;
+                        continue;
+                }
+
+                struct hist_record *r = record_at(i);
+                if (memmem(record_text(r), r->length, q, qlen))
+                        return i;
+                i--;
+        }
+        return -1;
+}
+
+/* Ctrl-R: incremental search backwards through the whole history file */
+static int
+reverse_search(int count_arg, int key)
+{
+        load_history();
+        refresh_index();
+
+        char query[256] = "";
+        size_t qlen = 0;
+        long match = -1;
+        bool failed = false;
+        char *saved_line = strdup(rl_line_buffer);
+        int saved_point = rl_point;
+
+        for (;;) {
+                rl_message("(%sreverse-i-search)`%s': ", failed ? "failed " : "", query);
+                rl_redisplay();
+
+                int c = rl_read_key();
+                long from = match == -1 ? (long) count : match;
+
+                if (c == CTRL('R')) {
+                        if (qlen == 0 || match == -1)
+                                continue;
+                        /* skip entries identical to the current one */
+                        struct hist_record *cur = record_at(match);
+                        long i = match;
+                        while ((i = search(query, i)) != -1) {
+                                struct hist_record *r = record_at(i);
+                                if (r->length != cur->length
+                                    || memcmp(record_text(r), record_text(cur), r->length))
+                                        break;
+                        }
+                        failed = i == -1;
+                        if (failed)
+                                continue;
+                        match = i;
+                } else if (c == RUBOUT || c == CTRL('H')) {
+                        if (qlen > 0)
+                                query[--qlen] = '\0';
+                        match = qlen ? search(query, count) : -1;
+                        failed = qlen && match == -1;
+                        if (match == -1) {
+                                rl_replace_line(saved_line, 0);
+                                rl_point = saved_point;
+                                continue;
+                        }
+                } else if (c == CTRL('G')) {
+                        rl_replace_line(saved_line, 0);
+                        rl_point = saved_point;
+                        break;
+                } else if (c >= ' ' && c < RUBOUT && qlen + 1 < sizeof query) {
+                        query[qlen++] = c;
+                        query[qlen] = '\0';
+                        /* the current match may still match the longer text */
+                        long i = search(query, from + (match != -1));
+                        failed = i == -1;
+                        if (failed)
+                                continue;
+                        match = i;
+                } else {
+                        /* any other key ends the search and is then executed */
+                        rl_clear_message();
+                        free(saved_line);
+                        if (c == '\r' || c == '\n')
+                                return rl_newline(1, c);
+                        if (c != ESC)
+                                rl_execute_next(c);
+                        return 0;
+                }
+
+                struct hist_record *r = record_at(match);
+                char *line = strndup(record_text(r), r->length);
+                rl_replace_line(line, 0);
+                rl_point = (char *) memmem(line, r->length, query, qlen) - line;
+                free(line);
+        }
+
+        rl_clear_message();
+        free(saved_line);
+        return 0;
+}
+
+static int
+load_and_previous(int count_arg, int key)
+{
+        load_history();
+        return rl_get_previous_history(count_arg, key);
+}
+
+/* Append a record to the history file */
+static void
+append_record(const char *line, time_t start, uint32_t duration_ms, int status)
+{
+        if (append_fd == -1) {
+                const char *path = history_path();
+                if (path == NULL)
+                        return;
+                append_fd = esh_open_cloexec(path, O_WRONLY | O_APPEND | O_CREAT,
+                                             S_IRUSR | S_IWUSR);
+                if (append_fd == -1) {
+                        esh_sys_error("history: %s: ", path);
+                        return;
+                }
+        }
+
+        size_t len = strlen(line);
+        if (len > HIST_MAX_LINE)
+                return;
+
+        size_t size = sizeof(struct hist_record) + PADDED(len);
+        char *buf = calloc(1, size);
+        struct hist_record *r = (struct hist_record *) buf;
+        r->magic = HIST_MAGIC;
+        r->length = len;
+        r->start = start;
+        r->duration_ms = duration_ms;
+        r->status = status;
+        memcpy(buf + sizeof *r, line, len);
+
+        /* one write, so that concurrent appends do not interleave */
+        if (write(append_fd, buf, size) != (ssize_t) size)
+                esh_sys_error("history: write: ");
+        free(buf);
+}
+
+/* Record the pending line with the given status */
+void
+esh_history_finish(int status)
+{
+        if (pending == NULL)
+                return;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long ms = (now.tv_sec - pending_start.tv_sec) * 1000
+                + (now.tv_nsec - pending_start.tv_nsec) / 1000000;
+
+        append_record(pending, time(NULL) - ms / 1000, ms, status);
+        free(pending);
+        pending = NULL;
+}
+
+/* The shell itself; subshells must not record its line when they exit */
+static pid_t shell_pid;
+
+static void
+finish_at_exit(void)
+{
+        if (getpid() == shell_pid)
+                esh_history_finish(-1);
+}
+
+/* readline(3) with a persistent history.  The line returned is
+ * recorded by esh_history_finish once it has been run. */
+char *
+esh_history_readline(const char *prompt)
+{
+        static bool initialized;
+        if (!initialized) {
+                initialized = true;
+                rl_bind_key(CTRL('R'), reverse_search);
+                rl_bind_key(CTRL('P'), load_and_previous);
+                rl_bind_keyseq("\\e[A", load_and_previous);
+                rl_bind_keyseq("\\eOA", load_and_previous);
+                shell_pid = getpid();
+                atexit(finish_at_exit);
+        }
+
+        /* a line that could not be parsed was never finished */
+        esh_history_finish(-1);
+
+        char *line = readline(prompt);
+        if (line == NULL || line[strspn(line, " \t")] == '\0')
+                return line;
+
+        if (loaded)
+                add_history(line);
+        pending = strdup(line);
+        clock_gettime(CLOCK_MONOTONIC, &pending_start);
+        return line;
+}
+
+/* The history builtin: 'history [N]' lists the last N entries, with
+ * when they were run, how long they took and their exit status. */
+void
+esh_history_builtin(char **argv)
+{
+        if (!refresh_index())
+                return;
+
+        size_t n = argv[1] ? strtoul(argv[1], NULL, 10) : 20;
+        size_t i = count > n ? count - n : 0;
+
+        for (; i < count; i++) {
+                struct hist_record *r = record_at(i);
+                time_t start = r->start;
+                char when[32], status[16] = "?";
+
+                strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", localtime(&start));
+                if (r->status != -1)
+                        snprintf(status, sizeof status, "%d", r->status);
+                printf("%6zu  %s  %7.3fs  %3s  %.*s\n", i + 1, when,
+                       r->duration_ms / 1000.0, status, (int) r->length, record_text(r));
+        }
+}
@@ -0,0 +1,326 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * Asynchronous plugin hooks.
+ *
+ * Each plugin with async_hooks gets a bounded queue of events and a
+ * thread that calls its hooks.  Events are queued by the reaper, which
+ * may run in the SIGCHLD handler, so queueing must not lock or
+ * allocate: the queue is a lock-free multi-producer ring in which each
+ * cell carries a sequence number telling whose turn it is, and the
+ * thread is woken with sem_post, which is async-signal-safe.
+ *
+ * With ESH_HOOK_COALESCE, an event that does not fit goes into a
+ * per-job slot instead, where it replaces any earlier event of that
+ * job; later events of the job go there too until the thread has
+ * delivered it, so that events of a job are never reordered.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esh.h"
+#include "esh-sys-utils.h"
+
+#define DEFAULT_QUEUE_SIZE 256
+#define COALESCE_SLOTS 64       /* Jobs that can be coalesced at a time */
+
+struct cell {
+        unsigned long seq;      /* == position: free for that enqueue;
+                                   == position + 1: holds its event */
+        struct esh_hook_event event;
+};
+
+/* A coalesced event */
+enum { SLOT_EMPTY, SLOT_BUSY, SLOT_FULL };
+struct slot {
+        int state;
+        struct esh_hook_event event;
+};
+
+struct hook_queue {
+        struct esh_plugin *plugin;
+        struct cell *cells;
+        unsigned long mask;     /* Number of cells - 1 */
+        unsigned long tail;     /* Next position to enqueue, producers */
+        unsigned long head;     /* Next position to dequeue, thread only */
+        unsigned long dropped;  /* Not yet reported */
+        unsigned long pending;  /* Events queued or coalesced, not yet delivered */
+        sem_t ready;
+        struct slot slots[COALESCE_SLOTS];
+};
+
+static struct hook_queue *queues;
+static int queue_count;
+static pid_t shell_pid;         /* Subshells do not queue events */
+
+/* Append ev to q; return false if q is full */
+static bool
+enqueue(struct hook_queue *q, const struct esh_hook_event *ev)
+{
+        unsigned long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        struct cell *cell;
+        for (;;) {
+                cell = &q->cells[pos & q->mask];
+                unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+                long diff = (long) (seq - pos);
+                if (diff == 0) {
+                        if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                                break;
+                } else if (diff < 0) {
+                        return false;
+                } else {
+                        pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+                }
+        }
+        cell->event = *ev;
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+        return true;
+}
+
+/* Take the oldest event off q; thread only */
+static bool
+dequeue(struct hook_queue *q, struct esh_hook_event *ev)
+{
+        struct cell *cell = &q->cells[q->head & q->mask];
+        if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != q->head + 1)
+                return false;
+        *ev = cell->event;
+        __atomic_store_n(&cell->seq, q->head + q->mask + 1, __ATOMIC_RELEASE);
+        q->head++;
+        return true;
+}
+
+/* Put ev into its job's slot, merging it with a waiting event of the
+ * job.  If 'only_if_waiting', do so only if there is one.  Return false
+ * if it was not stored. */
+static bool
+coalesce(struct hook_queue *q, const struct esh_hook_event *ev, bool only_if_waiting)
+{
+        struct slot *slot = &q->slots[ev->jid % COALESCE_SLOTS];
+        int state = SLOT_FULL;
+        if (!__atomic_compare_exchange_n(&slot->state, &state, SLOT_BUSY, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                if (only_if_waiting || state != SLOT_EMPTY
+                    || !__atomic_compare_exchange_n(&slot->state, &state, SLOT_BUSY, false,
+                                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                        return false;
+                slot->event = *ev;
+                slot->event.coalesced = 0;
+        } else if (slot->event.jid == ev->jid) {
+                unsigned coalesced = slot->event.coalesced + 1;
+                slot->event = *ev;
+                slot->event.coalesced = coalesced;
+        } else {
+                /* another job has the slot */
+                __atomic_store_n(&slot->state, SLOT_FULL, __ATOMIC_RELEASE);
+                return false;
+        }
+        __atomic_store_n(&slot->state, SLOT_FULL, __ATOMIC_RELEASE);
+        return true;
+}
+
+static void
+wait_a_little(void)
+{
+        struct timespec ts = { 0, 100000 };
+        nanosleep(&ts, NULL);
+}
+
+/* Queue ev for the plugin of q according to its policy */
+static void
+post(struct hook_queue *q, const struct esh_hook_event *ev)
+{
+        enum esh_hook_policy policy = q->plugin->async_hooks->policy;
+
+        /* the job's events wait in its slot until it is delivered */
+        if (policy == ESH_HOOK_COALESCE && coalesce(q, ev, true))
+                goto posted;
+
+        __atomic_add_fetch(&q->pending, 1, __ATOMIC_RELAXED);
+        while (!enqueue(q, ev)) {
+                if (policy == ESH_HOOK_BLOCK) {
+                        wait_a_little();
+                } else if (policy == ESH_HOOK_COALESCE && coalesce(q, ev, false)) {
+                        break;
+                } else {
+                        __atomic_sub_fetch(&q->pending, 1, __ATOMIC_RELAXED);
+                        __atomic_add_fetch(&q->dropped, 1, __ATOMIC_RELAXED);
+                        return;
+                }
+        }
+posted:
+        sem_post(&q->ready);
+}
+
+static void
+deliver(struct hook_queue *q, struct esh_hook_event *ev)
+{
+        struct esh_plugin_hooks *hooks = q->plugin->async_hooks;
+        ev->dropped = __atomic_exchange_n(&q->dropped, 0, __ATOMIC_RELAXED);
+
+        if (ev->kind == ESH_HOOK_PIPELINE_FORKED && hooks->pipeline_forked)
+                hooks->pipeline_forked(ev);
+        else if (ev->kind == ESH_HOOK_STATUS_CHANGE && hooks->command_status_change)
+                hooks->command_status_change(ev);
+}
+
+static void *
+hook_thread(void *arg)
+{
+        struct hook_queue *q = arg;
+        struct esh_hook_event ev;
+
+        for (;;) {
+                while (sem_wait(&q->ready) == -1 && errno == EINTR)
+                        continue;
+
+                if (dequeue(q, &ev)) {
+                        deliver(q, &ev);
+                        __atomic_sub_fetch(&q->pending, 1, __ATOMIC_RELEASE);
+                        continue;
+                }
+
+                /* the queue is empty, so the coalesced events are the latest */
+                int i;
+                for (i = 0; i < COALESCE_SLOTS; i++) {
+                        struct slot *slot = &q->slots[i];
+                        int state = SLOT_FULL;
+                        if (!__atomic_compare_exchange_n(&slot->state, &state, SLOT_BUSY, false,
+                                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                                continue;
+                        ev = slot->event;
+                        __atomic_store_n(&slot->state, SLOT_EMPTY, __ATOMIC_RELEASE);
+                        deliver(q, &ev);
+                        __atomic_sub_fetch(&q->pending, 1, __ATOMIC_RELEASE);
+                }
+        }
+        return NULL;
+}
+
+/* Give the threads up to a second to deliver what is queued */
+static void
+flush_queues(void)
+{
+        if (getpid() != shell_pid)
+                return;
+
+        int i, tries;
+        for (i = 0; i < queue_count; i++)
+                for (tries = 0; tries < 10000
+                     && __atomic_load_n(&queues[i].pending, __ATOMIC_ACQUIRE) > 0; tries++)
+                        wait_a_little();
+}
+
+/* Start the threads of the plugins that have async_hooks */
+void
+esh_hooks_start(void)
+{
+        struct list_elem *e;
+        for (e = list_begin(&esh_plugin_list); e != list_end(&esh_plugin_list); e = list_next(e))
+                if (list_entry(e, struct esh_plugin, elem)->async_hooks)
+                        queue_count++;
+        if (queue_count == 0)
+                return;
+
+        queues = calloc(queue_count, sizeof *queues);
+        shell_pid = getpid();
+
+        /* signals are for the main thread */
+        sigset_t all, saved;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &saved);
+
+        int n = 0;
+        for (e = list_begin(&esh_plugin_list); e != list_end(&esh_plugin_list); e = list_next(e)) {
+                struct esh_plugin *plugin = list_entry(e, struct esh_plugin, elem);
+                if (plugin->async_hooks == NULL)
+                        continue;
+
+                struct hook_queue *q = &queues[n];
+                unsigned long size = 1, wanted = plugin->async_hooks->queue_size;
+                if (wanted == 0)
+                        wanted = DEFAULT_QUEUE_SIZE;
+                while (size < wanted)
+                        size *= 2;
+
+                q->plugin = plugin;
+                q->cells = malloc(size * sizeof *q->cells);
+                q->mask = size - 1;
+                unsigned long i;
+                for (i = 0; i < size; i++)
+                        q->cells[i].seq = i;
+                sem_init(&q->ready, 0, 0);
+
+                pthread_t thread;
+                int rc = pthread_create(&thread, NULL, hook_thread, q);
+                if (rc != 0) {
+                        errno = rc;
+                        esh_sys_error("plugin hooks: pthread_create: ");
+                        sem_destroy(&q->ready);
+                        free(q->cells);
+                        memset(q, 0, sizeof *q);
+                        continue;
+                }
+                pthread_detach(thread);
+                n++;
+        }
+        queue_count = n;
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+        atexit(flush_queues);
+}
+
+static void
+fill_event(struct esh_hook_event *ev, enum esh_hook_event_kind kind, struct esh_pipeline *pipe)
+{
+        ev->kind = kind;
+        ev->jid = pipe->jid;
+        ev->pgrp = pipe->pgrp;
+        ev->bg_job = pipe->bg_job;
+        ev->nstages = list_size(&pipe->commands);
+        ev->pid = 0;
+        ev->waitstatus = 0;
+        ev->coalesced = 0;
+        ev->dropped = 0;
+        clock_gettime(CLOCK_REALTIME, &ev->time);
+        esh_pipeline_format(ev->command, sizeof ev->command, pipe);
+}
+
+/* Queue the events for the async hooks.  Async-signal-safe. */
+void
+esh_hooks_pipeline_forked(struct esh_pipeline *pipe)
+{
+        if (queue_count == 0 || getpid() != shell_pid)
+                return;
+
+        struct esh_hook_event ev;
+        fill_event(&ev, ESH_HOOK_PIPELINE_FORKED, pipe);
+        int i;
+        for (i = 0; i < queue_count; i++)
+                if (queues[i].plugin->async_hooks->pipeline_forked)
+                        post(&queues[i], &ev);
+}
+
+void
+esh_hooks_status_change(struct esh_pipeline *pipe, pid_t pid, int waitstatus)
+{
+        if (queue_count == 0 || getpid() != shell_pid)
+                return;
+
+        struct esh_hook_event ev;
+        fill_event(&ev, ESH_HOOK_STATUS_CHANGE, pipe);
+        ev.pid = pid;
+        ev.waitstatus = waitstatus;
+        int i;
+        for (i = 0; i < queue_count; i++)
+                if (queues[i].plugin->async_hooks->command_status_change)
+                        post(&queues[i], &ev);
+}
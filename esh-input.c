@@ -0,0 +1,228 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * The input of builtins.
+ *
+ * Builtins run in the shell, so their redirections are not applied to
+ * file descriptor 0.  A builtin that reads its input opens it with
+ * esh_input_open instead, which looks at the command's redirections:
+ * the last of < file, N<> file, <<< word and 0<&N, or else the shell's
+ * own standard input.  A regular file is mapped into memory, with
+ * madvise(MADV_SEQUENTIAL), and handed out in one piece; pipes and
+ * terminals are read in large blocks.  Either way the builtin sees
+ * blocks or lines that point into the input, without a copy.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "esh.h"
+#include "esh-sys-utils.h"
+
+#define STREAM_BLOCK (64 * 1024)
+
+struct esh_input {
+        int fd;                 /* Descriptor read from, or -1 */
+        bool own_fd;            /* Opened for the builtin, closed with it */
+
+        /* A mapped file or a here-string */
+        const char *data;
+        size_t size, pos;
+        void *map;              /* For munmap, or NULL */
+        size_t map_len;
+        off_t start;            /* Offset of data in fd, for a mapping */
+        char *string;           /* A here-string with its newline */
+
+        /* Streaming */
+        char *buf;
+        size_t buf_size, buf_start, buf_end;
+        bool eof;
+};
+
+/* Map the rest of the regular file fd, if it is one */
+static bool
+try_map(struct esh_input *in)
+{
+        struct stat st;
+        if (fstat(in->fd, &st) == -1 || !S_ISREG(st.st_mode))
+                return false;
+
+        off_t offset = lseek(in->fd, 0, SEEK_CUR);
+        if (offset == -1 || offset > st.st_size)
+                return false;
+
+        in->start = offset;
+        in->size = st.st_size - offset;
+        in->data = "";
+        if (st.st_size == 0 || in->size == 0)
+                return true;
+
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+        if (map == MAP_FAILED)
+                return false;
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        in->map = map;
+        in->map_len = st.st_size;
+        in->data = (char *) map + offset;
+        return true;
+}
+
+/* Open the standard input of builtin cmd.  Return NULL, after saying
+ * why, if it cannot be opened. */
+struct esh_input *
+esh_input_open(struct esh_command *cmd)
+{
+        struct esh_redirect *r, *source = NULL;
+        for (r = cmd->redirects; r; r = r->next)
+                if (r->fd == 0 && r->mode != ESH_REDIRECT_OUTPUT && r->mode != ESH_REDIRECT_APPEND)
+                        source = r;
+
+        struct esh_input *in = calloc(1, sizeof *in);
+        in->fd = 0;
+
+        if (source && source->mode == ESH_REDIRECT_HERESTRING) {
+                in->fd = -1;
+                asprintf(&in->string, "%s\n", source->target);
+                in->data = in->string;
+                in->size = strlen(in->string);
+                return in;
+        }
+        if (source && source->mode == ESH_REDIRECT_DUP) {
+                in->fd = source->dup_source;
+        } else if (source) {
+                const char *file = source->target ? source->target : cmd->iored_input;
+                in->fd = open(file, O_RDONLY | O_CLOEXEC);
+                if (in->fd == -1) {
+                        esh_sys_error("%s: ", file);
+                        free(in);
+                        return NULL;
+                }
+                in->own_fd = true;
+        }
+
+        if (!try_map(in)) {
+                in->data = NULL;
+                in->buf_size = STREAM_BLOCK;
+                in->buf = malloc(in->buf_size);
+        }
+        return in;
+}
+
+/* Read more of a streamed input into its buffer; return false at end
+ * of input or on an error */
+static bool
+fill(struct esh_input *in)
+{
+        if (in->eof)
+                return false;
+
+        /* keep what has not been consumed at the start of the buffer */
+        if (in->buf_start > 0) {
+                memmove(in->buf, in->buf + in->buf_start, in->buf_end - in->buf_start);
+                in->buf_end -= in->buf_start;
+                in->buf_start = 0;
+        }
+        if (in->buf_end == in->buf_size) {
+                in->buf_size *= 2;
+                in->buf = realloc(in->buf, in->buf_size);
+        }
+
+        ssize_t n;
+        while ((n = read(in->fd, in->buf + in->buf_end, in->buf_size - in->buf_end)) == -1
+               && errno == EINTR)
+                continue;
+        if (n == -1)
+                esh_sys_error("read: ");
+        if (n <= 0) {
+                in->eof = true;
+                return false;
+        }
+        in->buf_end += n;
+        return true;
+}
+
+/* Set *data to the next block of input and return its length: all of
+ * a mapped file at once, or what one read returned.  Return 0 at end
+ * of input. */
+ssize_t
+esh_input_read(struct esh_input *in, const char **data)
+{
+        if (in->data) {
+                *data = in->data + in->pos;
+                size_t len = in->size - in->pos;
+                in->pos = in->size;
+                return len;
+        }
+
+        if (in->buf_start == in->buf_end && !fill(in))
+                return 0;
+        *data = in->buf + in->buf_start;
+        size_t len = in->buf_end - in->buf_start;
+        in->buf_start = in->buf_end;
+        return len;
+}
+
+/* Set *line to the next line of input and return its length.  The
+ * line is not NUL-terminated and does not include its newline; it
+ * stays valid until the next call.  Return -1 at end of input. */
+ssize_t
+esh_input_getline(struct esh_input *in, const char **line)
+{
+        if (in->data) {
+                if (in->pos == in->size)
+                        return -1;
+                const char *start = in->data + in->pos;
+                const char *newline = memchr(start, '\n', in->size - in->pos);
+                size_t len = newline ? (size_t) (newline - start) : in->size - in->pos;
+                in->pos += newline ? len + 1 : len;
+                *line = start;
+                return len;
+        }
+
+        size_t scanned = 0;
+        for (;;) {
+                char *start = in->buf + in->buf_start;
+                char *newline = memchr(start + scanned, '\n',
+                                       in->buf_end - in->buf_start - scanned);
+                if (newline) {
+                        size_t len = newline - start;
+                        in->buf_start += len + 1;
+                        *line = start;
+                        return len;
+                }
+                scanned = in->buf_end - in->buf_start;
+                if (!fill(in))
+                        break;
+        }
+
+        /* the last line has no newline */
+        if (in->buf_start == in->buf_end)
+                return -1;
+        *line = in->buf + in->buf_start;
+        size_t len = in->buf_end - in->buf_start;
+        in->buf_start = in->buf_end;
+        return len;
+}
+
+/* Close in.  A descriptor the builtin did not open is left positioned
+ * after what it consumed of a mapping. */
+void
+esh_input_close(struct esh_input *in)
+{
+        if (in->map) {
+                munmap(in->map, in->map_len);
+                if (!in->own_fd)
+                        lseek(in->fd, in->start + in->pos, SEEK_SET);
+        }
+        if (in->own_fd)
+                close(in->fd);
+        free(in->string);
+        free(in->buf);
+        free(in);
+}
@@ -0,0 +1,60 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * Layout of the job table a shell mirrors into the POSIX shared memory
+ * object /esh-<pid> while 'set -o jobshm' is on.  This header has no
+ * other dependencies, so that monitoring tools can include it.
+ *
+ * The table is protected by a sequence lock.  The shell makes 'seq'
+ * odd before it changes the table and even again afterwards.  To take
+ * a consistent snapshot, a reader loads 'seq' (with acquire
+ * semantics), retries while it is odd, copies the table, and retries
+ * if 'seq' changed in the meantime:
+ *
+ *     do {
+ *             while ((s = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE)) & 1)
+ *                     continue;
+ *             memcpy(&copy, t, sizeof copy);
+ *             __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *     } while (__atomic_load_n(&t->seq, __ATOMIC_RELAXED) != s);
+ */
+
+#ifndef __ESH_JOBS_SHM_H
+#define __ESH_JOBS_SHM_H
+
+#include <stdint.h>
+
+#define ESH_JOBS_SHM_MAGIC      0x4553484au     /* "ESHJ" */
+#define ESH_JOBS_SHM_VERSION    1
+#define ESH_JOBS_SHM_MAX_JOBS   64      /* Later jobs are not mirrored */
+#define ESH_JOBS_SHM_MAX_STAGES 8       /* Later stages are not mirrored */
+#define ESH_JOBS_SHM_CMD_MAX    128     /* Longer commands are truncated */
+
+/* Values of esh_jobs_shm_job.status; the same as enum job_status */
+#define ESH_JOBS_SHM_FOREGROUND 0
+#define ESH_JOBS_SHM_RUNNING    1
+#define ESH_JOBS_SHM_STOPPED    2
+#define ESH_JOBS_SHM_DONE       3
+
+struct esh_jobs_shm_job {
+        int32_t jid;
+        int32_t pgrp;
+        int32_t status;
+        int32_t nstages;                /* Pipeline stages, may exceed MAX_STAGES */
+        int32_t pids[ESH_JOBS_SHM_MAX_STAGES];
+        int64_t start_sec;              /* Launch time, CLOCK_REALTIME */
+        int64_t start_nsec;
+        char cmd[ESH_JOBS_SHM_CMD_MAX]; /* NUL-terminated command line */
+};
+
+struct esh_jobs_shm {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t seq;                   /* Odd while the table is changing */
+        int32_t shell_pid;
+        uint32_t njobs;                 /* Valid entries of 'jobs' */
+        uint32_t reserved;
+        struct esh_jobs_shm_job jobs[ESH_JOBS_SHM_MAX_JOBS];
+};
+
+#endif /* __ESH_JOBS_SHM_H */
@@ -0,0 +1,231 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * Machine-readable views of the job table: 'jobs --json', and a copy
+ * of the table in POSIX shared memory for tools that poll many shells.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "esh.h"
+#include "esh-sys-utils.h"
+#include "esh-jobs-shm.h"
+
+static const char *status_names[] = { "foreground", "running", "stopped", "done" };
+
+/* Print s to out as a JSON string */
+static void
+print_json_string(FILE *out, const char *s)
+{
+        putc('"', out);
+        for (; *s; s++) {
+                unsigned char c = *s;
+                if (c == '"' || c == '\\')
+                        fprintf(out, "\\%c", c);
+                else if (c < 0x20)
+                        fprintf(out, "\\u%04x", c);
+                else
+                        putc(c, out);
+        }
+        putc('"', out);
+}
+
+/* Return the CPU time used so far by process pid, in seconds, or 0
+ * if it is gone */
+static double
+cpu_seconds(pid_t pid)
+{
+        char path[64], buf[1024];
+        snprintf(path, sizeof path, "/proc/%d/stat", (int) pid);
+
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+                return 0;
+        ssize_t n = read(fd, buf, sizeof buf - 1);
+        close(fd);
+        if (n <= 0)
+                return 0;
+        buf[n] = '\0';
+
+        /* utime and stime are fields 14 and 15; the command name in
+         * field 2 may contain blanks, so count from its closing ) */
+        char *p = strrchr(buf, ')');
+        unsigned long utime, stime;
+        if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                                &utime, &stime) != 2)
+                return 0;
+        return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/* Print the jobs to out as a JSON array, one object per job */
+void
+esh_jobs_print_json(FILE *out, struct list *jobs)
+{
+        struct list_elem *e;
+        fprintf(out, "[");
+        for (e = list_begin(jobs); e != list_end(jobs); e = list_next(e)) {
+                struct esh_pipeline *pipe = list_entry(e, struct esh_pipeline, elem);
+                double cpu = 0;
+
+                fprintf(out, "%s\n  {\"jid\": %d, \"pgrp\": %d, \"status\": \"%s\", "
+                        "\"background\": %s, \"start_time\": %ld.%03ld, \"stages\": [",
+                        e == list_begin(jobs) ? "" : ",", pipe->jid, (int) pipe->pgrp,
+                        status_names[pipe->status], pipe->bg_job ? "true" : "false",
+                        (long) pipe->started.tv_sec, pipe->started.tv_nsec / 1000000);
+
+                struct list_elem *c;
+                for (c = list_begin(&pipe->commands); c != list_end(&pipe->commands); c = list_next(c)) {
+                        struct esh_command *cmd = list_entry(c, struct esh_command, elem);
+                        fprintf(out, "%s{\"pid\": %d, \"argv\": [",
+                                c == list_begin(&pipe->commands) ? "" : ", ", (int) cmd->pid);
+                        char **argv;
+                        for (argv = cmd->argv; *argv; argv++) {
+                                if (argv != cmd->argv)
+                                        fprintf(out, ", ");
+                                print_json_string(out, *argv);
+                        }
+                        fprintf(out, "]}");
+                        cpu += cpu_seconds(cmd->pid);
+                }
+                fprintf(out, "], \"cpu_time\": %.2f}", cpu);
+        }
+        fprintf(out, "%s]\n", list_empty(jobs) ? "" : "\n");
+}
+
+/* The shared memory copy of the job table, or NULL */
+static struct esh_jobs_shm *table;
+static char table_name[32];
+
+/* Copy the command line of pipe into buf, truncating it.
+ * Async-signal-safe. */
+void
+esh_pipeline_format(char *buf, size_t size, struct esh_pipeline *pipe)
+{
+        size_t len = 0;
+        struct list_elem *c;
+
+        for (c = list_begin(&pipe->commands); c != list_end(&pipe->commands); c = list_next(c)) {
+                struct esh_command *cmd = list_entry(c, struct esh_command, elem);
+                char **argv;
+                for (argv = cmd->argv; *argv; argv++) {
+                        const char *s = *argv;
+                        if (len > 0 && len + 1 < size)
+                                buf[len++] = ' ';
+                        while (*s && len + 1 < size)
+                                buf[len++] = *s++;
+                }
+                if (list_next(c) != list_end(&pipe->commands) && len + 2 < size) {
+                        buf[len++] = ' ';
+                        buf[len++] = '|';
+                }
+        }
+        buf[len] = '\0';
+}
+
+/* Update the shared memory copy of the job table, if there is one.
+ * Async-signal-safe, so that the reaper can call it. */
+void
+esh_jobs_shm_export(struct list *jobs)
+{
+        /* subshells share the mapping, but not the job table */
+        if (table == NULL || table->shell_pid != getpid())
+                return;
+
+        bool was_blocked = esh_signal_block(SIGCHLD);
+        uint32_t seq = table->seq;
+        __atomic_store_n(&table->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        uint32_t n = 0;
+        struct list_elem *e;
+        for (e = list_begin(jobs); e != list_end(jobs) && n < ESH_JOBS_SHM_MAX_JOBS;
+             e = list_next(e)) {
+                struct esh_pipeline *pipe = list_entry(e, struct esh_pipeline, elem);
+                struct esh_jobs_shm_job *job = &table->jobs[n++];
+
+                job->jid = pipe->jid;
+                job->pgrp = pipe->pgrp;
+                job->status = pipe->status;
+                job->nstages = 0;
+                struct list_elem *c;
+                for (c = list_begin(&pipe->commands); c != list_end(&pipe->commands); c = list_next(c)) {
+                        struct esh_command *cmd = list_entry(c, struct esh_command, elem);
+                        if (job->nstages < ESH_JOBS_SHM_MAX_STAGES)
+                                job->pids[job->nstages] = cmd->pid;
+                        job->nstages++;
+                }
+                job->start_sec = pipe->started.tv_sec;
+                job->start_nsec = pipe->started.tv_nsec;
+                esh_pipeline_format(job->cmd, sizeof job->cmd, pipe);
+        }
+        table->njobs = n;
+
+        __atomic_store_n(&table->seq, seq + 2, __ATOMIC_RELEASE);
+        if (!was_blocked)
+                esh_signal_unblock(SIGCHLD);
+}
+
+static void
+remove_table(void)
+{
+        if (table == NULL || table->shell_pid != getpid())
+                return;
+        munmap(table, sizeof *table);
+        shm_unlink(table_name);
+        table = NULL;
+}
+
+/* Create or remove the shared memory object /esh-<pid> according to
+ * the jobshm option */
+void
+esh_jobs_shm_sync(struct list *jobs)
+{
+        bool wanted = esh_option_get("jobshm");
+        if (!wanted) {
+                remove_table();
+                return;
+        }
+        if (table)
+                return;
+
+        snprintf(table_name, sizeof table_name, "/esh-%d", (int) getpid());
+        int fd = shm_open(table_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+                esh_sys_error("shm_open %s: ", table_name);
+                return;
+        }
+        if (ftruncate(fd, sizeof *table) == -1) {
+                esh_sys_error("ftruncate %s: ", table_name);
+                close(fd);
+                shm_unlink(table_name);
+                return;
+        }
+
+        struct esh_jobs_shm *t = mmap(NULL, sizeof *t, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (t == MAP_FAILED) {
+                esh_sys_error("mmap %s: ", table_name);
+                shm_unlink(table_name);
+                return;
+        }
+
+        t->version = ESH_JOBS_SHM_VERSION;
+        t->shell_pid = getpid();
+        static bool registered;
+        if (!registered) {
+                registered = true;
+                atexit(remove_table);
+        }
+        table = t;
+        esh_jobs_shm_export(jobs);
+
+        /* readers check the magic number last */
+        __atomic_store_n(&t->magic, ESH_JOBS_SHM_MAGIC, __ATOMIC_RELEASE);
+}
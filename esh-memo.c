@@ -0,0 +1,662 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * Memoized commands.
+ *
+ *     memo [-e VAR]... [-i PATH]... cmd args [< file]
+ *
+ * runs cmd with its standard output and error captured, then keeps
+ * them and its exit status in a store on disk.  The next time the same
+ * command is run with the same inputs, what it printed is replayed and
+ * nothing is forked.  The key of an entry is a hash of
+ *
+ *   - argv, the working directory and the redirections,
+ *   - the values of the variables named with -e and in ESH_MEMO_ENV,
+ *   - the contents of the files read through < and of here-strings,
+ *   - the size and modification time of the paths named with -i,
+ *
+ * so changing any declared input simply leads to another entry.  The
+ * store is $ESH_MEMO_DIR, or esh/memo in the XDG cache directory.  Each
+ * entry is a directory holding 'stdout', 'stderr' and 'status'; a hit
+ * touches it, and when the store grows beyond ESH_MEMO_SIZE bytes
+ * (64 MiB by default) the least recently used entries are removed.
+ *
+ * On a miss, the command writes into pipes that the shell drains from
+ * its event loop, showing the output as it comes and storing it.  Only
+ * a simple foreground command can be memoized, and it may not write to
+ * files itself.  Commands killed by a signal are not cached, nor are
+ * those that were stopped.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "esh.h"
+#include "esh-sys-utils.h"
+
+#define DEFAULT_STORE_SIZE (64L << 20)
+
+/* Two 64-bit FNV-1a hashes with different offset bases */
+struct hash {
+        uint64_t a, b;
+};
+
+static void
+hash_init(struct hash *h)
+{
+        h->a = 0xcbf29ce484222325ULL;
+        h->b = 0x84222325cbf29ce4ULL;
+}
+
+static void
+hash_bytes(struct hash *h, const void *buf, size_t len)
+{
+        const unsigned char *p = buf;
+        size_t i;
+        for (i = 0; i < len; i++) {
+                h->a = (h->a ^ p[i]) * 0x100000001b3ULL;
+                h->b = (h->b ^ p[i] ^ (i & 0xff)) * 0x100000001b3ULL;
+        }
+}
+
+/* Hash s with its terminating NUL, so that words do not run together */
+static void
+hash_string(struct hash *h, const char *s)
+{
+        hash_bytes(h, s, strlen(s) + 1);
+}
+
+/* Hash the contents of the file path; return false if it cannot be read */
+static bool
+hash_file(struct hash *h, const char *path)
+{
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+                return false;
+
+        char buf[65536];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof buf)) != 0) {
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n == -1)
+                        break;
+                hash_bytes(h, buf, n);
+        }
+        close(fd);
+        return n == 0;
+}
+
+/* One output of a run: what the command writes into the pipe is
+ * shown on 'shown_fd' and stored in 'file' */
+struct stream {
+        int pipe[2];            /* -1 once closed */
+        int file;
+        int shown_fd;
+};
+
+/* A run whose output is being captured, between esh_memo_prepare and
+ * esh_memo_finish */
+static struct {
+        bool active;
+        char *entry;            /* Directory the entry will be stored as */
+        char *tmp;              /* Directory it is written to meanwhile */
+        struct stream out, err;
+        struct esh_pipeline *job;       /* Once it has been stopped, or NULL */
+} pending;
+
+/* Write all of buf to fd, return false on error */
+static bool
+write_all(int fd, const char *buf, size_t len)
+{
+        while (len > 0) {
+                ssize_t n = write(fd, buf, len);
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return false;
+                }
+                buf += n;
+                len -= n;
+        }
+        return true;
+}
+
+/* Return the directory of the store, creating it if needed */
+static char *
+store_dir(void)
+{
+        const char *dir = esh_var_get("ESH_MEMO_DIR");
+        char *path;
+        if (dir && *dir) {
+                path = strdup(dir);
+        } else {
+                const char *cache = esh_var_get("XDG_CACHE_HOME");
+                const char *home = esh_var_get("HOME");
+                if (cache && *cache)
+                        asprintf(&path, "%s/esh/memo", cache);
+                else
+                        asprintf(&path, "%s/.cache/esh/memo", home ? home : "/tmp");
+        }
+
+        /* mkdir -p */
+        char *p;
+        for (p = path + 1; ; p++) {
+                if (*p != '/' && *p != '\0')
+                        continue;
+                char c = *p;
+                *p = '\0';
+                if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+                        esh_sys_error("memo: %s: ", path);
+                        free(path);
+                        return NULL;
+                }
+                *p = c;
+                if (c == '\0')
+                        break;
+        }
+        return path;
+}
+
+/* Hash the variables named in the colon-separated list */
+static void
+hash_env_list(struct hash *h, const char *list)
+{
+        char *copy = strdup(list), *save, *name;
+        for (name = strtok_r(copy, ":", &save); name; name = strtok_r(NULL, ":", &save)) {
+                const char *value = esh_var_get(name);
+                hash_string(h, name);
+                hash_string(h, value ? value : "\001unset");
+        }
+        free(copy);
+}
+
+/* Compute the key of cmd, whose argv no longer has the 'memo' options.
+ * Return false, after saying why, if it cannot be memoized. */
+static bool
+compute_key(struct esh_command *cmd, char **vars, char **paths, char key[33])
+{
+        struct hash h;
+        hash_init(&h);
+
+        char **w;
+        for (w = cmd->argv; *w; w++)
+                hash_string(&h, *w);
+
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof cwd) == NULL) {
+                esh_sys_error("memo: getcwd: ");
+                return false;
+        }
+        hash_string(&h, cwd);
+
+        for (w = vars; *w; w++)
+                hash_env_list(&h, *w);
+        const char *env = esh_var_get("ESH_MEMO_ENV");
+        if (env)
+                hash_env_list(&h, env);
+
+        struct esh_redirect *r;
+        for (r = cmd->redirects; r; r = r->next) {
+                int fields[3] = { r->fd, r->mode, r->dup_source };
+                hash_bytes(&h, fields, sizeof fields);
+
+                const char *file = r->target ? r->target : cmd->iored_input;
+                switch (r->mode) {
+                case ESH_REDIRECT_INPUT:
+                        hash_string(&h, file);
+                        if (!hash_file(&h, file)) {
+                                esh_sys_error("memo: %s: ", file);
+                                return false;
+                        }
+                        break;
+                case ESH_REDIRECT_HERESTRING:
+                        hash_string(&h, r->target);
+                        break;
+                case ESH_REDIRECT_DUP:
+                        break;
+                default:
+                        fprintf(stderr, "memo: a memoized command cannot redirect "
+                                        "its output to a file\n");
+                        return false;
+                }
+        }
+
+        for (w = paths; *w; w++) {
+                struct stat st;
+                hash_string(&h, *w);
+                if (stat(*w, &st) == -1) {
+                        hash_string(&h, "\001missing");
+                        continue;
+                }
+                long fields[5] = { st.st_dev, st.st_ino, st.st_size,
+                                   st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+                hash_bytes(&h, fields, sizeof fields);
+        }
+
+        snprintf(key, 33, "%016llx%016llx", (unsigned long long) h.a,
+                 (unsigned long long) h.b);
+        return true;
+}
+
+/* Copy the file dir/name to fd, from *offset on, and advance *offset */
+static void
+replay_file(const char *dir, const char *name, int fd, off_t *offset)
+{
+        char path[strlen(dir) + strlen(name) + 2];
+        snprintf(path, sizeof path, "%s/%s", dir, name);
+        int in = open(path, O_RDONLY | O_CLOEXEC);
+        if (in == -1)
+                return;
+
+        char buf[65536];
+        ssize_t n;
+        while ((n = pread(in, buf, sizeof buf, *offset)) > 0) {
+                *offset += n;
+                if (!write_all(fd, buf, n))
+                        break;
+        }
+        close(in);
+}
+
+/* Replay the entry dir; return its status, or -1 if it is incomplete */
+static int
+replay(const char *dir)
+{
+        char path[strlen(dir) + sizeof "/status"];
+        snprintf(path, sizeof path, "%s/status", dir);
+        FILE *f = fopen(path, "re");
+        int status;
+        if (f == NULL)
+                return -1;
+        if (fscanf(f, "%d", &status) != 1)
+                status = -1;
+        fclose(f);
+        if (status == -1)
+                return -1;
+
+        /* a hit makes the entry the most recently used */
+        utimensat(AT_FDCWD, dir, NULL, 0);
+
+        off_t out = 0, err = 0;
+        fflush(stdout);
+        fflush(stderr);
+        replay_file(dir, "stdout", STDOUT_FILENO, &out);
+        replay_file(dir, "stderr", STDERR_FILENO, &err);
+        return status;
+}
+
+/* Remove the directory dir and the files in it */
+static void
+remove_entry(const char *dir)
+{
+        DIR *d = opendir(dir);
+        if (d) {
+                struct dirent *de;
+                while ((de = readdir(d)) != NULL)
+                        if (de->d_name[0] != '.')
+                                unlinkat(dirfd(d), de->d_name, 0);
+                closedir(d);
+        }
+        rmdir(dir);
+}
+
+struct entry {
+        char *path;
+        struct timespec used;
+        long size;
+};
+
+static int
+compare_use(const void *a, const void *b)
+{
+        const struct entry *x = a, *y = b;
+        if (x->used.tv_sec != y->used.tv_sec)
+                return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+        if (x->used.tv_nsec != y->used.tv_nsec)
+                return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+        return 0;
+}
+
+/* Remove the least recently used entries of store until its size is
+ * within ESH_MEMO_SIZE */
+static void
+evict(const char *store)
+{
+        const char *limit_text = esh_var_get("ESH_MEMO_SIZE");
+        long limit = limit_text ? atol(limit_text) : DEFAULT_STORE_SIZE;
+
+        DIR *d = opendir(store);
+        if (d == NULL)
+                return;
+
+        struct entry *entries = NULL;
+        size_t count = 0;
+        long total = 0;
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+                /* entries being written start with a dot */
+                if (de->d_name[0] == '.')
+                        continue;
+
+                struct entry e;
+                struct stat st;
+                asprintf(&e.path, "%s/%s", store, de->d_name);
+                if (stat(e.path, &st) == -1) {
+                        free(e.path);
+                        continue;
+                }
+                e.used = st.st_mtim;
+                e.size = 0;
+                static const char *const files[] = { "stdout", "stderr", "status" };
+                size_t i;
+                for (i = 0; i < sizeof files / sizeof files[0]; i++) {
+                        char file[strlen(e.path) + 8];
+                        snprintf(file, sizeof file, "%s/%s", e.path, files[i]);
+                        if (stat(file, &st) == 0)
+                                e.size += st.st_size;
+                }
+
+                entries = realloc(entries, (count + 1) * sizeof *entries);
+                entries[count++] = e;
+                total += e.size;
+        }
+        closedir(d);
+
+        qsort(entries, count, sizeof *entries, compare_use);
+        size_t i;
+        for (i = 0; i < count; i++) {
+                if (total > limit) {
+                        remove_entry(entries[i].path);
+                        total -= entries[i].size;
+                }
+                free(entries[i].path);
+        }
+        free(entries);
+}
+
+/* Show and store what the command has written into s so far; stop
+ * watching s at end of file */
+static void
+drain(struct stream *s)
+{
+        if (s->pipe[0] == -1)
+                return;
+
+        char buf[65536];
+        ssize_t n;
+        while ((n = read(s->pipe[0], buf, sizeof buf)) != 0) {
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n == -1)
+                        return;
+                write_all(s->shown_fd, buf, n);
+                write_all(s->file, buf, n);
+        }
+        esh_event_remove(s->pipe[0]);
+        close(s->pipe[0]);
+        s->pipe[0] = -1;
+}
+
+static void
+stream_readable(int fd, void *arg)
+{
+        drain(arg);
+}
+
+/* Create dir/name for one output of the command, and the pipe it
+ * writes into.  The shell's end does not block. */
+static bool
+open_stream(struct stream *s, const char *dir, const char *name, int shown_fd)
+{
+        char path[strlen(dir) + strlen(name) + 2];
+        snprintf(path, sizeof path, "%s/%s", dir, name);
+        s->shown_fd = shown_fd;
+        s->pipe[0] = s->pipe[1] = -1;
+        s->file = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (s->file == -1)
+                return false;
+        if (esh_pipe_cloexec(s->pipe) == -1) {
+                s->pipe[0] = s->pipe[1] = -1;
+                return false;
+        }
+        fcntl(s->pipe[0], F_SETFL, O_NONBLOCK);
+        return true;
+}
+
+/* Close what is left of s, after showing the rest of its output */
+static void
+close_stream(struct stream *s)
+{
+        if (s->pipe[1] != -1)
+                close(s->pipe[1]);
+        drain(s);
+        if (s->pipe[0] != -1) {
+                esh_event_remove(s->pipe[0]);
+                close(s->pipe[0]);
+        }
+        if (s->file != -1)
+                close(s->file);
+        s->pipe[0] = s->pipe[1] = s->file = -1;
+}
+
+static void
+usage(void)
+{
+        fprintf(stderr, "usage: memo [-e VAR]... [-i PATH]... command [args...]\n");
+}
+
+/* Handle a pipeline that starts with 'memo'.  If the command has been
+ * run with the same inputs before, replay its output, set *status to
+ * its exit status and return false; also return false, with *status 2,
+ * if it cannot be memoized.  Otherwise strip the prefix, arrange for
+ * the output to be captured and return true; esh_memo_finish must be
+ * called once the pipeline is done. */
+bool
+esh_memo_prepare(struct esh_pipeline *pipeline, int *status)
+{
+        struct esh_command *cmd = list_entry(list_front(&pipeline->commands),
+                                             struct esh_command, elem);
+        char **argv = cmd->argv;
+        *status = 2;
+
+        if (list_size(&pipeline->commands) > 1 || pipeline->bg_job) {
+                fprintf(stderr, "memo: only a simple foreground command can be memoized\n");
+                return false;
+        }
+        if (cmd->deferred) {
+                fprintf(stderr, "memo: process substitutions cannot be memoized\n");
+                return false;
+        }
+        if (pending.active) {
+                fprintf(stderr, "memo: a memoized command is already running\n");
+                return false;
+        }
+
+        /* the options, which are kept apart from the command's words */
+        int argc = 0;
+        while (argv[argc])
+                argc++;
+        char *vars[argc + 1], *paths[argc + 1];
+        int nvars = 0, npaths = 0, i = 1;
+        while (argv[i] && argv[i + 1]) {
+                if (!strcmp(argv[i], "-e"))
+                        vars[nvars++] = argv[i + 1];
+                else if (!strcmp(argv[i], "-i"))
+                        paths[npaths++] = argv[i + 1];
+                else
+                        break;
+                i += 2;
+        }
+        vars[nvars] = paths[npaths] = NULL;
+        if (argv[i] == NULL) {
+                usage();
+                return false;
+        }
+
+        char **words = argv + i;
+        char **saved = cmd->argv;
+        cmd->argv = words;
+        char key[33];
+        bool ok = compute_key(cmd, vars, paths, key);
+        cmd->argv = saved;
+        if (!ok)
+                return false;
+
+        char *store = store_dir();
+        if (store == NULL)
+                return false;
+
+        char *entry;
+        asprintf(&entry, "%s/%s", store, key);
+        *status = replay(entry);
+        if (*status != -1) {
+                free(entry);
+                free(store);
+                return false;
+        }
+
+        char *tmp;
+        asprintf(&tmp, "%s/.%s.%d", store, key, getpid());
+        free(store);
+        remove_entry(tmp);
+        if (mkdir(tmp, 0700) == -1) {
+                esh_sys_error("memo: %s: ", tmp);
+                free(entry);
+                free(tmp);
+                *status = 1;
+                return false;
+        }
+        struct stream out, err;
+        bool opened = open_stream(&out, tmp, "stdout", STDOUT_FILENO);
+        err.pipe[0] = err.pipe[1] = err.file = -1;
+        if (!opened || !open_stream(&err, tmp, "stderr", STDERR_FILENO)) {
+                esh_sys_error("memo: %s: ", tmp);
+                close_stream(&out);
+                close_stream(&err);
+                remove_entry(tmp);
+                free(entry);
+                free(tmp);
+                *status = 1;
+                return false;
+        }
+
+        /* the options were used, the prefix goes */
+        for (; argv < words; argv++)
+                free(*argv);
+        memmove(cmd->argv, words, (argc - i + 1) * sizeof *words);
+
+        /* before the user's own redirections, so that 2>&1 still works */
+        struct esh_redirect *r = esh_redirect_create(2, ESH_REDIRECT_DUP, NULL, err.pipe[1]);
+        r->next = cmd->redirects;
+        cmd->redirects = r;
+        r = esh_redirect_create(1, ESH_REDIRECT_DUP, NULL, out.pipe[1]);
+        r->next = cmd->redirects;
+        cmd->redirects = r;
+
+        pending.active = true;
+        pending.entry = entry;
+        pending.tmp = tmp;
+        pending.out = out;
+        pending.err = err;
+        pending.job = NULL;
+        return true;
+}
+
+/* Called once the pipeline prepared by esh_memo_prepare has been
+ * launched: the command has its own copies of the pipes, which the
+ * shell drains from now on */
+void
+esh_memo_launched(void)
+{
+        close(pending.out.pipe[1]);
+        close(pending.err.pipe[1]);
+        pending.out.pipe[1] = pending.err.pipe[1] = -1;
+        esh_event_add(pending.out.pipe[0], stream_readable, &pending.out);
+        esh_event_add(pending.err.pipe[0], stream_readable, &pending.err);
+}
+
+/* Forget the run prepared by esh_memo_prepare, which was not launched */
+void
+esh_memo_cancel(void)
+{
+        if (!pending.active)
+                return;
+        close_stream(&pending.out);
+        close_stream(&pending.err);
+        remove_entry(pending.tmp);
+        free(pending.entry);
+        free(pending.tmp);
+        pending.active = false;
+}
+
+/* Called when the foreground wait for the memoized command is over:
+ * show the rest of what it printed and store it, if it exited.  If it
+ * was stopped, its output is drained and kept until it ends. */
+void
+esh_memo_finish(struct esh_pipeline *pipeline)
+{
+        struct esh_command *cmd = list_entry(list_front(&pipeline->commands),
+                                             struct esh_command, elem);
+        if (!pending.active)
+                return;
+
+        fflush(stdout);
+        fflush(stderr);
+        drain(&pending.out);
+        drain(&pending.err);
+
+        /* a stopped command is not cached, even once it exits */
+        if (pipeline->stages_running > 0) {
+                pending.job = pipeline;
+                return;
+        }
+        close_stream(&pending.out);
+        close_stream(&pending.err);
+        bool cache = pending.job == NULL && WIFEXITED(cmd->waitstatus);
+        if (cache) {
+                char path[strlen(pending.tmp) + sizeof "/status"];
+                snprintf(path, sizeof path, "%s/status", pending.tmp);
+                FILE *f = fopen(path, "we");
+                cache = f && fprintf(f, "%d\n", WEXITSTATUS(cmd->waitstatus)) > 0;
+                if (f && fclose(f) != 0)
+                        cache = false;
+        }
+
+        /* an entry that another shell stored meanwhile is replaced */
+        if (cache) {
+                remove_entry(pending.entry);
+                cache = rename(pending.tmp, pending.entry) == 0;
+        }
+        if (!cache)
+                remove_entry(pending.tmp);
+        else {
+                char *store = strndup(pending.entry, strrchr(pending.entry, '/') - pending.entry);
+                evict(store);
+                free(store);
+        }
+
+        free(pending.entry);
+        free(pending.tmp);
+        pending.active = false;
+        pending.job = NULL;
+}
+
+/* Finish a memoized command that was stopped once it has ended.
+ * Called when the shell is back at the prompt, and after fg.  SIGCHLD
+ * must be blocked. */
+void
+esh_memo_poll(void)
+{
+        if (pending.active && pending.job)
+                esh_memo_finish(pending.job);
+}
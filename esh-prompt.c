@@ -0,0 +1,278 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * Prompts.
+ *
+ * The prompt is the concatenation of the fragments of the plugins, in
+ * plugin order.  Fragments that plugins provide through 'make_prompt'
+ * are made afresh for every prompt.  Those provided through a
+ * struct esh_prompt_fragment are cached, and made again only after one
+ * of the events they name.  Asynchronous fragments are made by a
+ * worker thread; when one is done, or a plugin invalidates its
+ * fragment, the event loop redraws the prompt that is showing.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <readline/readline.h>
+
+#include "esh.h"
+#include "esh-sys-utils.h"
+
+/* Defined in esh.c */
+extern struct esh_shell shell;
+
+struct fragment {
+        struct esh_plugin *plugin;
+        char *value;                    /* NULL until first made */
+        size_t len;
+
+        /* The state the value was made in, main thread only */
+        bool made;
+        char *cwd;
+        unsigned long jobs;
+        struct timespec when;
+
+        bool invalidated;               /* Set by esh_prompt_invalidate */
+
+        /* Asynchronous fragments, protected by 'lock' */
+        bool queued;                    /* Must be made (again) */
+        bool running;                   /* Being made by the worker */
+};
+
+static struct fragment *fragments;
+static int fragment_count = -1;         /* -1 until the plugins are known */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static bool worker_started;
+static int wake_fds[2] = { -1, -1 };    /* Asks the main loop to redraw */
+
+static void
+wake_main_loop(void)
+{
+        /* if the pipe is full, a redraw is pending anyway */
+        if (wake_fds[1] != -1 && write(wake_fds[1], "", 1) == -1)
+                return;
+}
+
+static void *
+worker(void *arg)
+{
+        pthread_mutex_lock(&lock);
+        for (;;) {
+                int i;
+                for (i = 0; i < fragment_count; i++)
+                        if (fragments[i].queued && !fragments[i].running)
+                                break;
+                if (i == fragment_count) {
+                        pthread_cond_wait(&work, &lock);
+                        continue;
+                }
+
+                struct fragment *f = &fragments[i];
+                f->queued = false;
+                f->running = true;
+                pthread_mutex_unlock(&lock);
+
+                char *value = f->plugin->prompt_fragment->make();
+
+                pthread_mutex_lock(&lock);
+                free(f->value);
+                f->value = value;
+                f->len = value ? strlen(value) : 0;
+                f->running = false;
+                wake_main_loop();
+        }
+        return NULL;
+}
+
+static void
+start_worker(void)
+{
+        /* signals are for the main thread */
+        sigset_t all, saved;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &saved);
+
+        pthread_t thread;
+        int rc = pthread_create(&thread, NULL, worker, NULL);
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+        if (rc != 0) {
+                errno = rc;
+                esh_sys_error("prompt: pthread_create: ");
+                return;
+        }
+        pthread_detach(thread);
+        worker_started = true;
+}
+
+/* A key that changes whenever a job starts, stops, continues or ends */
+static unsigned long
+jobs_key(void)
+{
+        unsigned long key = 0;
+        bool was_blocked = esh_signal_block(SIGCHLD);
+        struct list *jobs = shell.get_jobs();
+        struct list_elem *e;
+        for (e = list_begin(jobs); e != list_end(jobs); e = list_next(e)) {
+                struct esh_pipeline *pipe = list_entry(e, struct esh_pipeline, elem);
+                key = key * 31 + pipe->jid * 4 + pipe->status;
+        }
+        key = key * 31 + list_size(jobs);
+        if (!was_blocked)
+                esh_signal_unblock(SIGCHLD);
+        return key;
+}
+
+/* Return true if f must be made again in the current state */
+static bool
+is_stale(struct fragment *f, const char *cwd, unsigned long jobs, struct timespec *now)
+{
+        struct esh_prompt_fragment *pf = f->plugin->prompt_fragment;
+        if (__atomic_exchange_n(&f->invalidated, false, __ATOMIC_ACQ_REL) || !f->made)
+                return true;
+
+        if ((pf->invalidate_on & ESH_PROMPT_CWD) && strcmp(f->cwd, cwd))
+                return true;
+        if ((pf->invalidate_on & ESH_PROMPT_JOBS) && f->jobs != jobs)
+                return true;
+        if (pf->invalidate_on & ESH_PROMPT_TIMER) {
+                long ms = (now->tv_sec - f->when.tv_sec) * 1000
+                          + (now->tv_nsec - f->when.tv_nsec) / 1000000;
+                if (ms >= pf->interval_ms)
+                        return true;
+        }
+        return false;
+}
+
+static void redraw(int fd, void *arg);
+
+/* Find the plugins that make fragments */
+static void
+find_fragments(void)
+{
+        struct list_elem *e;
+        fragment_count = 0;
+        for (e = list_begin(&esh_plugin_list); e != list_end(&esh_plugin_list); e = list_next(e)) {
+                struct esh_plugin *plugin = list_entry(e, struct esh_plugin, elem);
+                if (plugin->prompt_fragment == NULL && plugin->make_prompt == NULL)
+                        continue;
+
+                fragments = realloc(fragments, (fragment_count + 1) * sizeof *fragments);
+                memset(&fragments[fragment_count], 0, sizeof *fragments);
+                fragments[fragment_count++].plugin = plugin;
+        }
+
+        if (pipe2(wake_fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+                esh_sys_error("prompt: pipe: ");
+                return;
+        }
+        esh_event_add(wake_fds[0], redraw, NULL);
+}
+
+/* Assemble the prompt from the plugins' fragments; the default
+ * shell.build_prompt */
+char *
+esh_prompt_build(void)
+{
+        if (fragment_count == -1)
+                find_fragments();
+        if (fragment_count == 0)
+                return strdup("esh> ");
+
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof cwd) == NULL)
+                cwd[0] = '\0';
+        unsigned long jobs = jobs_key();
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        int i;
+        for (i = 0; i < fragment_count; i++) {
+                struct fragment *f = &fragments[i];
+                struct esh_prompt_fragment *pf = f->plugin->prompt_fragment;
+
+                if (pf == NULL) {
+                        free(f->value);
+                        f->value = f->plugin->make_prompt();
+                        f->len = f->value ? strlen(f->value) : 0;
+                        continue;
+                }
+                if (!is_stale(f, cwd, jobs, &now))
+                        continue;
+
+                free(f->cwd);
+                f->cwd = strdup(cwd);
+                f->jobs = jobs;
+                f->when = now;
+                f->made = true;
+
+                if (!pf->async) {
+                        free(f->value);
+                        f->value = pf->make();
+                        f->len = f->value ? strlen(f->value) : 0;
+                        continue;
+                }
+
+                pthread_mutex_lock(&lock);
+                if (!worker_started)
+                        start_worker();
+                f->queued = true;
+                pthread_cond_signal(&work);
+                pthread_mutex_unlock(&lock);
+        }
+
+        /* a single allocation, whatever the number of fragments */
+        pthread_mutex_lock(&lock);
+        size_t len = 0;
+        for (i = 0; i < fragment_count; i++)
+                len += fragments[i].len;
+
+        char *prompt = malloc(len + 1), *p = prompt;
+        for (i = 0; i < fragment_count; i++) {
+                if (fragments[i].len > 0)
+                        memcpy(p, fragments[i].value, fragments[i].len);
+                p += fragments[i].len;
+        }
+        *p = '\0';
+        pthread_mutex_unlock(&lock);
+        return prompt;
+}
+
+/* The default shell.invalidate_prompt */
+void
+esh_prompt_invalidate(struct esh_plugin *plugin)
+{
+        int i;
+        for (i = 0; i < fragment_count; i++)
+                if (fragments[i].plugin == plugin)
+                        __atomic_store_n(&fragments[i].invalidated, true, __ATOMIC_RELEASE);
+        wake_main_loop();
+}
+
+/* Show the prompt again if a fragment changed while it is showing */
+static void
+redraw(int fd, void *arg)
+{
+        char buf[64];
+        while (read(fd, buf, sizeof buf) > 0)
+                continue;
+
+        if (!RL_ISSTATE(RL_STATE_READCMD) || shell.build_prompt != esh_prompt_build)
+                return;
+
+        char *prompt = esh_prompt_build();
+        if (rl_prompt == NULL || strcmp(prompt, rl_prompt)) {
+                rl_set_prompt(prompt);
+                rl_forced_update_display();
+        }
+        free(prompt);
+}
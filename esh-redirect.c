@@ -0,0 +1,215 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * Redirection of a command's file descriptors, applied in the
+ * child process just before exec.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "esh.h"
+#include "esh-sys-utils.h"
+
+/* Write all of buf to fd, return false on error */
+static bool
+write_all(int fd, const char *buf, size_t len)
+{
+        while (len > 0) {
+                ssize_t n = write(fd, buf, len);
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return false;
+                }
+                buf += n;
+                len -= n;
+        }
+        return true;
+}
+
+/* Make fd refer to the close-on-exec descriptor 'newfd', which is
+ * closed afterwards.  The copy made by dup2 survives exec. */
+static bool
+move_fd(int newfd, int fd)
+{
+        if (newfd == fd)
+                return esh_clear_cloexec(fd) == 0;
+
+        if (dup2(newfd, fd) < 0) {
+                esh_sys_error("dup2 error: ");
+                close(newfd);
+                return false;
+        }
+        close(newfd);
+        return true;
+}
+
+/* Open 'file' as descriptor fd */
+static bool
+redirect_file(int fd, enum esh_redirect_mode mode, char *file)
+{
+        int flags;
+        switch (mode) {
+        case ESH_REDIRECT_INPUT:
+                flags = O_RDONLY;
+                break;
+        case ESH_REDIRECT_APPEND:
+                flags = O_WRONLY | O_APPEND | O_CREAT;
+                break;
+        case ESH_REDIRECT_READWRITE:
+                flags = O_RDWR | O_CREAT;
+                break;
+        default:
+                flags = O_WRONLY | O_TRUNC | O_CREAT;
+                break;
+        }
+
+        int newfd = esh_open_cloexec(file, flags, S_IRWXU | S_IRWXG | S_IRWXO);
+        if (newfd == -1) {
+                esh_sys_error("%s: ", file);
+                return false;
+        }
+        return move_fd(newfd, fd);
+}
+
+/* Make fd read 'text' followed by a newline.  The text is kept in a
+ * memfd; if memfd_create is unavailable, it is fed through a pipe. */
+static bool
+redirect_string(int fd, char *text)
+{
+        size_t len = strlen(text);
+        int memfd = memfd_create("esh-here-string", MFD_CLOEXEC);
+
+        if (memfd != -1) {
+                if (!write_all(memfd, text, len) || !write_all(memfd, "\n", 1)
+                    || lseek(memfd, 0, SEEK_SET) == -1) {
+                        esh_sys_error("here-string: ");
+                        close(memfd);
+                        return false;
+                }
+                return move_fd(memfd, fd);
+        }
+
+        int fds[2];
+        if (esh_pipe_cloexec(fds) == -1) {
+                esh_sys_error("here-string pipe: ");
+                return false;
+        }
+
+        /* A string larger than the pipe buffer needs a writer process,
+         * since nobody reads the pipe until we exec.  It is forked
+         * twice, so that it is not left a zombie of the command. */
+        int capacity = fcntl(fds[1], F_GETPIPE_SZ);
+        if (capacity != -1 && len + 1 > (size_t) capacity) {
+                pid_t pid = fork();
+                if (pid == -1) {
+                        esh_sys_error("here-string fork: ");
+                        return false;
+                }
+                if (pid == 0) {
+                        close(fds[0]);
+                        pid = fork();
+                        if (pid == 0)
+                                _exit(write_all(fds[1], text, len)
+                                      && write_all(fds[1], "\n", 1) ? 0 : 1);
+                        _exit(pid == -1 ? 1 : 0);
+                }
+                int status = 0;
+                while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+                        continue;
+                if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+                        fprintf(stderr, "esh: here-string: cannot fork a writer\n");
+                        return false;
+                }
+        } else if (!write_all(fds[1], text, len) || !write_all(fds[1], "\n", 1)) {
+                esh_sys_error("here-string: ");
+                return false;
+        }
+        close(fds[1]);
+        return move_fd(fds[0], fd);
+}
+
+/* Return true if r is a plain <, > or >> whose file is kept in the
+ * command's iored_input or iored_output field */
+static bool
+is_legacy(struct esh_redirect *r)
+{
+        return r->target == NULL && r->mode != ESH_REDIRECT_DUP;
+}
+
+/* Apply the redirections of cmd to the calling process, which is
+ * about to exec it.  Return false if one of them failed. */
+bool
+esh_command_redirect(struct esh_command *cmd)
+{
+        bool has_input = false, has_output = false;
+        struct esh_redirect *r;
+
+        for (r = cmd->redirects; r; r = r->next) {
+                if (is_legacy(r) && r->fd == 0)
+                        has_input = true;
+                if (is_legacy(r) && r->fd == 1)
+                        has_output = true;
+        }
+
+        /* A plugin may have set iored_input or iored_output on a
+         * command that had no such redirection. */
+        if (cmd->iored_input && !has_input
+            && !redirect_file(0, ESH_REDIRECT_INPUT, cmd->iored_input))
+                return false;
+
+        if (cmd->iored_output && !has_output
+            && !redirect_file(1, cmd->append_to_output ? ESH_REDIRECT_APPEND
+                                                       : ESH_REDIRECT_OUTPUT,
+                              cmd->iored_output))
+                return false;
+
+        for (r = cmd->redirects; r; r = r->next) {
+                switch (r->mode) {
+                case ESH_REDIRECT_DUP:
+                        /* dup2 leaves FD_CLOEXEC alone for N>&N */
+                        if (r->dup_source == r->fd) {
+                                if (esh_clear_cloexec(r->fd) < 0) {
+                                        esh_sys_error("%d>&%d: ", r->fd, r->dup_source);
+                                        return false;
+                                }
+                        } else if (dup2(r->dup_source, r->fd) < 0) {
+                                esh_sys_error("%d>&%d: ", r->fd, r->dup_source);
+                                return false;
+                        }
+                        break;
+
+                case ESH_REDIRECT_HERESTRING:
+                        if (!redirect_string(r->fd, r->target))
+                                return false;
+                        break;
+
+                default:
+                        if (!is_legacy(r)) {
+                                if (!redirect_file(r->fd, r->mode, r->target))
+                                        return false;
+                        } else if (r->fd == 0) {
+                                if (cmd->iored_input
+                                    && !redirect_file(0, ESH_REDIRECT_INPUT,
+                                                      cmd->iored_input))
+                                        return false;
+                        } else if (cmd->iored_output) {
+                                if (!redirect_file(1, cmd->append_to_output
+                                                      ? ESH_REDIRECT_APPEND
+                                                      : ESH_REDIRECT_OUTPUT,
+                                                   cmd->iored_output))
+                                        return false;
+                        }
+                        break;
+                }
+        }
+        return true;
+}
@@ -0,0 +1,338 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * Scheduling attributes of jobs.
+ *
+ *     cpus=0-7,12 numa=1 nice=10 ioprio=idle sched=batch cmd | cmd ...
+ *
+ * Words of this form in front of a pipeline are attributes of the
+ * job, applied to each of its commands after it has joined the job's
+ * process group and before it execs:
+ *
+ *     cpus=LIST      CPU affinity, as for taskset -c; cpus=auto gives
+ *                    each command, and each part of a batch command, a
+ *                    CPU of its own, in turn over the CPUs the shell may
+ *                    use, so that parallel jobs spread across cores
+ *     numa=NODE      run on the CPUs of NODE and allocate memory there
+ *     nice=N         niceness, from -20 to 19
+ *     ioprio=CLASS   I/O priority: idle, be[:0-7], rt[:0-7] or none,
+ *                    which follows the niceness
+ *     sched=POLICY   other, batch, idle, fifo[:PRIO] or rr[:PRIO]
+ *
+ * 'renice N [%JOB]' changes the niceness of every process of a job.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "esh.h"
+#include "esh-sys-utils.h"
+
+/* Defined in esh.c */
+extern struct esh_shell shell;
+
+/* Not in every libc */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+enum { IOPRIO_CLASS_NONE, IOPRIO_CLASS_RT, IOPRIO_CLASS_BE, IOPRIO_CLASS_IDLE };
+#define MPOL_BIND 2
+
+struct esh_sched {
+        bool has_cpus;
+        cpu_set_t cpus;
+        bool auto_cpus;         /* cpus=auto */
+        int auto_base;          /* First turn of the job for cpus=auto */
+        int numa_node;          /* -1 if not set */
+        bool has_nice;
+        int nice;
+        int ioprio;             /* -1 if not set */
+        int policy;             /* -1 if not set */
+        int priority;
+};
+
+/* The next turn for cpus=auto */
+static int next_auto_cpu;
+
+/* Parse a list such as 0-3,8 into set; return false if it is not one */
+static bool
+parse_cpu_list(const char *list, cpu_set_t *set)
+{
+        CPU_ZERO(set);
+        const char *p = list;
+        while (*p) {
+                char *end;
+                long first = strtol(p, &end, 10), last = first;
+                if (end == p)
+                        return false;
+                p = end;
+                if (*p == '-') {
+                        last = strtol(p + 1, &end, 10);
+                        if (end == p + 1)
+                                return false;
+                        p = end;
+                }
+                if (first < 0 || last < first || last >= CPU_SETSIZE)
+                        return false;
+                for (; first <= last; first++)
+                        CPU_SET(first, set);
+                if (*p == ',')
+                        p++;
+                else if (*p != '\0' && *p != '\n')
+                        return false;
+                else
+                        break;
+        }
+        return CPU_COUNT(set) > 0;
+}
+
+/* Parse 'CLASS[:LEVEL]' with the given names for the classes; the
+ * level is between 'min' and 'max', 'dflt' if not given */
+static bool
+parse_class(const char *value, const char *const *names, int *class, int *level,
+            int min, int max, int dflt)
+{
+        size_t len = strcspn(value, ":");
+        for (*class = 0; names[*class]; (*class)++)
+                if (len > 0 && strlen(names[*class]) == len
+                    && !strncmp(value, names[*class], len))
+                        break;
+        if (names[*class] == NULL)
+                return false;
+
+        *level = dflt;
+        if (value[len] == ':') {
+                char *end;
+                *level = strtol(value + len + 1, &end, 10);
+                if (end == value + len + 1 || *end || *level < min || *level > max)
+                        return false;
+        }
+        return true;
+}
+
+/* Read the CPUs of NUMA node 'node' into set */
+static bool
+numa_node_cpus(int node, cpu_set_t *set)
+{
+        char path[64], list[4096];
+        snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *f = fopen(path, "re");
+        if (f == NULL)
+                return false;
+        bool ok = fgets(list, sizeof list, f) && parse_cpu_list(list, set);
+        fclose(f);
+        return ok;
+}
+
+/* Add the attribute 'word' to s.  Return 1 if it was one, 0 if the
+ * word is not an attribute, and -1, after saying why, if its value is
+ * not valid. */
+static int
+parse_attribute(struct esh_sched *s, const char *word)
+{
+        const char *value = strchr(word, '=');
+        if (value == NULL)
+                return 0;
+        size_t len = value++ - word;
+        char *end;
+
+        if (len == 4 && !strncmp(word, "cpus", 4)) {
+                if (!strcmp(value, "auto")) {
+                        s->auto_cpus = true;
+                        return 1;
+                }
+                s->has_cpus = true;
+                if (parse_cpu_list(value, &s->cpus))
+                        return 1;
+        } else if (len == 4 && !strncmp(word, "numa", 4)) {
+                s->numa_node = strtol(value, &end, 10);
+                cpu_set_t cpus;
+                if (end != value && *end == '\0' && s->numa_node >= 0
+                    && numa_node_cpus(s->numa_node, &cpus))
+                        return 1;
+                fprintf(stderr, "esh: %s: no such NUMA node\n", word);
+                return -1;
+        } else if (len == 4 && !strncmp(word, "nice", 4)) {
+                s->has_nice = true;
+                s->nice = strtol(value, &end, 10);
+                if (end != value && *end == '\0' && s->nice >= -20 && s->nice <= 19)
+                        return 1;
+        } else if (len == 6 && !strncmp(word, "ioprio", 6)) {
+                static const char *const classes[] = { "none", "rt", "be", "idle", NULL };
+                int class, level;
+                if (parse_class(value, classes, &class, &level, 0, 7, 4)
+                    && (class == IOPRIO_CLASS_RT || class == IOPRIO_CLASS_BE || !strchr(value, ':'))) {
+                        /* the kernel takes no level with none or idle */
+                        s->ioprio = class << IOPRIO_CLASS_SHIFT
+                                    | (class == IOPRIO_CLASS_RT || class == IOPRIO_CLASS_BE ? level : 0);
+                        return 1;
+                }
+        } else if (len == 5 && !strncmp(word, "sched", 5)) {
+                static const char *const policies[] = { "other", "fifo", "rr", "batch",
+                                                        "", "idle", NULL };
+                if (parse_class(value, policies, &s->policy, &s->priority, 1, 99, 1)) {
+                        if (s->policy != SCHED_FIFO && s->policy != SCHED_RR)
+                                s->priority = 0;
+                        return 1;
+                }
+        } else {
+                return 0;
+        }
+
+        fprintf(stderr, "esh: %s: invalid value\n", word);
+        return -1;
+}
+
+/* Remove the attributes in front of the first command of pipeline and
+ * keep them in pipeline->sched.  Return false on an invalid one. */
+bool
+esh_pipeline_sched_prefix(struct esh_pipeline *pipeline)
+{
+        struct esh_command *cmd = list_entry(list_front(&pipeline->commands),
+                                             struct esh_command, elem);
+        struct esh_sched s = { .numa_node = -1, .ioprio = -1, .policy = -1 };
+        int n = 0, found;
+
+        /* the command itself is not an attribute, even if it has a '=' */
+        while (cmd->argv[n + 1] && (found = parse_attribute(&s, cmd->argv[n])) != 0) {
+                if (found == -1)
+                        return false;
+                n++;
+        }
+        if (n == 0)
+                return true;
+
+        int argc = n;
+        while (cmd->argv[argc])
+                argc++;
+        int i;
+        for (i = 0; i < n; i++)
+                free(cmd->argv[i]);
+        memmove(cmd->argv, cmd->argv + n, (argc - n + 1) * sizeof *cmd->argv);
+        struct esh_deferred_word *word;
+        for (word = cmd->deferred; word; word = word->next)
+                word->index -= n;
+
+        if (s.auto_cpus) {
+                s.auto_base = next_auto_cpu;
+                next_auto_cpu += list_size(&pipeline->commands);
+        }
+        free(pipeline->sched);
+        pipeline->sched = malloc(sizeof s);
+        *pipeline->sched = s;
+        return true;
+}
+
+/* Apply s to the calling process, the process of a job that is about
+ * to exec.  'turn' is the number of the command in its job, or of the
+ * part of a batch command, for cpus=auto.  Exits on failure. */
+void
+esh_sched_apply(struct esh_sched *s, int turn)
+{
+        cpu_set_t cpus;
+        bool set_cpus = false;
+
+        if (s->auto_cpus && sched_getaffinity(0, sizeof cpus, &cpus) == 0) {
+                /* the turn-th of the CPUs we may use */
+                int count = CPU_COUNT(&cpus), k = (s->auto_base + turn) % count, cpu;
+                for (cpu = 0; k > 0 || !CPU_ISSET(cpu, &cpus); cpu++)
+                        if (CPU_ISSET(cpu, &cpus))
+                                k--;
+                CPU_ZERO(&cpus);
+                CPU_SET(cpu, &cpus);
+                set_cpus = true;
+        } else if (s->has_cpus) {
+                cpus = s->cpus;
+                set_cpus = true;
+        }
+
+        if (s->numa_node != -1) {
+                cpu_set_t node;
+                unsigned long mask[(s->numa_node / (8 * sizeof(long))) + 1];
+                memset(mask, 0, sizeof mask);
+                mask[s->numa_node / (8 * sizeof(long))] = 1UL << (s->numa_node % (8 * sizeof(long)));
+                if (syscall(SYS_set_mempolicy, MPOL_BIND, mask, 8 * sizeof mask + 1) == -1) {
+                        esh_sys_error("numa=%d: ", s->numa_node);
+                        exit(126);
+                }
+                if (numa_node_cpus(s->numa_node, &node)) {
+                        if (set_cpus)
+                                CPU_AND(&cpus, &cpus, &node);
+                        else
+                                cpus = node;
+                        set_cpus = true;
+                }
+        }
+
+        if (set_cpus && sched_setaffinity(0, sizeof cpus, &cpus) == -1) {
+                esh_sys_error("cpus: ");
+                exit(126);
+        }
+        if (s->has_nice && setpriority(PRIO_PROCESS, 0, s->nice) == -1) {
+                esh_sys_error("nice=%d: ", s->nice);
+                exit(126);
+        }
+        if (s->ioprio != -1 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, s->ioprio) == -1) {
+                esh_sys_error("ioprio: ");
+                exit(126);
+        }
+        if (s->policy != -1) {
+                struct sched_param param = { .sched_priority = s->priority };
+                if (sched_setscheduler(0, s->policy, &param) == -1) {
+                        esh_sys_error("sched: ");
+                        exit(126);
+                }
+        }
+}
+
+/* The renice builtin: 'renice N [%JOB]', by default the most recent
+ * job.  Return its exit status. */
+int
+esh_sched_renice(char **argv)
+{
+        char *end = NULL;
+        int nice = argv[1] ? strtol(argv[1], &end, 10) : 0;
+        if (argv[1] == NULL || end == argv[1] || *end || (argv[2] && argv[3])) {
+                fprintf(stderr, "usage: renice N [%%JOB]\n");
+                return 2;
+        }
+
+        bool was_blocked = esh_signal_block(SIGCHLD);
+        struct list *jobs = shell.get_jobs();
+        struct esh_pipeline *job = NULL;
+        if (argv[2])
+                job = shell.get_job_from_jid(atoi(argv[2] + (argv[2][0] == '%')));
+        else if (!list_empty(jobs))
+                job = list_entry(list_back(jobs), struct esh_pipeline, elem);
+
+        int status = 0;
+        if (job == NULL) {
+                fprintf(stderr, "renice: %s: no such job\n", argv[2] ? argv[2] : "current");
+                status = 1;
+        } else {
+                struct list_elem *e;
+                for (e = list_begin(&job->commands); e != list_end(&job->commands); e = list_next(e)) {
+                        pid_t pid = list_entry(e, struct esh_command, elem)->pid;
+                        if (setpriority(PRIO_PROCESS, pid, nice) == -1 && errno != ESRCH) {
+                                esh_sys_error("renice: %d: ", (int) pid);
+                                status = 1;
+                        }
+                }
+                for (e = list_begin(&job->procsubs); e != list_end(&job->procsubs); e = list_next(e)) {
+                        pid_t pid = list_entry(e, struct esh_procsub, elem)->pid;
+                        if (setpriority(PRIO_PROCESS, pid, nice) == -1 && errno != ESRCH) {
+                                esh_sys_error("renice: %d: ", (int) pid);
+                                status = 1;
+                        }
+                }
+        }
+        if (!was_blocked)
+                esh_signal_unblock(SIGCHLD);
+        return status;
+}
@@ -0,0 +1,214 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * Command server mode: 'esh --server SOCKET'.
+ *
+ * The server starts up once, loading its plugins, and then forks a
+ * worker for each connection.  A worker takes over the client's
+ * descriptors, directory and environment, runs its command line as
+ * 'esh -c' would, and replies with the exit status, so that short
+ * invocations through esh-client pay for a fork rather than for exec,
+ * dynamic linking and plugin initialization.  The protocol is
+ * described in esh-server.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "esh.h"
+#include "esh-sys-utils.h"
+#include "esh-server.h"
+
+static struct sockaddr_un address;
+static pid_t server_pid;
+
+static void
+remove_socket(void)
+{
+        if (getpid() == server_pid)
+                unlink(address.sun_path);
+}
+
+static void
+terminate(int sig)
+{
+        unlink(address.sun_path);
+        _exit(128 + sig);
+}
+
+/* Read exactly len bytes, or return false */
+static bool
+read_full(int fd, char *buf, size_t len)
+{
+        while (len > 0) {
+                ssize_t n = read(fd, buf, len);
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return false;
+                buf += n;
+                len -= n;
+        }
+        return true;
+}
+
+/* Receive the request header and the client's stdin, stdout and
+ * stderr.  Return false if the request is malformed. */
+static bool
+receive_header(int conn, struct esh_server_request *req, int fds[3])
+{
+        union {
+                char buf[CMSG_SPACE(3 * sizeof(int))];
+                struct cmsghdr align;
+        } control;
+        struct iovec iov = { .iov_base = req, .iov_len = sizeof *req };
+        struct msghdr msg = {
+                .msg_iov = &iov, .msg_iovlen = 1,
+                .msg_control = control.buf, .msg_controllen = sizeof control.buf,
+        };
+
+        ssize_t n;
+        while ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+                continue;
+        if (n <= 0)
+                return false;
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+            || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+                return false;
+        memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+        /* the rest of a short read of the header */
+        if (n < (ssize_t) sizeof *req && !read_full(conn, (char *) req + n, sizeof *req - n))
+                return false;
+        return req->magic == ESH_SERVER_MAGIC && req->length <= ESH_SERVER_MAX_REQUEST;
+}
+
+/* Split buf[0..len) into its NUL-terminated strings, in a
+ * NULL-terminated array; an empty string also ends the array, and
+ * *rest is set to what follows it */
+static char **
+split_strings(char *buf, char *end, char **rest)
+{
+        size_t count = 0, capacity = 16;
+        char **strings = malloc(capacity * sizeof *strings);
+
+        while (buf < end && *buf) {
+                if (count + 1 == capacity)
+                        strings = realloc(strings, (capacity *= 2) * sizeof *strings);
+                strings[count++] = buf;
+                buf += strlen(buf) + 1;
+        }
+        strings[count] = NULL;
+        *rest = buf < end ? buf + 1 : end;
+        return strings;
+}
+
+/* Serve the request on conn; run in a worker process */
+static int
+serve(int conn)
+{
+        struct esh_server_request req;
+        int fds[3], i;
+        if (!receive_header(conn, &req, fds))
+                return 2;
+
+        for (i = 0; i < 3; i++) {
+                if (dup2(fds[i], i) == -1)
+                        return 2;
+                close(fds[i]);
+        }
+
+        char *buf = malloc(req.length + 1);
+        if (!read_full(conn, buf, req.length))
+                return 2;
+        buf[req.length] = '\0';
+        char *end = buf + req.length;
+
+        char *cwd = buf, *rest;
+        char **argv = split_strings(cwd + strlen(cwd) + 1, end, &rest);
+        char **envp = split_strings(rest, end, &rest);
+
+        if (chdir(cwd) == -1) {
+                esh_sys_error("esh: %s: ", cwd);
+                return 1;
+        }
+        esh_vars_clear();
+        esh_vars_init(envp);
+
+        if (argv[0] == NULL || strcmp(argv[0], "-c") || argv[1] == NULL) {
+                fprintf(stderr, "usage: esh-client SOCKET -c COMMAND\n");
+                return 2;
+        }
+        return esh_command_string_run(argv[1]);
+}
+
+/* Listen on path and serve requests until killed.  Does not return. */
+void
+esh_server_run(const char *path)
+{
+        address.sun_family = AF_UNIX;
+        if (snprintf(address.sun_path, sizeof address.sun_path, "%s", path)
+            >= (int) sizeof address.sun_path) {
+                fprintf(stderr, "esh: %s: socket path too long\n", path);
+                exit(EXIT_FAILURE);
+        }
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+                esh_sys_fatal_error("esh: socket: ");
+
+        /* a socket left behind by a server that crashed, but not a
+         * file or the socket of a server that is still running */
+        if (!esh_remove_stale_socket("esh", path))
+                exit(EXIT_FAILURE);
+        mode_t mask = umask(0077);
+        if (bind(fd, (struct sockaddr *) &address, sizeof address) == -1
+            || listen(fd, SOMAXCONN) == -1)
+                esh_sys_fatal_error("esh: %s: ", path);
+        umask(mask);
+
+        server_pid = getpid();
+        atexit(remove_socket);
+        signal(SIGTERM, terminate);
+        signal(SIGINT, terminate);
+        signal(SIGHUP, terminate);
+
+        /* workers are reaped by the SIGCHLD handler */
+        for (;;) {
+                int conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+                if (conn == -1) {
+                        if (errno != EINTR && errno != ECONNABORTED)
+                                esh_sys_error("esh: accept: ");
+                        continue;
+                }
+
+                /* or the workers would print it again */
+                fflush(NULL);
+
+                pid_t pid = fork();
+                if (pid == -1)
+                        esh_sys_error("esh: fork: ");
+
+                if (pid == 0) {
+                        close(fd);
+                        signal(SIGTERM, SIG_DFL);
+                        signal(SIGINT, SIG_DFL);
+                        signal(SIGHUP, SIG_DFL);
+
+                        int32_t status = serve(conn);
+                        fflush(NULL);
+                        send(conn, &status, sizeof status, MSG_NOSIGNAL);
+                        exit(status);
+                }
+                close(conn);
+        }
+}
@@ -0,0 +1,30 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * Protocol between 'esh --server SOCKET' and its client, esh-client.
+ *
+ * The client connects to the server's Unix domain socket and sends
+ * a request in one sendmsg(2) that carries its standard input, output
+ * and error as SCM_RIGHTS.  The request is a header followed by
+ * 'length' bytes of NUL-terminated strings: the client's working
+ * directory, its arguments, an empty string, and its environment.
+ * The server runs the command in a worker process on the client's
+ * descriptors and replies with the command's exit status, as an
+ * int32_t, when it is done.  This header has no other dependencies,
+ * so that other clients can include it.
+ */
+
+#ifndef __ESH_SERVER_H
+#define __ESH_SERVER_H
+
+#include <stdint.h>
+
+#define ESH_SERVER_MAGIC        0x45534853u     /* "ESHS" */
+#define ESH_SERVER_MAX_REQUEST  (4 * 1024 * 1024)
+
+struct esh_server_request {
+        uint32_t magic;
+        uint32_t length;        /* Bytes of strings that follow */
+};
+
+#endif /* __ESH_SERVER_H */
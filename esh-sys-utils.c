@@ -7,6 +7,7 @@
  * Virginia Tech.
  */
 
+#define _GNU_SOURCE
 #include <termios.h>
 #include <stdio.h>
 #include <errno.h>
@@ -17,6 +18,15 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <assert.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
 
 #include "esh-sys-utils.h"
 
@@ -28,9 +38,10 @@ vesh_sys_error(char *fmt, va_list ap)
 {
         char errmsg[1024];
 
-        strerror_r(errno, errmsg, sizeof errmsg);
+        /* GNU strerror_r, which may return a static string instead */
+        char *msg = strerror_r(errno, errmsg, sizeof errmsg);
         vfprintf(stderr, fmt, ap);
-        fprintf(stderr, "%s\n", errmsg);
+        fprintf(stderr, "%s\n", msg);
 }
 
 /* Print information about the last syscall error */
@@ -66,6 +77,102 @@ esh_set_cloexec(int fd)
         return fcntl(fd, F_SETFD, oldflags | FD_CLOEXEC);
 }
 
+/* Clear the 'close-on-exec' flag on fd, return error indicator */
+int
+esh_clear_cloexec(int fd)
+{
+        int oldflags = fcntl (fd, F_GETFD, 0);
+        if (oldflags < 0)
+                return oldflags;
+
+        return fcntl(fd, F_SETFD, oldflags & ~FD_CLOEXEC);
+}
+
+/* Like pipe(2), but both ends are created close-on-exec */
+int
+esh_pipe_cloexec(int fds[2])
+{
+        return pipe2(fds, O_CLOEXEC);
+}
+
+/* Like open(2), but the descriptor is created close-on-exec */
+int
+esh_open_cloexec(const char *path, int flags, mode_t mode)
+{
+        return open(path, flags | O_CLOEXEC, mode);
+}
+
+/* Mark every descriptor from lowfd on close-on-exec.
+ * close_range(2) does so in one call, without looking at the
+ * descriptor table; older kernels get a walk over /proc/self/fd,
+ * which visits only the descriptors that are actually open. */
+int
+esh_cloexec_from(int lowfd)
+{
+#ifdef SYS_close_range
+        if (syscall(SYS_close_range, lowfd, ~0U, CLOSE_RANGE_CLOEXEC) == 0)
+                return 0;
+#endif
+        DIR *dir = opendir("/proc/self/fd");
+        if (dir == NULL)
+                return -1;
+
+        int rc = 0;
+        struct dirent *dentry;
+        while ((dentry = readdir(dir)) != NULL) {
+                int fd = atoi(dentry->d_name);
+                if (dentry->d_name[0] == '.' || fd < lowfd || fd == dirfd(dir))
+                        continue;
+                if (esh_set_cloexec(fd) < 0)
+                        rc = -1;
+        }
+        closedir(dir);
+        return rc;
+}
+
+/* Remove the Unix socket at path if it was left behind by a process
+ * that no longer listens on it.  A socket is stale only if connecting
+ * to it is refused; anything else at path is left alone. */
+bool
+esh_remove_stale_socket(const char *who, const char *path)
+{
+        struct stat st;
+        if (lstat(path, &st) == -1) {
+                if (errno == ENOENT)
+                        return true;
+                esh_sys_error("%s: %s: ", who, path);
+                return false;
+        }
+        if (!S_ISSOCK(st.st_mode)) {
+                fprintf(stderr, "%s: %s: exists and is not a socket\n", who, path);
+                return false;
+        }
+
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+        if (strlen(path) >= sizeof address.sun_path) {
+                fprintf(stderr, "%s: %s: socket path too long\n", who, path);
+                return false;
+        }
+        strcpy(address.sun_path, path);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (fd == -1) {
+                esh_sys_error("%s: socket: ", who);
+                return false;
+        }
+        int rc = connect(fd, (struct sockaddr *) &address, sizeof address);
+        int error = errno;
+        close(fd);
+
+        if (rc == -1 && error == ECONNREFUSED) {
+                if (unlink(path) == 0 || errno == ENOENT)
+                        return true;
+                esh_sys_error("%s: %s: ", who, path);
+                return false;
+        }
+        fprintf(stderr, "%s: %s: in use by another process\n", who, path);
+        return false;
+}
+
 static int terminal_fd = -1;           /* the controlling terminal */
 static struct termios saved_tty_state;  /* the state of the terminal when shell
                                            was started. */
@@ -77,13 +184,10 @@ esh_sys_tty_init(void)
         char *tty;
         assert(terminal_fd == -1 || !!!"esh_sys_tty_init already called");
 
-        terminal_fd = open(tty = ctermid(NULL), O_RDWR);
+        terminal_fd = esh_open_cloexec(tty = ctermid(NULL), O_RDWR, 0);
         if (terminal_fd == -1)
                 esh_sys_fatal_error("opening controlling terminal %s failed: ", tty);
 
-        if (esh_set_cloexec(terminal_fd))
-                esh_sys_fatal_error("cannot mark terminal fd FD_CLOEXEC");
-
         esh_sys_tty_save(&saved_tty_state);
         return &saved_tty_state;
 }
@@ -9,6 +9,7 @@
 
 #include <stdbool.h>
 #include <signal.h>
+#include <sys/types.h>
 
 /* Print message to stderr, followed by information about current error. 
  * Use like 'printf' */
@@ -18,6 +19,25 @@ void esh_sys_fatal_error(char *fmt, ...);
 /* Set the 'close-on-exec' flag on fd, return error indicator */
 int esh_set_cloexec(int fd);
 
+/* Clear the 'close-on-exec' flag on fd, return error indicator */
+int esh_clear_cloexec(int fd);
+
+/* Like pipe(2), but both ends are created close-on-exec */
+int esh_pipe_cloexec(int fds[2]);
+
+/* Like open(2), but the descriptor is created close-on-exec */
+int esh_open_cloexec(const char *path, int flags, mode_t mode);
+
+/* Mark every descriptor from lowfd on close-on-exec, so that a child
+ * inherits only what it dup2()s or clears afterwards.
+ * Return error indicator */
+int esh_cloexec_from(int lowfd);
+
+/* Remove the Unix socket at path if no process listens on it any
+ * more.  Return false, after a message that starts with 'who', if
+ * something else is at path, such as a file or a live socket. */
+bool esh_remove_stale_socket(const char *who, const char *path);
+
 /* Get a file descriptor that refers to controlling terminal */
 int esh_sys_tty_getfd(void);
 
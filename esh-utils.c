@@ -6,10 +6,13 @@
  * Virginia Tech.
  */
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <dlfcn.h>
 #include <limits.h>
+#include <unistd.h>
 
 #include "esh.h"
 
@@ -32,10 +35,30 @@ esh_command_create(char ** argv,
     cmd->iored_output = iored_output;
     cmd->argv = argv;
     cmd->append_to_output = append_to_output;
+    cmd->deferred = NULL;
+    cmd->redirects = NULL;
+    cmd->batch_jobs = 0;
+    cmd->watch = NULL;
+    cmd->watched = NULL;
 
     return cmd;
 }
 
+/* Create a redirection; 'target' becomes owned by it */
+struct esh_redirect *
+esh_redirect_create(int fd, enum esh_redirect_mode mode,
+                    char *target, int dup_source)
+{
+    struct esh_redirect *redirect = malloc(sizeof *redirect);
+
+    redirect->next = NULL;
+    redirect->fd = fd;
+    redirect->mode = mode;
+    redirect->target = target;
+    redirect->dup_source = dup_source;
+    return redirect;
+}
+
 /* Create a new pipeline containing only one command */
 struct esh_pipeline *
 esh_pipeline_create(struct esh_command *cmd)
@@ -43,8 +66,12 @@ esh_pipeline_create(struct esh_command *cmd)
     struct esh_pipeline *pipe = malloc(sizeof *pipe);
 
     pipe->bg_job = false;
+    pipe->connector = ESH_CONNECT_ALWAYS;
+    pipe->sched = NULL;
+    pipe->quiet = false;
     cmd->pipeline = pipe;
     list_init(&pipe->commands);
+    list_init(&pipe->procsubs);
     list_push_back(&pipe->commands, &cmd->elem);
     return pipe;
 }
@@ -105,6 +132,15 @@ esh_command_print(struct esh_command *cmd)
 
     if (cmd->iored_input)
         printf("  stdin reads from %s\n", cmd->iored_input);
+
+    static const char * modes[] = { "<", ">", ">>", "<>", ">&", "<<<" };
+    struct esh_redirect *r;
+    for (r = cmd->redirects; r; r = r->next) {
+        if (r->mode == ESH_REDIRECT_DUP)
+            printf("  redirect %d%s%d\n", r->fd, modes[r->mode], r->dup_source);
+        else if (r->target)
+            printf("  redirect %d%s %s\n", r->fd, modes[r->mode], r->target);
+    }
 }
   
 /* Print esh_pipeline structure to stdout */
@@ -166,6 +202,17 @@ esh_pipeline_free(struct esh_pipeline *pipe)
         e = list_remove(e);
         esh_command_free(cmd);
     }
+
+    e = list_begin (&pipe->procsubs);
+    for (; e != list_end (&pipe->procsubs); ) {
+        struct esh_procsub *procsub = list_entry(e, struct esh_procsub, elem);
+        e = list_remove(e);
+        if (procsub->fd != -1)
+            close(procsub->fd);
+        free(procsub->text);
+        free(procsub);
+    }
+    free(pipe->sched);
     free(pipe);
 }
 
@@ -180,11 +227,24 @@ esh_command_free(struct esh_command * cmd)
         free(cmd->iored_input);
     if (cmd->iored_output)
         free(cmd->iored_output);
+    free(cmd->watched);
+    while (cmd->redirects) {
+        struct esh_redirect *next = cmd->redirects->next;
+        free(cmd->redirects->target);
+        free(cmd->redirects);
+        cmd->redirects = next;
+    }
+    while (cmd->deferred) {
+        struct esh_deferred_word *next = cmd->deferred->next;
+        free(cmd->deferred);
+        cmd->deferred = next;
+    }
     free(cmd->argv);
     free(cmd);
 }
 
 #define PSH_MODULE_NAME "esh_module"
+#define PSH_MODULE_VERSION_NAME "esh_module_version"
 
 /* Load a plugin referred to by modname */
 static struct esh_plugin *
@@ -206,6 +266,16 @@ load_plugin(char *modname)
         return NULL;
     }
 
+    /* A version 1 esh_module ends before the version 2 fields: use a
+     * copy of it in which they are zero.  Its own list element, unused,
+     * stays in the plugin. */
+    const int *version = dlsym(handle, PSH_MODULE_VERSION_NAME);
+    if (version == NULL || *version < 2) {
+        struct esh_plugin *v1 = calloc(1, sizeof *v1);
+        memcpy(v1, p, offsetof(struct esh_plugin, prompt_fragment));
+        p = v1;
+    }
+
     printf("done.\n");
     return p;
 }
@@ -0,0 +1,492 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * Shell variables.
+ *
+ * Variables live in an open-addressing hash table with linear probing.
+ * The environment passed to commands is built from the exported
+ * variables only when one of them changed since the last launch.
+ *
+ * $? is not a variable but the exit status of the last pipeline, and
+ * PIPESTATUS holds those of its commands, separated by blanks; as in
+ * bash, ${PIPESTATUS[N]} is the Nth of them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "esh.h"
+
+struct esh_var {
+        char *name;             /* NULL if the slot is free */
+        char *value;
+        bool exported;
+};
+
+/* Marks a slot whose variable was unset; probing continues past it */
+static char tombstone[] = "";
+
+static struct esh_var *table;
+static size_t table_size;       /* Number of slots, a power of 2 */
+static size_t table_used;       /* Slots that are not free, tombstones included */
+static size_t var_count;        /* Live variables */
+
+static char status_text[16] = "0";    /* $? */
+
+static char **envp_cache;       /* NULL-terminated "NAME=VALUE" array */
+static bool envp_dirty = true;  /* An exported variable changed */
+
+/* Shell options, changed with set -o and set +o */
+static struct esh_option {
+        const char *name;
+        bool on;
+} options[] = {
+        { "notify", false },    /* Report background jobs while typing */
+        { "jobshm", false },    /* Mirror the jobs into /esh-<pid> */
+        { "control", false },   /* Listen on the control socket */
+        { "pipefail", false },  /* A pipeline fails if any command fails */
+        { NULL, false }
+};
+
+/* FNV-1a */
+static size_t
+hash_name(const char *name, size_t len)
+{
+        size_t h = 2166136261u;
+        size_t i;
+        for (i = 0; i < len; i++) {
+                h ^= (unsigned char) name[i];
+                h *= 16777619u;
+        }
+        return h;
+}
+
+/* Return the slot of the variable called name[0..len), or, if there
+ * is none, the slot where it would be inserted. */
+static struct esh_var *
+lookup(const char *name, size_t len)
+{
+        size_t mask = table_size - 1;
+        size_t i = hash_name(name, len) & mask;
+        struct esh_var *free_slot = NULL;
+
+        for (;; i = (i + 1) & mask) {
+                struct esh_var *var = &table[i];
+                if (var->name == NULL)
+                        return free_slot ? free_slot : var;
+
+                if (var->name == tombstone) {
+                        if (free_slot == NULL)
+                                free_slot = var;
+                } else if (!strncmp(var->name, name, len) && var->name[len] == '\0') {
+                        return var;
+                }
+        }
+}
+
+static void
+grow_table(void)
+{
+        struct esh_var *old = table;
+        size_t old_size = table_size;
+
+        /* rehashing also drops the tombstones */
+        table_size = old_size ? 2 * old_size : 64;
+        table = calloc(table_size, sizeof *table);
+        table_used = var_count;
+
+        size_t i;
+        for (i = 0; i < old_size; i++) {
+                if (old[i].name && old[i].name != tombstone)
+                        *lookup(old[i].name, strlen(old[i].name)) = old[i];
+        }
+        free(old);
+}
+
+/* Return true if name is a valid variable name */
+static bool
+is_name(const char *name)
+{
+        if (!isalpha((unsigned char) *name) && *name != '_')
+                return false;
+        while (*++name)
+                if (!isalnum((unsigned char) *name) && *name != '_')
+                        return false;
+        return true;
+}
+
+/* Return the variable called name, creating it if needed */
+static struct esh_var *
+intern(const char *name)
+{
+        if (4 * (table_used + 1) > 3 * table_size)
+                grow_table();
+
+        struct esh_var *var = lookup(name, strlen(name));
+        if (var->name == NULL || var->name == tombstone) {
+                if (var->name == NULL)
+                        table_used++;
+                var->name = strdup(name);
+                var->value = strdup("");
+                var->exported = false;
+                var_count++;
+        }
+        return var;
+}
+
+/* Import the environment the shell was started with */
+void
+esh_vars_init(char **envp)
+{
+        for (; *envp; envp++) {
+                char *eq = strchr(*envp, '=');
+                if (eq == NULL)
+                        continue;
+
+                char *name = strndup(*envp, eq - *envp);
+                if (is_name(name)) {
+                        esh_var_set(name, eq + 1);
+                        esh_var_export(name);
+                }
+                free(name);
+        }
+}
+
+/* Remove all variables */
+void
+esh_vars_clear(void)
+{
+        size_t i;
+        for (i = 0; i < table_size; i++) {
+                char *name = table[i].name;
+                if (name && name != tombstone) {
+                        /* unset takes care of the exported PATH */
+                        char *copy = strdup(name);
+                        esh_var_unset(copy);
+                        free(copy);
+                }
+        }
+}
+
+/* Return the value of variable name, or NULL if it is not set */
+const char *
+esh_var_get(const char *name)
+{
+        if (table_size == 0)
+                return NULL;
+
+        struct esh_var *var = lookup(name, strlen(name));
+        return var->name && var->name != tombstone ? var->value : NULL;
+}
+
+/* Set variable name to value */
+void
+esh_var_set(const char *name, const char *value)
+{
+        struct esh_var *var = intern(name);
+        free(var->value);
+        var->value = strdup(value);
+
+        if (var->exported) {
+                envp_dirty = true;
+                /* execvpe searches the shell's own PATH */
+                if (!strcmp(name, "PATH"))
+                        setenv("PATH", value, 1);
+        }
+}
+
+/* Mark variable name for export to commands, defining it if needed */
+void
+esh_var_export(const char *name)
+{
+        struct esh_var *var = intern(name);
+        if (!var->exported) {
+                var->exported = true;
+                envp_dirty = true;
+                if (!strcmp(name, "PATH"))
+                        setenv("PATH", var->value, 1);
+        }
+}
+
+/* Remove variable name */
+void
+esh_var_unset(const char *name)
+{
+        if (table_size == 0)
+                return;
+
+        struct esh_var *var = lookup(name, strlen(name));
+        if (var->name == NULL || var->name == tombstone)
+                return;
+
+        if (var->exported) {
+                envp_dirty = true;
+                if (!strcmp(name, "PATH"))
+                        unsetenv("PATH");
+        }
+        free(var->name);
+        free(var->value);
+        var->name = tombstone;
+        var_count--;
+}
+
+/* Return the environment for commands, rebuilt only if an exported
+ * variable changed since the last call. */
+char **
+esh_vars_envp(void)
+{
+        if (!envp_dirty)
+                return envp_cache;
+
+        if (envp_cache) {
+                char **p;
+                for (p = envp_cache; *p; p++)
+                        free(*p);
+                free(envp_cache);
+        }
+
+        size_t n = 0, i;
+        envp_cache = malloc((var_count + 1) * sizeof *envp_cache);
+        for (i = 0; i < table_size; i++) {
+                struct esh_var *var = &table[i];
+                if (var->name == NULL || var->name == tombstone || !var->exported)
+                        continue;
+
+                size_t len = strlen(var->name) + strlen(var->value) + 2;
+                envp_cache[n] = malloc(len);
+                snprintf(envp_cache[n++], len, "%s=%s", var->name, var->value);
+        }
+        envp_cache[n] = NULL;
+        envp_dirty = false;
+        return envp_cache;
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+        return strcmp((*(struct esh_var **) a)->name, (*(struct esh_var **) b)->name);
+}
+
+/* Print the variables, sorted by name, optionally only exported ones */
+static void
+print_vars(bool exported_only)
+{
+        struct esh_var **vars = malloc((var_count + 1) * sizeof *vars);
+        size_t n = 0, i;
+
+        for (i = 0; i < table_size; i++) {
+                struct esh_var *var = &table[i];
+                if (var->name && var->name != tombstone
+                    && (var->exported || !exported_only))
+                        vars[n++] = var;
+        }
+        qsort(vars, n, sizeof *vars, compare_names);
+
+        for (i = 0; i < n; i++)
+                printf("%s%s=%s\n", exported_only ? "export " : "",
+                       vars[i]->name, vars[i]->value);
+        free(vars);
+}
+
+/* Assign a NAME=VALUE word; return false if it is not one */
+static bool
+assign(char *word, bool export)
+{
+        char *eq = strchr(word, '=');
+        if (eq)
+                *eq = '\0';
+
+        bool ok = is_name(word);
+        if (!ok) {
+                fprintf(stderr, "%s: not a valid variable name\n", word);
+        } else {
+                if (eq)
+                        esh_var_set(word, eq + 1);
+                if (export)
+                        esh_var_export(word);
+        }
+
+        if (eq)
+                *eq = '=';
+        return ok;
+}
+
+static struct esh_option *
+find_option(const char *name)
+{
+        struct esh_option *opt;
+        for (opt = options; opt->name; opt++)
+                if (!strcmp(opt->name, name))
+                        return opt;
+        return NULL;
+}
+
+/* Return true if shell option name is on */
+bool
+esh_option_get(const char *name)
+{
+        struct esh_option *opt = find_option(name);
+        return opt && opt->on;
+}
+
+/* Turn shell option name on or off */
+void
+esh_option_set(const char *name, bool on)
+{
+        struct esh_option *opt = find_option(name);
+        if (opt)
+                opt->on = on;
+}
+
+/* The set builtin: 'set' lists all variables,
+ * 'set NAME=VALUE ...' assigns them, 'set -o NAME' and 'set +o NAME'
+ * turn an option on and off, and 'set -o' lists the options. */
+void
+esh_vars_set_builtin(char **argv)
+{
+        if (argv[1] == NULL) {
+                print_vars(false);
+                return;
+        }
+
+        for (argv++; *argv; argv++) {
+                if (!strcmp(*argv, "-o") || !strcmp(*argv, "+o")) {
+                        bool on = **argv == '-';
+                        if (argv[1] == NULL) {
+                                struct esh_option *opt;
+                                for (opt = options; opt->name; opt++)
+                                        printf("%-15s %s\n", opt->name, opt->on ? "on" : "off");
+                                continue;
+                        }
+
+                        struct esh_option *opt = find_option(*++argv);
+                        if (opt)
+                                opt->on = on;
+                        else
+                                fprintf(stderr, "set: %s: no such option\n", *argv);
+                } else if (strchr(*argv, '=') == NULL)
+                        fprintf(stderr, "set: %s: expected NAME=VALUE\n", *argv);
+                else
+                        assign(*argv, false);
+        }
+}
+
+/* The export builtin: 'export' lists exported variables,
+ * 'export NAME[=VALUE] ...' exports them. */
+void
+esh_vars_export_builtin(char **argv)
+{
+        if (argv[1] == NULL) {
+                print_vars(true);
+                return;
+        }
+
+        for (argv++; *argv; argv++)
+                assign(*argv, true);
+}
+
+/* The unset builtin: 'unset NAME ...' */
+void
+esh_vars_unset_builtin(char **argv)
+{
+        for (argv++; *argv; argv++)
+                esh_var_unset(*argv);
+}
+
+/* Write the index'th blank-separated field of value to f */
+static void
+put_field(FILE *f, const char *value, long index)
+{
+        for (;;) {
+                value += strspn(value, " \t\n");
+                size_t len = strcspn(value, " \t\n");
+                if (len == 0)
+                        return;
+                if (index-- == 0) {
+                        fwrite(value, 1, len, f);
+                        return;
+                }
+                value += len;
+        }
+}
+
+/* Return a malloc'd copy of word in which $NAME and ${NAME} are
+ * replaced by the values of the variables, ${NAME[N]} by the Nth
+ * blank-separated field of NAME, and $? by the last exit status;
+ * unset variables expand to nothing.  A $ that starts no name is kept
+ * as is. */
+char *
+esh_vars_expand(const char *word)
+{
+        if (strchr(word, '$') == NULL)
+                return strdup(word);
+
+        char *out;
+        size_t len;
+        FILE *f = open_memstream(&out, &len);
+
+        while (*word) {
+                const char *name = word + 1;
+                bool braced = *word == '$' && *name == '{';
+                if (braced)
+                        name++;
+
+                if (*word == '$' && *name == '?' && (!braced || name[1] == '}')) {
+                        fputs(status_text, f);
+                        word = name + 1 + braced;
+                        continue;
+                }
+
+                size_t n = 0;
+                if (*word == '$' && (isalpha((unsigned char) *name) || *name == '_'))
+                        while (isalnum((unsigned char) name[n]) || name[n] == '_')
+                                n++;
+
+                /* ${NAME[N]} */
+                const char *end = name + n;
+                long index = -1;
+                if (braced && n > 0 && *end == '[' && isdigit((unsigned char) end[1])) {
+                        char *close;
+                        index = strtol(end + 1, &close, 10);
+                        end = *close == ']' ? close + 1 : name;
+                }
+
+                if (n == 0 || (braced && *end != '}')) {
+                        fputc(*word++, f);
+                        continue;
+                }
+
+                if (table_size) {
+                        struct esh_var *var = lookup(name, n);
+                        if (var->name && var->name != tombstone) {
+                                if (index >= 0)
+                                        put_field(f, var->value, index);
+                                else
+                                        fputs(var->value, f);
+                        }
+                }
+                word = end + braced;
+        }
+        fclose(f);
+        return out;
+}
+
+/* Record the exit status of the last pipeline, 'status', and those of
+ * its 'n' commands, for $? and PIPESTATUS */
+void
+esh_vars_set_status(int status, const int *statuses, int n)
+{
+        snprintf(status_text, sizeof status_text, "%d", status);
+
+        char *out;
+        size_t len;
+        FILE *f = open_memstream(&out, &len);
+        int i;
+        for (i = 0; i < n; i++)
+                fprintf(f, i ? " %d" : "%d", statuses[i]);
+        fclose(f);
+        esh_var_set("PIPESTATUS", out);
+        free(out);
+}
@@ -0,0 +1,478 @@
+/*
+ * esh - the 'extensible' shell.
+ *
+ * Watch mode.
+ *
+ *     watch [-d MS] PATHS... -- cmd [| cmd ...]
+ *
+ * is a job that runs the pipeline, then runs it again whenever one of
+ * PATHS changes.  The pipeline is kept as text and parsed anew for each
+ * run, so that its parameters, substitutions and globs are expanded
+ * then, not once for all runs.  The job is a subshell, listed by jobs
+ * as a single entry for as long as it watches; its runs are its
+ * children, in its process group, so that fg, stop and kill, and ^C
+ * and ^Z, reach them.
+ *
+ * Directories are watched with inotify, with their subdirectories, also
+ * those made later, and files through the directory they are in, so
+ * that editors that replace a file by renaming are noticed.  A burst of
+ * changes triggers a single run once no change has come for MS
+ * milliseconds (100 by default).  A run that has not ended by then is
+ * killed first.  Each run reports on standard error how long after the
+ * change it started, and how it ended.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "esh.h"
+#include "esh-sys-utils.h"
+
+#define DEFAULT_DEBOUNCE_MS 100
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE \
+                      | IN_MOVED_FROM | IN_MOVED_TO)
+
+/* Defined in esh.c */
+extern struct esh_shell shell;
+
+struct esh_watch {
+        char *text;                     /* The pipeline that is run */
+        char **paths;
+        int npaths;
+        int debounce_ms;
+};
+
+/* A watch descriptor, the path of its directory, and the name of the
+ * file it is for if the directory was only watched for that file */
+struct watched_dir {
+        int wd;
+        char *path;
+        char *only;
+};
+
+static struct watched_dir *dirs;
+static int ndirs;
+static int inotify_fd = -1;
+
+static long
+ms_since(const struct timespec *then)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (now.tv_sec - then->tv_sec) * 1000 + (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+static void
+add_dir(const char *path, const char *only)
+{
+        int wd = inotify_add_watch(inotify_fd, path, WATCH_EVENTS | IN_ONLYDIR);
+        if (wd == -1) {
+                esh_sys_error("watch: %s: ", path);
+                return;
+        }
+
+        /* a directory that is watched as a whole takes precedence */
+        int i;
+        for (i = 0; i < ndirs; i++)
+                if (dirs[i].wd == wd) {
+                        /* two files of a directory watch all of it */
+                        if (dirs[i].only && (only == NULL || strcmp(dirs[i].only, only))) {
+                                free(dirs[i].only);
+                                dirs[i].only = NULL;
+                        }
+                        return;
+                }
+
+        dirs = realloc(dirs, (ndirs + 1) * sizeof *dirs);
+        dirs[ndirs].wd = wd;
+        dirs[ndirs].path = strdup(path);
+        dirs[ndirs].only = only ? strdup(only) : NULL;
+        ndirs++;
+}
+
+/* Watch the directory path and those below it, except hidden ones */
+static void
+add_tree(const char *path)
+{
+        add_dir(path, NULL);
+
+        DIR *d = opendir(path);
+        if (d == NULL)
+                return;
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+                if (de->d_name[0] == '.')
+                        continue;
+                char sub[PATH_MAX];
+                struct stat st;
+                snprintf(sub, sizeof sub, "%s/%s", path, de->d_name);
+                if (lstat(sub, &st) == 0 && S_ISDIR(st.st_mode))
+                        add_tree(sub);
+        }
+        closedir(d);
+}
+
+static void
+add_path(const char *path)
+{
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+                add_tree(path);
+                return;
+        }
+
+        /* a file, which may not exist yet, is watched through its directory */
+        char *copy = strdup(path);
+        char *slash = strrchr(copy, '/');
+        if (slash == NULL)
+                add_dir(".", copy);
+        else if (slash == copy)
+                add_dir("/", slash + 1);
+        else {
+                *slash = '\0';
+                add_dir(copy, slash + 1);
+        }
+        free(copy);
+}
+
+/* Read the pending inotify events; return true if one of them is for
+ * a watched path */
+static bool
+read_events(void)
+{
+        char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        bool changed = false;
+        ssize_t n;
+        while ((n = read(inotify_fd, buf, sizeof buf)) > 0) {
+                char *p;
+                for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *) p)->len) {
+                        struct inotify_event *ev = (struct inotify_event *) p;
+                        int i;
+                        for (i = 0; i < ndirs && dirs[i].wd != ev->wd; i++)
+                                continue;
+                        if (i == ndirs)
+                                continue;
+                        if (dirs[i].only && (ev->len == 0 || strcmp(dirs[i].only, ev->name)))
+                                continue;
+                        changed = true;
+
+                        /* a directory made in a watched tree is watched too */
+                        if (dirs[i].only == NULL && (ev->mask & IN_ISDIR)
+                            && (ev->mask & (IN_CREATE | IN_MOVED_TO)) && ev->name[0] != '.') {
+                                char sub[PATH_MAX];
+                                snprintf(sub, sizeof sub, "%s/%s", dirs[i].path, ev->name);
+                                add_tree(sub);
+                        }
+                }
+        }
+        return changed;
+}
+
+/* Kill the run that is in flight and wait for it to end */
+static void
+cancel(struct esh_pipeline *pipeline, const sigset_t *mask)
+{
+        struct list_elem *e;
+        for (e = list_begin(&pipeline->commands); e != list_end(&pipeline->commands); e = list_next(e)) {
+                pid_t pid = list_entry(e, struct esh_command, elem)->pid;
+                kill(pid, SIGTERM);
+                kill(pid, SIGCONT);
+        }
+        while (pipeline->stages_running > 0)
+                sigsuspend(mask);
+}
+
+/* Describe how the run that started at 'start' ended */
+static void
+report(int run, struct esh_pipeline *pipeline, const struct timespec *start)
+{
+        fprintf(stderr, "watch: run %d exited with status %d after %.3f s\n", run,
+                esh_pipeline_exit_status(pipeline), ms_since(start) / 1000.0);
+}
+
+/* Parse the watched pipeline for the next run; NULL if it cannot be */
+static struct esh_pipeline *
+parse_run(struct esh_watch *w)
+{
+        struct esh_command_line *cline = shell.parse_command_line(w->text);
+        if (cline == NULL)
+                return NULL;
+        struct esh_pipeline *pipeline = NULL;
+        if (!list_empty(&cline->pipes))
+                pipeline = list_entry(list_pop_front(&cline->pipes), struct esh_pipeline, elem);
+        esh_command_line_free(cline);
+        return pipeline;
+}
+
+/* The body of the watch job, in the child the shell forked for it */
+void
+esh_watch_run(struct esh_watch *w)
+{
+        /* a subshell: its runs are its own jobs, in its process group */
+        esh_job_control = false;
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        esh_signal_block(SIGCHLD);
+        sigset_t mask;
+        sigprocmask(SIG_SETMASK, NULL, &mask);
+        sigdelset(&mask, SIGCHLD);
+
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd == -1)
+                esh_sys_fatal_error("watch: inotify_init: ");
+        int i;
+        for (i = 0; i < w->npaths; i++)
+                add_path(w->paths[i]);
+
+        struct esh_pipeline *pipeline = NULL;
+        struct timespec change, start;
+        bool pending = true, running = false;
+        int run = 0;
+        clock_gettime(CLOCK_MONOTONIC, &change);
+        struct timespec last = change;
+
+        for (;;) {
+                if (running && pipeline->stages_running == 0) {
+                        report(run, pipeline, &start);
+                        running = false;
+                }
+
+                if (pending && ms_since(&last) >= w->debounce_ms) {
+                        pending = false;
+                        if (running) {
+                                cancel(pipeline, &mask);
+                                fprintf(stderr, "watch: run %d cancelled\n", run);
+                                running = false;
+                        }
+
+                        clock_gettime(CLOCK_MONOTONIC, &start);
+                        fprintf(stderr, "watch: run %d started %ld ms after the change\n",
+                                ++run, ms_since(&change));
+                        int status = 2;
+                        pipeline = parse_run(w);
+                        running = false;
+                        if (pipeline) {
+                                pipeline->bg_job = true;
+                                running = esh_pipeline_run(pipeline, &status);
+                                esh_signal_block(SIGCHLD);
+                                /* a launched pipeline is the shell's, as a job */
+                                if (!running)
+                                        esh_pipeline_free(pipeline);
+                        }
+                        if (!running)
+                                fprintf(stderr, "watch: run %d exited with status %d\n",
+                                        run, status);
+                }
+
+                struct timespec timeout, *tp = NULL;
+                if (pending) {
+                        long left = w->debounce_ms - ms_since(&last);
+                        if (left < 0)
+                                left = 0;
+                        timeout.tv_sec = left / 1000;
+                        timeout.tv_nsec = left % 1000 * 1000000;
+                        tp = &timeout;
+                }
+                struct pollfd pfd = { .fd = inotify_fd, .events = POLLIN };
+                if (ppoll(&pfd, 1, tp, &mask) > 0 && read_events()) {
+                        /* the latency is counted from the first change of a burst */
+                        if (!pending)
+                                clock_gettime(CLOCK_MONOTONIC, &change);
+                        clock_gettime(CLOCK_MONOTONIC, &last);
+                        pending = true;
+                }
+        }
+}
+
+/* Write cmd to out as it was typed, from its argv[from] on */
+static void
+print_command(FILE *out, struct esh_command *cmd, int from)
+{
+        struct esh_deferred_word *word = cmd->deferred;
+        int i;
+        for (i = from; cmd->argv[i]; i++) {
+                while (word && word->index < i)
+                        word = word->next;
+                fputs(i > from ? " " : "", out);
+                if (word && word->index == i && word->kind == ESH_WORD_PROCESS_INPUT)
+                        fprintf(out, "<(%s)", cmd->argv[i]);
+                else if (word && word->index == i && word->kind == ESH_WORD_PROCESS_OUTPUT)
+                        fprintf(out, ">(%s)", cmd->argv[i]);
+                else
+                        fputs(cmd->argv[i], out);
+        }
+
+        struct esh_redirect *r;
+        for (r = cmd->redirects; r; r = r->next) {
+                switch (r->mode) {
+                case ESH_REDIRECT_INPUT:
+                        if (r->target)
+                                fprintf(out, " %d<%s", r->fd, r->target);
+                        else
+                                fprintf(out, " <%s", cmd->iored_input);
+                        break;
+                case ESH_REDIRECT_OUTPUT:
+                        if (r->target)
+                                fprintf(out, " %d>%s", r->fd, r->target);
+                        else
+                                fprintf(out, " >%s", cmd->iored_output);
+                        break;
+                case ESH_REDIRECT_APPEND:
+                        if (r->target)
+                                fprintf(out, " %d>>%s", r->fd, r->target);
+                        else
+                                fprintf(out, " >>%s", cmd->iored_output);
+                        break;
+                case ESH_REDIRECT_READWRITE:
+                        fprintf(out, " %d<>%s", r->fd, r->target);
+                        break;
+                case ESH_REDIRECT_DUP:
+                        fprintf(out, " %d>&%d", r->fd, r->dup_source);
+                        break;
+                case ESH_REDIRECT_HERESTRING:
+                        fprintf(out, " <<<%s", r->target);
+                        break;
+                }
+        }
+}
+
+/* If pipeline is 'watch ... -- cmd | cmd...', before it is expanded,
+ * keep the text of what is watched, with the attributes in front of
+ * watch, in the first command, and leave only 'watch ...' in pipeline. */
+void
+esh_watch_split(struct esh_pipeline *pipeline)
+{
+        struct esh_command *first = list_entry(list_front(&pipeline->commands),
+                                               struct esh_command, elem);
+        struct esh_deferred_word *word = first->deferred;
+        char **argv = first->argv;
+        int attrs = 0, i;
+
+        /* a word that is expanded is neither an attribute, nor watch, nor -- */
+        for (i = 0; argv[i]; i++) {
+                while (word && word->index < i)
+                        word = word->next;
+                bool literal = word == NULL || word->index != i;
+                if (i == attrs) {
+                        if (literal && argv[i + 1] && strchr(argv[i], '=')) {
+                                attrs++;
+                                continue;
+                        }
+                        if (!literal || strcmp(argv[i], "watch"))
+                                return;
+                } else if (literal && !strcmp(argv[i], "--"))
+                        break;
+        }
+        if (argv[i] == NULL || argv[i + 1] == NULL)
+                return;
+
+        char *text;
+        size_t size;
+        FILE *out = open_memstream(&text, &size);
+        int j;
+        for (j = 0; j < attrs; j++)
+                fprintf(out, "%s ", argv[j]);
+        print_command(out, first, i + 1);
+        struct list_elem *e;
+        for (e = list_next(&first->elem); e != list_end(&pipeline->commands); ) {
+                struct esh_command *cmd = list_entry(e, struct esh_command, elem);
+                fputs(" | ", out);
+                print_command(out, cmd, 0);
+                e = list_remove(e);
+                esh_command_free(cmd);
+        }
+        fclose(out);
+        first->watched = text;
+
+        /* what follows -- is left to the runs */
+        for (j = i; argv[j]; j++)
+                free(argv[j]);
+        argv[i] = NULL;
+        struct esh_deferred_word **link = &first->deferred;
+        while (*link && (*link)->index < i)
+                link = &(*link)->next;
+        while (*link) {
+                struct esh_deferred_word *next = (*link)->next;
+                free(*link);
+                *link = next;
+        }
+        while (first->redirects) {
+                struct esh_redirect *next = first->redirects->next;
+                free(first->redirects->target);
+                free(first->redirects);
+                first->redirects = next;
+        }
+        free(first->iored_input);
+        free(first->iored_output);
+        first->iored_input = first->iored_output = NULL;
+        first->append_to_output = false;
+        esh_pipeline_finish(pipeline);
+}
+
+/* Turn a pipeline that starts with 'watch', which esh_watch_split
+ * split, into the watch job that runs it.  Return the job, or NULL
+ * after a usage error. */
+struct esh_pipeline *
+esh_watch_prepare(struct esh_pipeline *pipeline)
+{
+        struct esh_command *first = list_entry(list_front(&pipeline->commands),
+                                               struct esh_command, elem);
+        char **argv = first->argv;
+        int debounce_ms = DEFAULT_DEBOUNCE_MS, i = 1;
+
+        if (argv[i] && !strcmp(argv[i], "-d")) {
+                char *end = NULL;
+                if (argv[i + 1])
+                        debounce_ms = strtol(argv[i + 1], &end, 10);
+                if (end == NULL || *end || debounce_ms < 0) {
+                        fprintf(stderr, "watch: -d expects milliseconds\n");
+                        return NULL;
+                }
+                i += 2;
+        }
+        if (argv[i] == NULL || first->watched == NULL) {
+                fprintf(stderr, "usage: watch [-d MS] PATHS... -- command [args...]\n");
+                return NULL;
+        }
+        if (first->deferred) {
+                fprintf(stderr, "watch: process substitutions cannot be watched\n");
+                return NULL;
+        }
+
+        struct esh_watch *w = malloc(sizeof *w);
+        w->text = strdup(first->watched);
+        w->debounce_ms = debounce_ms;
+        int argc = i;
+        while (argv[argc])
+                argc++;
+        w->npaths = argc - i;
+        w->paths = malloc(w->npaths * sizeof *w->paths);
+        int n;
+        for (n = 0; n < w->npaths; n++)
+                w->paths[n] = strdup(argv[i + n]);
+
+        /* jobs shows the whole line */
+        char **shown = malloc((argc + 3) * sizeof *shown);
+        for (n = 0; n < argc; n++)
+                shown[n] = strdup(argv[n]);
+        shown[n++] = strdup("--");
+        shown[n++] = strdup(w->text);
+        shown[n] = NULL;
+
+        struct esh_command *cmd = esh_command_create(shown, NULL, NULL, false);
+        cmd->watch = w;
+        struct esh_pipeline *job = esh_pipeline_create(cmd);
+        esh_pipeline_finish(job);
+        job->bg_job = pipeline->bg_job;
+        return job;
+}
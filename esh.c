@@ -5,15 +5,18 @@
  * Virginia Tech.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <readline/readline.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <signal.h>
 #include <sys/wait.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #include "esh.h"
 #include "esh-sys-utils.h"
@@ -25,6 +28,14 @@
 #define BG 4
 #define KILL 5
 #define STOP 6
+#define SET 7
+#define EXPORT 8
+#define UNSET 9
+#define HISTORY 10
+#define SENDLINE 11
+#define READLINE_FROM 12
+#define DAG 13
+#define RENICE 14
 #define DEFAULT 0
 
 /* List of current pipelines/jobs */
@@ -34,14 +45,38 @@ struct list current_pipelines;
 // If the current_pipelines is empty this number will comeback to 0.
 int pipeline_num;
 
-static void usage(char *progname);
+// The terminal state of the shell, restored whenever it gets the terminal back
+static struct termios *terminal;
 
-/* Build a prompt by assembling fragments from loaded plugins that
- * implement 'make_prompt.'
- *
- * This function demonstrates how to iterate over all loaded plugins.
- */
-static char * build_prompt_from_plugins(void);
+// Subshells run their pipelines without job control
+bool esh_job_control = true;
+
+// Exit status of the last pipeline, $?, recorded in the history
+static int last_status;
+
+// Set while the control socket runs a job: builtins would run in the shell
+static bool refuse_builtins;
+
+// The job run_pipeline launched last, which watch may have made anew
+static struct esh_pipeline *launched_job;
+
+// Job status changes are queued by the reaper, which may run in the SIGCHLD
+// handler, and printed by the main loop when it is safe to do so.
+// SIGCHLD must be blocked to access the queue outside the handler.
+#define NOTIFY_QUEUE_SIZE 64
+#define NOTIFY_LINE_MAX 256
+static char notify_queue[NOTIFY_QUEUE_SIZE][NOTIFY_LINE_MAX];
+static int notify_head, notify_count, notify_dropped;
+
+// The plugins that implement command_status_change, in rank order,
+// so that the reaper does not walk the whole plugin list for every event
+static struct esh_plugin **status_subscribers;
+static int status_subscriber_count;
+
+// Names of the job states, indexed by enum job_status
+static const char *jobs_status[]={"Running","Running","Stopped","Done"};
+
+static void usage(char *progname);
 
 // To return a MACRO number for each command
 int builtin_command(char *command);
@@ -55,6 +90,14 @@ static struct esh_pipeline * get_job_from_jid(int jid);
 // Return pipline whose pgrp equals the given pgrp
 static struct esh_pipeline * get_job_from_pgrp(pid_t pgrp);
 
+// Fork the processes of a pipeline and add it to the current pipelines.
+// SIGCHLD must be blocked, and pipeline->pgrp set or -1.
+static void launch_pipeline(struct esh_pipeline *pipeline);
+
+// Run a pipeline, either as a builtin or as a job.
+// Return true if the pipeline now belongs to current_pipelines.
+static bool run_pipeline(struct esh_pipeline *pipeline);
+
 // From the website
 static void give_terminal_to(pid_t pgrp, struct termios *pg_tty_state);
 
@@ -64,7 +107,13 @@ static void print_pipeline(struct esh_pipeline *pipeline);
 // Print the status of the pipeline
 static void print_pipeline_status(struct esh_pipeline *pipeline);
 
-// If the pipeline is foreground, the shell needs to wait for it and get terminal back
+// Record status as $?, and as the PIPESTATUS of a single command
+static void set_status(int status);
+
+// Record the exit status of a foreground pipeline that has ended or stopped
+static void set_pipeline_status(struct esh_pipeline *pipeline);
+
+// Wait until a foreground pipeline has ended or stopped.  SIGCHLD must be blocked.
 void wait_for_pipeline(struct esh_pipeline *pipeline,struct termios *terminal);
 
 // Every time parent receives a signal, it needs to change status of the child.
@@ -76,11 +125,32 @@ static void child_handler(int sig, siginfo_t *info, void *_ctxt);
 // The handler of the signal sent by ctrl+z which is SIGTSTP
 static void ctrlz_handler(int sig, siginfo_t *info, void *_ctxt);
 
-// To determine if the command specified by PID is with in the pipeline
-static bool is_pipeline_last_command(struct esh_pipeline *pipeline,pid_t pid);
+// Return the command of the pipeline whose process is PID, or NULL
+static struct esh_command *find_command(struct esh_pipeline *pipeline,pid_t pid);
+
+// Return the process substitution of the pipeline whose subshell is PID, or NULL
+static struct esh_procsub *find_procsub(struct esh_pipeline *pipeline,pid_t pid);
+
+// The pipeline was sent SIGCONT, so none of its stages is stopped any more
+static void mark_continued(struct esh_pipeline *pipeline);
+
+// Queue a line reporting the status of the pipeline; async-signal-safe
+static void queue_notification(struct esh_pipeline *pipeline,bool newline);
 
-// To determine if the command specified by PID is at the end of the pipeline
-static bool is_pipeline_has_command(struct esh_pipeline *pipeline,pid_t pid);
+// Print the queued notifications, redrawing the input line if readline shows one
+static void drain_notifications(bool redraw);
+
+// Called by readline while it waits for input, if the notify option is on
+static int notify_event_hook(void);
+
+// Fill in status_subscribers from the loaded plugins
+static void collect_subscribers(void);
+
+// Let the plugins that want to rewrite a raw command line do so
+static void process_raw_cmdline(char **cmdline);
+
+// Return true if the command is a builtin of the shell or of a plugin
+static bool is_builtin(struct esh_command *command);
 
 /* The shell object plugins use.
  * Some methods are set to defaults.
@@ -90,9 +160,23 @@ struct esh_shell shell =
         .get_jobs=get_jobs,
         .get_job_from_jid=get_job_from_jid,
         .get_job_from_pgrp=get_job_from_pgrp,
-        .build_prompt = build_prompt_from_plugins,
-        .readline = readline, /* GNU readline(3) */
-        .parse_command_line = esh_parse_command_line /* Default parser */
+        .build_prompt = esh_prompt_build, /* Plugins' fragments, cached */
+        .readline = esh_history_readline, /* GNU readline(3) with history */
+        .parse_command_line = esh_parse_command_line, /* Default parser */
+        .register_completion = esh_complete_register,
+        .invalidate_prompt = esh_prompt_invalidate,
+        .open_input = esh_input_open, /* Regular files are mapped */
+        .read_input = esh_input_read,
+        .read_input_line = esh_input_getline,
+        .close_input = esh_input_close,
+        .register_printing_builtin = esh_register_printing_builtin
+};
+
+// Names of the builtins, offered by tab completion
+static const char *builtin_names[] = {
+        "exit", "jobs", "fg", "bg", "kill", "stop",
+        "set", "export", "unset", "history", "batch",
+        "coproc", "sendline", "readline-from", "memo", "dag", "watch", "renice", NULL
 };
 
 int main(int ac, char *av[])
@@ -100,10 +184,19 @@ int main(int ac, char *av[])
         // Initialize the list of plugins
         list_init(&esh_plugin_list);
 
+        // Shell variables start out as the exported environment
+        esh_vars_init(environ);
+
         // Parse the option of user input
         int opt;
+        char *command_string=NULL;
+        char *server_socket=NULL;
+        static const struct option long_options[]={
+                { "server", required_argument, NULL, 'S' },
+                { NULL, 0, NULL, 0 }
+        };
         /* Process command-line arguments. See getopt(3) */
-        while ((opt = getopt(ac, av, "hp:")) > 0) {
+        while ((opt = getopt_long(ac, av, "hp:c:", long_options, NULL)) > 0) {
                 switch (opt) {
                 case 'h':
                         usage(av[0]);
@@ -114,42 +207,83 @@ int main(int ac, char *av[])
                         esh_plugin_load_from_directory(optarg);
 
                         break;
+
+                case 'c':
+                        command_string=optarg;
+                        break;
+
+                case 'S':
+                        server_socket=optarg;
+                        break;
                 }
         }
 
         // Initialize the shell by any plugin
         esh_plugin_initialize(&shell);
 
+        // Plugins with asynchronous hooks get a thread of their own
+        esh_hooks_start();
+        collect_subscribers();
+
+        // Tab completion knows the builtins and indexes PATH in the background
+        const char **name;
+        for(name=builtin_names; *name; name++) {
+                esh_complete_register(*name);
+        }
+        if(isatty(0)) {
+                esh_complete_init();
+        }
+
         // Initialize the pipeline list
         list_init(&current_pipelines);
 
         // We now have zero pipelines
         pipeline_num=0;
 
+        // A command string, and every request to a server, runs without a terminal or job control
+        if(command_string!=NULL || server_socket!=NULL) {
+                esh_job_control=false;
+                esh_signal_sethandler(SIGCHLD,child_handler);
+                fflush(stdout);
+                if(server_socket!=NULL) {
+                        esh_server_run(server_socket);
+                }
+                return esh_command_string_run(command_string);
+        }
+
         // The main process is the parent of its own
         setpgid(0,0);
 
         // Initialize the termianal state and give it to the main process
-        struct termios *terminal=esh_sys_tty_init();
+        terminal=esh_sys_tty_init();
         give_terminal_to(getpgrp(),terminal);
 
+        // While readline waits for input, the event loop serves the control socket
+        rl_getc_function=esh_event_getc;
+
         // Install handler for SIGCHLD and SIGTSTP
         esh_signal_sethandler(SIGCHLD,child_handler);
         esh_signal_sethandler(SIGTSTP,ctrlz_handler);
 
         // Read/eval loop
         for (;; ) {
+                // Report background jobs before the prompt, or also while typing with set -o notify
+                drain_notifications(false);
+                // A memoized command that was stopped shows its output from here on
+                bool was_blocked=esh_signal_block(SIGCHLD);
+                esh_memo_poll();
+                if(!was_blocked) {
+                        esh_signal_unblock(SIGCHLD);
+                }
+                esh_jobs_shm_sync(&current_pipelines);
+                esh_control_sync();
+                rl_event_hook=esh_option_get("notify") ? notify_event_hook : NULL;
+
                 char * prompt = isatty(0) ? shell.build_prompt() : NULL;
                 char * cmdline = shell.readline(prompt);
 
                 // To check if any plugin wants to change command line
-                struct list_elem *e;
-                for(e=list_begin(&esh_plugin_list); e!=list_end(&esh_plugin_list); e=list_next(e)) {
-                        struct esh_plugin * plugin=list_entry(e,struct esh_plugin,elem);
-                        if(plugin->process_raw_cmdline) {
-                                plugin->process_raw_cmdline(&cmdline);
-                        }
-                }
+                process_raw_cmdline(&cmdline);
 
                 free (prompt);
 
@@ -166,329 +300,608 @@ int main(int ac, char *av[])
                         continue;
                 }
 
-                // Load the first pipiline from the command line
-                struct esh_pipeline *pipeline=list_entry(list_begin(&cline->pipes),struct esh_pipeline,elem);
+                last_status=0;
+                esh_command_line_run(cline);
+                esh_command_line_free(cline);
+                esh_history_finish(last_status);
+        }// end of the wholie cline
+        return 0;
+}
 
-                // To check if any plugin wants to change pipeline
-                for(e=list_begin(&esh_plugin_list); e!=list_end(&esh_plugin_list); e=list_next(e)) {
-                        struct esh_plugin * plugin=list_entry(e,struct esh_plugin,elem);
-                        if(plugin->process_pipeline) {
-                                plugin->process_pipeline(pipeline);
+static void process_raw_cmdline(char **cmdline)
+{
+        struct list_elem *e;
+        for(e=list_begin(&esh_plugin_list); e!=list_end(&esh_plugin_list); e=list_next(e)) {
+                struct esh_plugin * plugin=list_entry(e,struct esh_plugin,elem);
+                if(plugin->process_raw_cmdline) {
+                        plugin->process_raw_cmdline(cmdline);
+                }
+        }
+}
+
+int esh_command_string_run(char *text)
+{
+        char *cmdline=strdup(text);
+        process_raw_cmdline(&cmdline);
+        if(cmdline==NULL) {
+                return 0;
+        }
+
+        struct esh_command_line *cline=shell.parse_command_line(cmdline);
+        free(cmdline);
+        if(cline==NULL) {
+                return 2;
+        }
+
+        last_status=0;
+        esh_command_line_run(cline);
+        esh_command_line_free(cline);
+        fflush(stdout);
+        return last_status;
+}
+
+void esh_command_line_run(struct esh_command_line *cline)
+{
+        // Run the pipelines one after another, in the order they were typed
+        while(!list_empty(&cline->pipes)) {
+                struct list_elem *e=list_pop_front(&cline->pipes);
+                struct esh_pipeline *pipeline=list_entry(e,struct esh_pipeline,elem);
+
+                // 'a && b' and 'a || b' skip b according to how a ended, leaving $? alone
+                if((pipeline->connector==ESH_CONNECT_AND && last_status!=0)
+                   || (pipeline->connector==ESH_CONNECT_OR && last_status==0)) {
+                        esh_pipeline_free(pipeline);
+                        continue;
+                }
+                if(!run_pipeline(pipeline)) {
+                        esh_pipeline_free(pipeline);
+                }
+        }
+}
+
+bool esh_pipeline_run(struct esh_pipeline *pipeline,int *status)
+{
+        bool launched=run_pipeline(pipeline);
+        *status=last_status;
+        return launched;
+}
+
+struct esh_pipeline *esh_pipeline_run_job(struct esh_pipeline *pipeline)
+{
+        pipeline->bg_job=true;
+        refuse_builtins=true;
+        launched_job=NULL;
+        if(!run_pipeline(pipeline)) {
+                launched_job=NULL;
+        }
+        refuse_builtins=false;
+        return launched_job;
+}
+
+static bool run_pipeline(struct esh_pipeline *pipeline)
+{
+        struct list_elem *e;
+
+        // What watch runs is parsed and expanded anew for each run
+        esh_watch_split(pipeline);
+
+        // Substitute the words that could not be expanded by the parser
+        for(e=list_begin(&pipeline->commands); e!=list_end(&pipeline->commands); e=list_next(e)) {
+                struct esh_command *command=list_entry(e,struct esh_command,elem);
+                if(!esh_command_expand(command)) {
+                        set_status(1);
+                        return false;
+                }
+                // $(true) expands to nothing at all
+                if(command->argv[0]==NULL) {
+                        if(list_size(&pipeline->commands)>1) {
+                                fprintf(stderr, "Invalid null command.\n");
+                                set_status(1);
+                        }else{
+                                set_status(0);
                         }
+                        return false;
                 }
+        }
 
-                // Load the first command from the pipeline
-                struct esh_command *command=list_entry(list_begin(&pipeline->commands),struct esh_command,elem);
+        // The pipeline's copies of its redirections may have been expanded
+        esh_pipeline_finish(pipeline);
 
-                // Parse the command
-                int command_num = builtin_command(command->argv[0]);
+        // Attributes such as cpus=0-3 and nice=10 in front of the pipeline apply to all of it;
+        // they go first, so that batch and globbing see the command itself
+        if(!esh_pipeline_sched_prefix(pipeline)) {
+                set_status(2);
+                return false;
+        }
 
-                // Check if the command is defined by pluggins, if it is, run it
-                // and change command_num so that our shell won't run it
+        // Globbing needs to know whether an oversized argv may be split
+        for(e=list_begin(&pipeline->commands); e!=list_end(&pipeline->commands); e=list_next(e)) {
+                struct esh_command *command=list_entry(e,struct esh_command,elem);
+                if(!esh_command_batch_prefix(command) || !esh_command_glob(command)) {
+                        set_status(1);
+                        return false;
+                }
+        }
+
+        // 'watch PATHS -- pipeline' is a job that runs the pipeline again whenever PATHS change
+        if(!strcmp(list_entry(list_begin(&pipeline->commands),struct esh_command,elem)->argv[0],"watch")) {
+                pipeline=esh_watch_prepare(pipeline);
+                if(pipeline==NULL) {
+                        set_status(2);
+                        return false;
+                }
+        }
+
+        // 'memo cmd' replays what cmd printed the last time it was run
+        // with the same inputs, or captures it to do so next time
+        struct esh_command *command=list_entry(list_begin(&pipeline->commands),struct esh_command,elem);
+        bool memo=!strcmp(command->argv[0],"memo");
+        if(memo) {
+                int status;
+                if(!esh_memo_prepare(pipeline,&status)) {
+                        set_status(status);
+                        return false;
+                }
+        }
+
+        // A job started through the control socket must not be a builtin,
+        // which would run in the shell, not in the job
+        if(refuse_builtins && is_builtin(command)) {
+                if(memo) {
+                        esh_memo_cancel();
+                }
+                set_status(2);
+                return false;
+        }
+
+        // Start the process substitutions first; the first one to be
+        // forked becomes the leader of the job's process group
+        esh_signal_block(SIGCHLD);
+        pipeline->pgrp=esh_job_control ? -1 : getpgrp();
+        for(e=list_begin(&pipeline->commands); e!=list_end(&pipeline->commands); e=list_next(e)) {
+                struct esh_command *command=list_entry(e,struct esh_command,elem);
+                if(!esh_command_start_procsubs(command)) {
+                        if(memo) {
+                                esh_memo_cancel();
+                        }
+                        esh_signal_unblock(SIGCHLD);
+                        set_status(1);
+                        return false;
+                }
+        }
+
+        // To check if any plugin wants to change pipeline
+        for(e=list_begin(&esh_plugin_list); e!=list_end(&esh_plugin_list); e=list_next(e)) {
+                struct esh_plugin * plugin=list_entry(e,struct esh_plugin,elem);
+                if(plugin->process_pipeline) {
+                        plugin->process_pipeline(pipeline);
+                }
+        }
+
+        // Run the first command if it is a builtin.  Builtins succeed
+        // unless they say otherwise, as fg does.
+        set_status(0);
+        if(esh_command_run_builtin(command)) {
+                // what a builtin prints is not captured
+                if(memo) {
+                        esh_memo_cancel();
+                }
+                esh_signal_unblock(SIGCHLD);
+                return false;
+        }
+
+        // 'coproc NAME cmd' runs cmd in the background, connected to the shell by pipes
+        bool coproc=!strcmp(command->argv[0],"coproc");
+        if(coproc && !esh_coproc_prepare(pipeline)) {
+                esh_signal_unblock(SIGCHLD);
+                set_status(2);
+                return false;
+        }
+
+        launch_pipeline(pipeline);
+        launched_job=pipeline;
+        if(coproc) {
+                esh_coproc_launched(pipeline);
+        }
+        if(memo) {
+                esh_memo_launched();
+        }
+
+        // Change pipeline status and give terminal
+        if(pipeline->bg_job) {
+                pipeline->status=BACKGROUND;
+                struct esh_command *last=list_entry(list_back(&pipeline->commands),struct esh_command,elem);
+                // Subshells, such as the watch job, run background jobs quietly
+                if(esh_job_control && !pipeline->quiet) {
+                        printf("[%d] %d\n",pipeline->jid,last->pid);
+                }
+        }else{
+                pipeline->status=FOREGROUND;
+                if(esh_job_control) {
+                        give_terminal_to(pipeline->pgrp,terminal);
+                }
+
+                wait_for_pipeline(pipeline,terminal);
+                set_pipeline_status(pipeline);
+
+                if(esh_job_control) {
+                        give_terminal_to(getpgrp(),terminal);
+                }
+                if(memo) {
+                        esh_memo_finish(pipeline);
+                }
+        }
+        esh_signal_unblock(SIGCHLD);
+        return true;
+}
+
+static bool is_builtin(struct esh_command *command)
+{
+        if(builtin_command(command->argv[0])!=DEFAULT || !strcmp(command->argv[0],"coproc")) {
+                return true;
+        }
+
+        // Only a plugin's process_builtin knows its names, and it runs the
+        // builtin when it recognizes one: ask in a child that is thrown away,
+        // with its standard descriptors on /dev/null
+        bool was_blocked=esh_signal_block(SIGCHLD);
+        fflush(NULL);
+        pid_t pid=fork();
+        if(pid==0) {
+                int null=open("/dev/null",O_RDWR);
+                dup2(null,0);
+                dup2(null,1);
+                dup2(null,2);
+                struct list_elem *e;
                 for(e=list_begin(&esh_plugin_list); e!=list_end(&esh_plugin_list); e=list_next(e)) {
                         struct esh_plugin *plugin=list_entry(e,struct esh_plugin,elem);
-                        if(plugin->process_builtin) {
-                                if(plugin->process_builtin(command)) {
-                                        command_num=-1;
-                                }
+                        if(plugin->process_builtin && plugin->process_builtin(command)) {
+                                _exit(0);
                         }
                 }
+                _exit(1);
+        }
+
+        int status=0;
+        while(pid>0 && waitpid(pid,&status,0)==-1 && errno==EINTR) {
+                continue;
+        }
+        if(!was_blocked) {
+                esh_signal_unblock(SIGCHLD);
+        }
+        // A plugin that exits or crashes on the command took it, too
+        return pid==-1 || !WIFEXITED(status) || WEXITSTATUS(status)!=1;
+}
 
-                // exit
-                if(command_num==EXIT) {
-                        exit(0);
+bool esh_command_run_builtin(struct esh_command *command)
+{
+        // Check if the command is defined by pluggins, if it is, run it
+        // so that our shell won't run it
+        struct list_elem *e;
+        for(e=list_begin(&esh_plugin_list); e!=list_end(&esh_plugin_list); e=list_next(e)) {
+                struct esh_plugin *plugin=list_entry(e,struct esh_plugin,elem);
+                if(plugin->process_builtin) {
+                        if(plugin->process_builtin(command)) {
+                                return true;
+                        }
                 }
+        }
 
-                // jobs/pipelines
-                if(command_num==JOBS) {
-                        if(!list_empty(&current_pipelines)) {
-                                struct list_elem *e;
-                                for(e=list_begin(&current_pipelines); e!=list_end(&current_pipelines); e=list_next(e)) {
-                                        struct esh_pipeline * pipeline=list_entry(e,struct esh_pipeline,elem);
-                                        print_pipeline_status(pipeline);
-                                        printf("(");
-                                        print_pipeline(pipeline);
-                                        printf(")\n");
-                                }
+        // Parse the command
+        int command_num = builtin_command(command->argv[0]);
+
+        // exit
+        if(command_num==EXIT) {
+                exit(0);
+        }
+
+        // jobs/pipelines
+        if(command_num==JOBS) {
+                if(command->argv[1] && !strcmp(command->argv[1],"--json")) {
+                        bool was_blocked=esh_signal_block(SIGCHLD);
+                        esh_jobs_print_json(stdout,&current_pipelines);
+                        if(!was_blocked) {
+                                esh_signal_unblock(SIGCHLD);
+                        }
+                }else if(!list_empty(&current_pipelines)) {
+                        struct list_elem *e;
+                        for(e=list_begin(&current_pipelines); e!=list_end(&current_pipelines); e=list_next(e)) {
+                                struct esh_pipeline * pipeline=list_entry(e,struct esh_pipeline,elem);
+                                print_pipeline_status(pipeline);
+                                printf("(");
+                                print_pipeline(pipeline);
+                                printf(")\n");
                         }
                 }
+        }
+
+        // shell variables
+        if(command_num==SET) {
+                esh_vars_set_builtin(command->argv);
+        }
+        if(command_num==EXPORT) {
+                esh_vars_export_builtin(command->argv);
+        }
+        if(command_num==UNSET) {
+                esh_vars_unset_builtin(command->argv);
+        }
+
+        // history
+        if(command_num==HISTORY) {
+                esh_history_builtin(command->argv);
+        }
 
-                if(command_num==FG||command_num==BG||command_num==KILL||command_num==STOP) {
-                        // The current pipelines must be unempty.
-                        struct esh_pipeline *specified_pipeline;
+        // coprocesses
+        if(command_num==SENDLINE) {
+                set_status(esh_coproc_sendline(command->argv));
+        }
+        if(command_num==READLINE_FROM) {
+                set_status(esh_coproc_readline(command->argv));
+        }
+
+        // dependency graphs of jobs
+        if(command_num==DAG) {
+                set_status(esh_dag_builtin(command->argv));
+        }
+
+        // scheduling attributes of jobs
+        if(command_num==RENICE) {
+                set_status(esh_sched_renice(command->argv));
+        }
 
-                        int job_id=-1;
+        if(command_num==FG||command_num==BG||command_num==KILL||command_num==STOP) {
+                // The current pipelines must be unempty.
+                struct esh_pipeline *specified_pipeline;
 
-                        // This part is for getting pid of the pipeline for the operation.
-                        // If the command desn't specify a job_id, we will operate on the most recent pipeline.
-                        if(command->argv[1]==NULL) {
+                int job_id=-1;
+
+                // This part is for getting pid of the pipeline for the operation.
+                // If the command desn't specify a job_id, we will operate on the most recent pipeline.
+                if(command->argv[1]==NULL) {
+                        if(!list_empty(&current_pipelines)) {
                                 struct list_elem *e=list_back(&current_pipelines);
                                 struct esh_pipeline *pipeline=list_entry(e,struct esh_pipeline,elem);
                                 job_id=pipeline->jid;
                         }
-                        else{
-                                // if the argv has % we need to use the number for jid
-                                if(strncmp(command->argv[1],"%",1)==0) {
-                                        job_id=atoi(command->argv[1]+1);
-                                }else{
-                                        job_id=atoi(command->argv[1]);
-                                }
+                }
+                else{
+                        // if the argv has % we need to use the number for jid
+                        if(strncmp(command->argv[1],"%",1)==0) {
+                                job_id=atoi(command->argv[1]+1);
+                        }else{
+                                job_id=atoi(command->argv[1]);
                         }
+                }
 
-                        // Get the pipeline according to the job_id
-                        // or prompt no such job
-                        if(!list_empty(&current_pipelines)) {
-                                specified_pipeline=get_job_from_jid(job_id);
-                                if(specified_pipeline==NULL) {
-                                        printf("No job with job id %d found",job_id);
-                                        //printf("%s: %s: no such job\n",command->argv[0],command->argv[1]);
-                                        continue;
-                                }
-                        }else{
+                // Get the pipeline according to the job_id
+                // or prompt no such job
+                if(!list_empty(&current_pipelines)) {
+                        specified_pipeline=get_job_from_jid(job_id);
+                        if(specified_pipeline==NULL) {
                                 printf("No job with job id %d found",job_id);
                                 //printf("%s: %s: no such job\n",command->argv[0],command->argv[1]);
-                                continue;
+                                return true;
                         }
+                }else{
+                        printf("No job with job id %d found",job_id);
+                        //printf("%s: %s: no such job\n",command->argv[0],command->argv[1]);
+                        return true;
+                }
 
-                        //fg command
-                        if(command_num==FG) {
-                                specified_pipeline->status=FOREGROUND;
-                                printf("(");
-                                print_pipeline(specified_pipeline);
-                                printf(")\n");
+                // A subshell, such as that of $(fg), cannot wait for the shell's jobs
+                // nor give them the terminal
+                if((command_num==FG||command_num==BG) && !esh_job_control) {
+                        fprintf(stderr,"%s: no job control\n",command->argv[0]);
+                        set_status(1);
+                        return true;
+                }
 
-                                // Send SIGCONT no matter if the job is running or stopped
-                                if(kill(-specified_pipeline->pgrp,SIGCONT)<0) {
-                                        esh_sys_fatal_error("SIGCONT error");
-                                }
+                //fg command
+                if(command_num==FG) {
+                        esh_signal_block(SIGCHLD);
+                        specified_pipeline->status=FOREGROUND;
+                        specified_pipeline->bg_job=false;
+                        esh_jobs_shm_export(&current_pipelines);
+                        printf("(");
+                        print_pipeline(specified_pipeline);
+                        printf(")\n");
+
+                        // Send SIGCONT no matter if the job is running or stopped
+                        if(kill(-specified_pipeline->pgrp,SIGCONT)<0) {
+                                esh_sys_fatal_error("SIGCONT error");
+                        }
+                        // Or the wait would see the job as still stopped
+                        mark_continued(specified_pipeline);
+
+                        // The pipeline is now foreground.
+                        give_terminal_to(specified_pipeline->pgrp,terminal);
+                        wait_for_pipeline(specified_pipeline,terminal);
+                        set_pipeline_status(specified_pipeline);
+                        esh_memo_poll();
+
+                        // Remember to give terminal back to main process
+                        give_terminal_to(getpgrp(),terminal);
+                        esh_signal_unblock(SIGCHLD);
+                }
 
-                                // The pipeline is now foreground.
-                                give_terminal_to(specified_pipeline->pgrp,terminal);
-                                wait_for_pipeline(specified_pipeline,terminal);
+                //bg command
+                if(command_num==BG) {
+                        specified_pipeline->status=BACKGROUND;
+                        esh_jobs_shm_export(&current_pipelines);
 
-                                // Remember to give terminal back to main process
-                                give_terminal_to(getpgrp(),terminal);
+                        // Send SIGCONT no matter if the job is running or stopped
+                        if(kill(-specified_pipeline->pgrp,SIGCONT)<0) {
+                                esh_sys_fatal_error("SIGCONT error");
                         }
+                        printf("[%d] ",specified_pipeline->jid);
+                        printf("(");
+                        print_pipeline(specified_pipeline);
+                        printf(")\n");
+                }
 
-                        //bg command
-                        if(command_num==BG) {
-                                specified_pipeline->status=BACKGROUND;
+                //kill command
+                if(command_num==KILL) {
 
-                                // Send SIGCONT no matter if the job is running or stopped
-                                if(kill(-specified_pipeline->pgrp,SIGCONT)<0) {
-                                        esh_sys_fatal_error("SIGCONT error");
-                                }
-                                printf("[%d] ",specified_pipeline->jid);
-                                printf("(");
-                                print_pipeline(specified_pipeline);
-                                printf(")\n");
+                        if(kill(-specified_pipeline->pgrp,SIGTERM)<0) {
+                                esh_sys_fatal_error("SIGKILL error");
                         }
+                }
 
-                        //kill command
-                        if(command_num==KILL) {
-
-                                if(kill(-specified_pipeline->pgrp,SIGTERM)<0) {
-                                        esh_sys_fatal_error("SIGKILL error");
-                                }
+                // stop command
+                if(command_num==STOP) {
+                        if(kill(-specified_pipeline->pgrp,SIGSTOP)<0) {
+                                esh_sys_fatal_error("SIGSTOP error");
                         }
 
-                        // stop command
-                        if(command_num==STOP) {
-                                if(kill(-specified_pipeline->pgrp,SIGSTOP)<0) {
-                                        esh_sys_fatal_error("SIGSTOP error");
-                                }
+                }
+        } // End of fg bg kill stop
 
-                        }
-                } // End of fg bg kill stop
+        return command_num!=DEFAULT;
+}
 
-                if(command_num==DEFAULT) {
+static void launch_pipeline(struct esh_pipeline *pipeline)
+{
+        pipeline_num++;
+        pipeline->jid=pipeline_num;
+        clock_gettime(CLOCK_REALTIME,&pipeline->started);
+        pid_t pid;
 
-                        esh_signal_block(SIGCHLD);
-                        pipeline_num++;
-                        pipeline->jid=pipeline_num;
-                        pipeline->pgrp=-1;
-                        pid_t pid;
+        // Every stage counts as running until the reaper hears otherwise
+        pipeline->stages_running=list_size(&pipeline->commands)+list_size(&pipeline->procsubs);
+        pipeline->stages_stopped=0;
 
-                        int inputPipe[2],outputPipe[2];
+        // Read end of the pipe from the previous command, or -1 for the head.
+        // All pipes are close-on-exec, so a child keeps only what it dup2()s.
+        int inputFd=-1;
 
-                        struct list_elem *e;
-                        for(e=list_begin(&pipeline->commands); e!=list_end(&pipeline->commands); e=list_next(e)) {
-                                struct esh_command *command=list_entry(e,struct esh_command,elem);
+        struct list_elem *e;
+        int stage=0;
+        for(e=list_begin(&pipeline->commands); e!=list_end(&pipeline->commands); e=list_next(e), stage++) {
+                struct esh_command *command=list_entry(e,struct esh_command,elem);
+                command->waitstatus=0;
+                command->stopped=false;
 
-                                if(list_size(&pipeline->commands)>1 && e!=list_back(&pipeline->commands)) {
-                                        pipe(outputPipe);
-                                }
+                int outputPipe[2]={-1,-1};
+                if(e!=list_back(&pipeline->commands) && esh_pipe_cloexec(outputPipe)<0) {
+                        esh_sys_fatal_error("pipe error");
+                }
 
-                                pid=fork();
-                                if (pid < 0) {
-                                        esh_sys_fatal_error("Fork Error ");
-                                }// Child
-                                else if(pid==0) {
-                                        pid_t pid=getpid();
-                                        command->pid=pid;
-
-                                        if(pipeline->pgrp==-1) {
-                                                pipeline->pgrp=pid;
-                                        }
-
-                                        // Set the pgrp of the every command process as the pgrp of the pipeline
-                                        if(setpgid(pid,pipeline->pgrp)<0) {
-                                                esh_sys_fatal_error("setpgid error");
-                                        }
-
-                                        if(command->iored_input!=NULL) {
-                                                int fd_in=open(command->iored_input,O_RDONLY);
-                                                if (dup2(fd_in, 0) < 0) {
-                                                        esh_sys_fatal_error("dup2 error");
-                                                }
-                                                close(fd_in);
-                                        }
-
-                                        if(command->iored_output!=NULL) {
-                                                int fd_out;
-                                                if(command->append_to_output) {
-                                                        //fd_out = open(command->iored_output, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR);
-                                                        fd_out = open(command->iored_output, O_WRONLY | O_APPEND | O_CREAT, S_IRWXU | S_IRWXG | S_IRWXO);
-                                                }else{
-                                                        //fd_out = open(command->iored_output, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IRGRP | S_IWGRP | S_IWUSR);
-                                                        fd_out = open(command->iored_output, O_WRONLY | O_TRUNC  | O_CREAT, S_IRWXU | S_IRWXG | S_IRWXO);
-                                                }
-                                                if((dup2(fd_out,1))<0) {
-                                                        esh_sys_fatal_error("dup2 error");
-                                                };
-                                                close(fd_out);
-                                        }
-                                        // IO direction
-                                        if(list_size(&pipeline->commands)>1) {
-                                                // Commands that are not the head
-                                                if(e!=list_begin(&pipeline->commands)) {
-                                                        dup2(inputPipe[0],0);
-                                                        close(inputPipe[0]);
-                                                        close(inputPipe[1]);
-                                                }
-
-                                                // Commands that are not the back
-                                                if(e!=list_back(&pipeline->commands)) {
-                                                        dup2(outputPipe[1],1);
-                                                        close(outputPipe[1]);
-                                                        close(outputPipe[0]);
-                                                }
-
-
-
-                                        }// End of pipeline size > 1
-
-                                        esh_signal_unblock(SIGCHLD);
-                                        if(execvp(command->argv[0],command->argv)<0) {
-                                                esh_sys_fatal_error("");
-                                        }
-                                } // End of Child
-                                  // Parent
-                                else {
-                                        // Make the pid of the first command in the command list the pgrp of the pipeline
-                                        if(pipeline->pgrp==-1) {
-                                                pipeline->pgrp=pid;
-                                        }
-                                        command->pid=pid;
-                                        // Set the pgrp of the every command process as the pgrp of the pipeline
-                                        if(setpgid(pid,pipeline->pgrp)<0) {
-                                                esh_sys_fatal_error("setpgid error");
-                                        }
-                                        if(list_size(&pipeline->commands)>1) {
-
-                                                if(e!=list_begin(&pipeline->commands)) {
-                                                        close(inputPipe[0]);
-                                                        close(inputPipe[1]);
-                                                }
-
-                                                if(e!=list_back(&pipeline->commands)) {
-                                                        inputPipe[0]=outputPipe[0];
-                                                        inputPipe[1]=outputPipe[1];
-                                                }
-
-                                                if(e==list_back(&pipeline->commands)) {
-                                                        close(inputPipe[0]);
-                                                        close(inputPipe[1]);
-                                                        close(outputPipe[0]);
-                                                        close(outputPipe[1]);
-                                                }
-                                        }
+                pid=fork();
+                if (pid < 0) {
+                        esh_sys_fatal_error("Fork Error ");
+                }// Child
+                else if(pid==0) {
+                        pid_t pid=getpid();
+                        command->pid=pid;
 
+                        if(pipeline->pgrp==-1) {
+                                pipeline->pgrp=pid;
+                        }
 
-                                }
-                        } // End of iteration through commands
+                        // Set the pgrp of the every command process as the pgrp of the pipeline
+                        if(esh_job_control && setpgid(pid,pipeline->pgrp)<0) {
+                                esh_sys_fatal_error("setpgid error");
+                        }
 
-                        // To check if any plugin wants to change pipeline
-                        for(e=list_begin(&esh_plugin_list); e!=list_end(&esh_plugin_list); e=list_next(e)) {
-                                struct esh_plugin * plugin=list_entry(e,struct esh_plugin,elem);
-                                if(plugin->pipeline_forked) {
-                                        plugin->pipeline_forked(pipeline);
-                                }
+                        // Affinity, niceness and the like, before the command runs
+                        if(pipeline->sched) {
+                                esh_sched_apply(pipeline->sched,stage);
                         }
 
-                        e = list_pop_front(&cline->pipes);
-                        list_push_back(&current_pipelines, e);
-                        // Change pipeline status and give terminal
-                        if(pipeline->bg_job) {
-                                pipeline->status=BACKGROUND;
-                                printf("[%d] %d\n",pipeline->jid,pid);
-                        }else{
-                                pipeline->status=FOREGROUND;
-                                give_terminal_to(pipeline->pgrp,terminal);
+                        // IO direction
+                        // Commands that are not the head
+                        if(inputFd!=-1 && dup2(inputFd,0)<0) {
+                                esh_sys_fatal_error("dup2 error");
+                        }
 
-                                int i=list_size(&pipeline->commands);
-                                for(; i>0; i--) {
-                                        wait_for_pipeline(pipeline,terminal);
-                                }
+                        // Commands that are not the back
+                        if(outputPipe[1]!=-1 && dup2(outputPipe[1],1)<0) {
+                                esh_sys_fatal_error("dup2 error");
+                        }
 
-                                give_terminal_to(getpgrp(),terminal);
+                        // Descriptors leaked by plugins or libraries must not reach the
+                        // command, or a pipe's reader may never see end of file
+                        if(esh_cloexec_from(3)<0) {
+                                esh_sys_error("cannot mark inherited descriptors FD_CLOEXEC");
                         }
 
-                } // End of command_num == DEFAULT
-                  //esh_command_line_print(cline);
-                esh_signal_unblock(SIGCHLD);
-                esh_command_line_free(cline);
-        }// end of the wholie cline
-        return 0;
-}
+                        // Redirections come after the pipes, so that 2>&1 can refer to a pipe
+                        if(!esh_command_redirect(command)) {
+                                exit(EXIT_FAILURE);
+                        }
 
-static void usage(char *progname)
-{
-        printf("Usage: %s -h\n"
-               " -h            print this help\n"
-               " -p  plugindir directory from which to load plug-ins\n",
-               progname);
+                        // Keep open the process substitutions this command names
+                        struct list_elem *p;
+                        for(p=list_begin(&pipeline->procsubs); p!=list_end(&pipeline->procsubs); p=list_next(p)) {
+                                struct esh_procsub *procsub=list_entry(p,struct esh_procsub,elem);
+                                if(procsub->consumer==command) {
+                                        esh_clear_cloexec(procsub->fd);
+                                }
+                        }
 
-        exit(EXIT_SUCCESS);
-}
+                        esh_signal_unblock(SIGCHLD);
 
-static char * build_prompt_from_plugins(void)
-{
-        char *prompt = NULL;
-        struct list_elem * e = list_begin(&esh_plugin_list);
+                        // A watch job runs its pipeline itself
+                        if(command->watch) {
+                                esh_watch_run(command->watch);
+                        }
 
-        for (; e != list_end(&esh_plugin_list); e = list_next(e)) {
-                struct esh_plugin *plugin = list_entry(e, struct esh_plugin, elem);
+                        // Batchable commands may be run in several parts
+                        esh_command_exec(command);
+                } // End of Child
+                  // Parent
+                else {
+                        // Make the pid of the first command in the command list the pgrp of the pipeline
+                        if(pipeline->pgrp==-1) {
+                                pipeline->pgrp=pid;
+                        }
+                        command->pid=pid;
+                        // Set the pgrp of the every command process as the pgrp of the pipeline.
+                        // EACCES means the child already did so itself and called execvp.
+                        if(esh_job_control && setpgid(pid,pipeline->pgrp)<0 && errno!=EACCES) {
+                                esh_sys_fatal_error("setpgid error");
+                        }
+                        // The next command reads what this one writes
+                        if(inputFd!=-1) {
+                                close(inputFd);
+                        }
+                        if(outputPipe[1]!=-1) {
+                                close(outputPipe[1]);
+                        }
+                        inputFd=outputPipe[0];
+                }
+        } // End of iteration through commands
 
-                if (plugin->make_prompt == NULL)
-                        continue;
+        // Only the consumers hold the process substitution pipes now
+        for(e=list_begin(&pipeline->procsubs); e!=list_end(&pipeline->procsubs); e=list_next(e)) {
+                struct esh_procsub *procsub=list_entry(e,struct esh_procsub,elem);
+                close(procsub->fd);
+                procsub->fd=-1;
+        }
 
-                /* append prompt fragment created by plug-in */
-                char * p = plugin->make_prompt();
-                if (prompt == NULL) {
-                        prompt = p;
-                } else {
-                        prompt = realloc(prompt, strlen(prompt) + strlen(p) + 1);
-                        strcat(prompt, p);
-                        free(p);
+        // To check if any plugin wants to change pipeline
+        for(e=list_begin(&esh_plugin_list); e!=list_end(&esh_plugin_list); e=list_next(e)) {
+                struct esh_plugin * plugin=list_entry(e,struct esh_plugin,elem);
+                if(plugin->pipeline_forked) {
+                        plugin->pipeline_forked(pipeline);
                 }
         }
+        esh_hooks_pipeline_forked(pipeline);
 
-        /* default prompt */
-        if (prompt == NULL)
-                prompt = strdup("esh> ");
+        list_push_back(&current_pipelines, &pipeline->elem);
+        esh_jobs_shm_export(&current_pipelines);
+}
 
-        return prompt;
+static void usage(char *progname)
+{
+        printf("Usage: %s -h\n"
+               " -h            print this help\n"
+               " -p  plugindir directory from which to load plug-ins\n"
+               " -c  command   run command and exit with its status\n"
+               " --server path serve esh-client requests on socket path\n",
+               progname);
+
+        exit(EXIT_SUCCESS);
 }
 
 int builtin_command(char *command){
@@ -515,6 +928,38 @@ int builtin_command(char *command){
         else if (!strcmp(command, "stop")) {
                 return STOP;
         }
+
+        else if (!strcmp(command, "set")) {
+                return SET;
+        }
+
+        else if (!strcmp(command, "export")) {
+                return EXPORT;
+        }
+
+        else if (!strcmp(command, "unset")) {
+                return UNSET;
+        }
+
+        else if (!strcmp(command, "history")) {
+                return HISTORY;
+        }
+
+        else if (!strcmp(command, "sendline")) {
+                return SENDLINE;
+        }
+
+        else if (!strcmp(command, "readline-from")) {
+                return READLINE_FROM;
+        }
+
+        else if (!strcmp(command, "dag")) {
+                return DAG;
+        }
+
+        else if (!strcmp(command, "renice")) {
+                return RENICE;
+        }
         return DEFAULT;
 }
 
@@ -561,7 +1006,6 @@ static void give_terminal_to(pid_t pgrp, struct termios *pg_tty_state)
 }
 
 static void print_pipeline_status(struct esh_pipeline *pipeline){
-        char *jobs_status[] ={"Running","Running","Stopped", "Done"};
         printf("[%d]   %s         ",pipeline->jid,jobs_status[pipeline->status]);
 }
 
@@ -585,13 +1029,64 @@ static void print_pipeline(struct esh_pipeline *pipeline){
         }
 }
 
+static void set_status(int status){
+        last_status=status;
+        esh_vars_set_status(status,&status,1);
+}
+
+// The exit status of a command that waitpid reported as 'waitstatus', as sh reports it
+static int exit_code(int waitstatus){
+        if(WIFEXITED(waitstatus)) {
+                return WEXITSTATUS(waitstatus);
+        }else if(WIFSIGNALED(waitstatus)) {
+                return 128+WTERMSIG(waitstatus);
+        }else if(WIFSTOPPED(waitstatus)) {
+                return 128+WSTOPSIG(waitstatus);
+        }
+        return 0;
+}
+
+// The status of the pipeline, with those of its commands in statuses if not NULL
+static int pipeline_exit_status(struct esh_pipeline *pipeline,int *statuses){
+        int n=0, status=0;
+        bool pipefail=esh_option_get("pipefail");
+
+        // The last command's status, or with pipefail the last one that is not 0
+        struct list_elem *e;
+        for(e=list_begin(&pipeline->commands); e!=list_end(&pipeline->commands); e=list_next(e)) {
+                int code=exit_code(list_entry(e,struct esh_command,elem)->waitstatus);
+                if(statuses) {
+                        statuses[n++]=code;
+                }
+                if(!pipefail || code!=0) {
+                        status=code;
+                }
+        }
+        return status;
+}
+
+static void set_pipeline_status(struct esh_pipeline *pipeline){
+        int statuses[list_size(&pipeline->commands)];
+        last_status=pipeline_exit_status(pipeline,statuses);
+        esh_vars_set_status(last_status,statuses,list_size(&pipeline->commands));
+}
+
+int esh_pipeline_exit_status(struct esh_pipeline *pipeline){
+        return pipeline_exit_status(pipeline,NULL);
+}
+
 void wait_for_pipeline(struct esh_pipeline *pipeline,struct termios *terminal)
 {
-        int status;
-        pid_t pid;
-        if((pid=waitpid(-pipeline->pgrp, &status, WUNTRACED)) > 0) {
-                //give_terminal_to(getpgrp(), terminal);
-                change_pipeline_status(pid, status);
+        // Children are only reaped by child_handler, which can run only while we wait
+        sigset_t mask;
+        sigprocmask(SIG_SETMASK,NULL,&mask);
+        sigdelset(&mask,SIGCHLD);
+
+        // The control socket and other events are served in the meantime
+        while(pipeline->stages_running>0 && pipeline->stages_stopped<pipeline->stages_running) {
+                esh_event_wait(&mask);
+                // An event handler may have run commands that unblocked it
+                esh_signal_block(SIGCHLD);
         }
 }
 
@@ -603,79 +1098,96 @@ static void change_pipeline_status(pid_t pid, int status){
 
                 for(e=list_begin(&current_pipelines); e!=list_end(&current_pipelines); e=list_next(e)) {
                         struct esh_pipeline * pipeline=list_entry(e,struct esh_pipeline,elem);
-                        if(is_pipeline_has_command(pipeline,pid)) {
-
-                                // Find the the command according to the pid
-                                struct esh_command *command;
-                                struct list_elem *command_elem;
-                                for(command_elem=list_begin(&pipeline->commands); command_elem!=list_end(&pipeline->commands); command_elem=list_next(command_elem)) {
-                                        command=list_entry(command_elem,struct esh_command,elem);
-                                        if(command->pid==pid) {
-                                                break;
-                                        }
-                                }
+                        // Set if a plugin reports the change itself
+                        bool reported=false;
+
+                        // Find the stage the pid belongs to; process substitutions have no command
+                        struct esh_command *command=find_command(pipeline,pid);
+                        struct esh_procsub *procsub=command ? NULL : find_procsub(pipeline,pid);
+                        if(command==NULL && procsub==NULL) {
+                                continue;
+                        }
+                        bool *stopped=command ? &command->stopped : &procsub->stopped;
+                        if(command) {
+                                command->waitstatus=status;
+                        }
 
-                                // To check if any plugin wants to know about the command status change
-                                struct list_elem *plugin_elem;
-                                for(plugin_elem=list_begin(&esh_plugin_list); plugin_elem!=list_end(&esh_plugin_list); plugin_elem=list_next(plugin_elem)) {
-                                        struct esh_plugin * plugin=list_entry(plugin_elem,struct esh_plugin,elem);
-                                        if(plugin->command_status_change) {
-                                                plugin->command_status_change(command,status);
-                                                return;
-                                        }
+                        // Asynchronous hooks get a copy of the event
+                        esh_hooks_status_change(pipeline,pid,status);
+
+                        // Every subscribed plugin hears about the change, in rank order.
+                        // Returning true only stops the shell from printing its own message.
+                        int i;
+                        for(i=0; command!=NULL && i<status_subscriber_count; i++) {
+                                if(status_subscribers[i]->command_status_change(command,status)) {
+                                        reported=true;
                                 }
+                        }
 
-                                // Child being stopped
-                                if (WIFSTOPPED(status)) {
-                                        pipeline->bg_job=true;
-                                        pipeline->status = STOPPED;
-
-                                        if(WSTOPSIG(status)==SIGTSTP) {
-                                                printf("\n");
-                                                print_pipeline_status(pipeline);
-                                                printf("(");
-                                                print_pipeline(pipeline);
-                                                printf(")\n");
-                                        }
+                        // Keep count of the stages that are still running, and of those stopped
+                        if(WIFSTOPPED(status)) {
+                                if(!*stopped) {
+                                        *stopped=true;
+                                        pipeline->stages_stopped++;
+                                }
+                        }else{
+                                if(*stopped) {
+                                        *stopped=false;
+                                        pipeline->stages_stopped--;
+                                }
+                                if(!WIFCONTINUED(status)) {
+                                        pipeline->stages_running--;
                                 }
+                        }
+
+                        // Child being stopped; the job is reported once all of it has stopped
+                        if (WIFSTOPPED(status)) {
+                                pipeline->bg_job=true;
+                                pipeline->status = STOPPED;
 
-                                // Being Killed
-                                if (WIFSIGNALED(status)) {
-                                        pipeline->status=NEEDSTERMINAL;
-                                        //printf("[%d]   %s: %d          ",pipeline->jid,"Terminated",WTERMSIG(status));
-                                        //printf("(");
-                                        //print_pipeline(pipeline);
-                                        //printf(")\n");
-                                        list_remove(e);
+                                if(WSTOPSIG(status)==SIGTSTP && !reported
+                                   && pipeline->stages_stopped==pipeline->stages_running) {
+                                        queue_notification(pipeline,true);
                                 }
                         }
 
-                        if(is_pipeline_last_command(pipeline,pid)) {
-                                // Child terminated nomailly
-                                if(WIFEXITED(status)) {
-                                        if(pipeline->bg_job) {
-                                                //Try to output the Done message!
-                                                pipeline->status=NEEDSTERMINAL;
-                                                print_pipeline_status(pipeline);
-                                                printf("(");
-                                                print_pipeline(pipeline);
-                                                printf(")\n");
-                                        }
-                                        list_remove(e);
+                        // Child being continued by a SIGCONT
+                        if (WIFCONTINUED(status) && pipeline->status==STOPPED) {
+                                if(pipeline->bg_job) {
+                                        pipeline->status=BACKGROUND;
+                                }else{
+                                        pipeline->status=FOREGROUND;
                                 }
-                                // Child being continued by a SIGCONT
-                                if (WIFCONTINUED(status)) {
-                                        if(pipeline->bg_job) {
-                                                pipeline->status=BACKGROUND;
-                                        }else{
-                                                pipeline->status=FOREGROUND;
-                                        }
+                        }
+
+                        // The job is done once all of its stages have ended, whichever ends last.
+                        // Background jobs whose last command was killed end silently.
+                        if(pipeline->stages_running==0) {
+                                struct esh_command *last=list_entry(list_back(&pipeline->commands),struct esh_command,elem);
+                                pipeline->status=NEEDSTERMINAL;
+                                if(pipeline->bg_job && WIFEXITED(last->waitstatus) && !reported && !pipeline->quiet) {
+                                        queue_notification(pipeline,false);
                                 }
+                                list_remove(e);
 
                                 if(list_empty(&current_pipelines)) {
                                         pipeline_num=0;
                                 }
                         }
+                        // A pid belongs to a single job
+                        break;
+                }
+                esh_jobs_shm_export(&current_pipelines);
+        }
+}
+
+static void collect_subscribers(void){
+        struct list_elem *e;
+        status_subscribers=malloc(list_size(&esh_plugin_list)*sizeof *status_subscribers);
+        for(e=list_begin(&esh_plugin_list); e!=list_end(&esh_plugin_list); e=list_next(e)) {
+                struct esh_plugin * plugin=list_entry(e,struct esh_plugin,elem);
+                if(plugin->command_status_change) {
+                        status_subscribers[status_subscriber_count++]=plugin;
                 }
         }
 }
@@ -689,28 +1201,122 @@ static void child_handler(int sig, siginfo_t *info, void *_ctxt){
         }
 }
 
-static void ctrlz_handler(int sig, siginfo_t *info, void *_ctxt){
-        printf("\b\b  \b\b");
+// Append s to the notification line buf of length *len, without stdio
+static void notify_append(char *buf,int *len,const char *s){
+        while(*s && *len<NOTIFY_LINE_MAX-1) {
+                buf[(*len)++]=*s++;
+        }
+        buf[*len]='\0';
 }
 
-static bool is_pipeline_last_command(struct esh_pipeline *pipeline,pid_t pid){
-        struct list_elem *e=list_back(&pipeline->commands);
-        struct esh_command *command=list_entry(e,struct esh_command,elem);
-        if(command->pid==pid) {
-                return true;
-        }else{
-                return false;
+static void queue_notification(struct esh_pipeline *pipeline,bool newline){
+        if(notify_count==NOTIFY_QUEUE_SIZE) {
+                notify_dropped++;
+                return;
+        }
+        char *buf=notify_queue[(notify_head+notify_count++)%NOTIFY_QUEUE_SIZE];
+        int len=0;
+
+        // The same format as print_pipeline_status and print_pipeline
+        char jid[16];
+        int i=sizeof jid-1, n=pipeline->jid;
+        jid[i]='\0';
+        do {
+                jid[--i]='0'+n%10;
+                n/=10;
+        } while(n>0 && i>0);
+
+        buf[0]='\0';
+        notify_append(buf,&len,newline ? "\n[" : "[");
+        notify_append(buf,&len,jid+i);
+        notify_append(buf,&len,"]   ");
+        notify_append(buf,&len,jobs_status[pipeline->status]);
+        notify_append(buf,&len,"         (");
+
+        struct list_elem *e;
+        for(e=list_begin(&pipeline->commands); e!=list_end(&pipeline->commands); e=list_next(e)) {
+                struct esh_command *command=list_entry(e,struct esh_command,elem);
+                char **argv;
+                for(argv=command->argv; *argv; argv++) {
+                        notify_append(buf,&len,*argv);
+                        if(argv[1]) {
+                                notify_append(buf,&len," ");
+                        }
+                }
+                if(list_next(e)!=list_end(&pipeline->commands)) {
+                        notify_append(buf,&len,"|");
+                }
+        }
+        notify_append(buf,&len,")");
+}
 
+static void drain_notifications(bool redraw){
+        bool was_blocked=esh_signal_block(SIGCHLD);
+        if(notify_count>0 || notify_dropped>0) {
+                if(redraw) {
+                        rl_clear_visible_line();
+                }
+                for(; notify_count>0; notify_count--) {
+                        printf("%s\n",notify_queue[notify_head]);
+                        notify_head=(notify_head+1)%NOTIFY_QUEUE_SIZE;
+                }
+                if(notify_dropped>0) {
+                        printf("(%d more job notifications)\n",notify_dropped);
+                        notify_dropped=0;
+                }
+                fflush(stdout);
+                if(redraw) {
+                        rl_forced_update_display();
+                }
+        }
+        if(!was_blocked) {
+                esh_signal_unblock(SIGCHLD);
         }
 }
 
-static bool is_pipeline_has_command(struct esh_pipeline *pipeline,pid_t pid){
+static int notify_event_hook(void){
+        drain_notifications(true);
+        // readline only calls its getc function once input is ready while a hook is set
+        esh_event_poll(-1,0);
+        return 0;
+}
+
+static void ctrlz_handler(int sig, siginfo_t *info, void *_ctxt){
+        printf("\b\b  \b\b");
+}
+
+static struct esh_command *find_command(struct esh_pipeline *pipeline,pid_t pid){
         struct list_elem *e;
         for(e=list_begin(&pipeline->commands); e!=list_end(&pipeline->commands); e=list_next(e)) {
                 struct esh_command *command=list_entry(e,struct esh_command,elem);
                 if(command->pid==pid) {
-                        return true;
+                        return command;
+                }
+        }
+        return NULL;
+}
+
+static struct esh_procsub *find_procsub(struct esh_pipeline *pipeline,pid_t pid){
+        struct list_elem *e;
+        for(e=list_begin(&pipeline->procsubs); e!=list_end(&pipeline->procsubs); e=list_next(e)) {
+                struct esh_procsub *procsub=list_entry(e,struct esh_procsub,elem);
+                if(procsub->pid==pid) {
+                        return procsub;
                 }
         }
-        return false;
+        return NULL;
+}
+
+static void mark_continued(struct esh_pipeline *pipeline){
+        struct list_elem *e;
+        for(e=list_begin(&pipeline->commands); e!=list_end(&pipeline->commands); e=list_next(e)) {
+                list_entry(e,struct esh_command,elem)->stopped=false;
+        }
+        for(e=list_begin(&pipeline->procsubs); e!=list_end(&pipeline->procsubs); e=list_next(e)) {
+                list_entry(e,struct esh_procsub,elem)->stopped=false;
+        }
+        pipeline->stages_stopped=0;
+        if(pipeline->status==STOPPED) {
+                pipeline->status=pipeline->bg_job ? BACKGROUND : FOREGROUND;
+        }
 }
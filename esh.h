@@ -8,15 +8,24 @@
  */
 
 #include <stdbool.h>
+#include <stdio.h>
 #include <obstack.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <termios.h>
+#include <time.h>
 #include "list.h"
 
 /* Forward declarations. */
 struct esh_command;
 struct esh_pipeline;
+struct esh_watch;
+struct esh_sched;
+struct esh_input;
 struct esh_command_line;
+struct esh_deferred_word;
+struct esh_redirect;
+struct esh_plugin;
 
 /*
  * A esh_shell object allows plugins to access services and information.
@@ -44,6 +53,51 @@ struct esh_shell {
 
         /* Parse command line */
         struct esh_command_line * (* parse_command_line) (char *);
+
+        /* Offer 'name' as a command name to tab completion.
+         * Plugins that provide builtins call this from 'init'. */
+        void (* register_completion) (const char *name);
+
+        /* Recompute the prompt fragment of 'plugin' before it is next
+         * shown, and redraw a prompt that is showing.  May be called
+         * from any thread. */
+        void (* invalidate_prompt) (struct esh_plugin *plugin);
+
+        /* The standard input of a builtin, as its redirections say;
+         * regular files are mapped into memory.  See esh_input_open
+         * and the functions after it. */
+        struct esh_input * (* open_input) (struct esh_command *cmd);
+        ssize_t (* read_input) (struct esh_input *in, const char **data);
+        ssize_t (* read_input_line) (struct esh_input *in, const char **line);
+        void (* close_input) (struct esh_input *in);
+
+        /* Declare that builtin 'name' only prints, through stdio, and
+         * changes nothing in the shell, so that $(name ...) may run it
+         * without a subshell.  Other builtins are run in a subshell. */
+        void (* register_printing_builtin) (const char *name);
+};
+
+/* Events after which a cached prompt fragment is recomputed */
+#define ESH_PROMPT_CWD    0x1   /* The working directory changed */
+#define ESH_PROMPT_JOBS   0x2   /* A job was started, stopped or ended */
+#define ESH_PROMPT_TIMER  0x4   /* 'interval_ms' have passed */
+
+/*
+ * A prompt fragment the shell caches.  It is computed once, and again
+ * only after one of the events in 'invalidate_on', or after the plugin
+ * calls shell->invalidate_prompt.
+ */
+struct esh_prompt_fragment {
+        /* Return the fragment, allocated via malloc() */
+        char * (* make)(void);
+
+        unsigned invalidate_on;   /* ESH_PROMPT_* */
+        int interval_ms;          /* For ESH_PROMPT_TIMER */
+
+        /* If true, 'make' runs in a thread of the shell, and the prompt
+         * shows the previous value, or nothing, until it returns.  It
+         * must then be thread-safe and not use the shell object. */
+        bool async;
 };
 
 /*
@@ -52,7 +106,15 @@ struct esh_shell {
  * esh will call its 'init' functions upon successful load.
  *
  * For binary compatibility, do not change the order of these fields.
+ * Plugins that set the fields after command_status_change must also
+ * define
+ *
+ *     const int esh_module_version = ESH_PLUGIN_VERSION;
+ *
+ * An esh_module without it is taken to be a version 1 one, which ends
+ * at command_status_change, and only that much of it is read.
  */
+#define ESH_PLUGIN_VERSION 2
 struct esh_plugin {
         struct list_elem elem; /* Link element */
 
@@ -98,12 +160,74 @@ struct esh_plugin {
          * May be called from SIGCHLD handler.
          * The status of the associated pipeline has not yet been
          * updated.
+         * All plugins that implement this are notified.  Return true
+         * if the plugin reported the change, so that the shell does
+         * not print its own message; the shell updates the job either
+         * way.
          * */
         bool (* command_status_change)(struct esh_command *, int waitstatus);
 
+        /* Version 2 fields, read only from a plugin that defines
+         * esh_module_version */
+
+        /* A cached alternative to 'make_prompt', used instead of it if set */
+        struct esh_prompt_fragment *prompt_fragment;
+
+        /* Hooks that run in a thread of their own, see below */
+        struct esh_plugin_hooks *async_hooks;
+
         /* Add additional fields here if needed. */
 };
 
+/* What happened to a job, for asynchronous hooks */
+enum esh_hook_event_kind {
+        ESH_HOOK_PIPELINE_FORKED,
+        ESH_HOOK_STATUS_CHANGE,
+};
+
+#define ESH_HOOK_COMMAND_MAX 256
+
+/* A copy of the state of a job when an event happened */
+struct esh_hook_event {
+        enum esh_hook_event_kind kind;
+        int jid;
+        pid_t pgrp;
+        bool bg_job;
+        int nstages;              /* Commands in the pipeline */
+        pid_t pid;                /* ESH_HOOK_STATUS_CHANGE: process whose
+                                     status changed */
+        int waitstatus;           /* ESH_HOOK_STATUS_CHANGE: as returned by
+                                     waitpid(2) */
+        struct timespec time;     /* When it happened, CLOCK_REALTIME */
+        char command[ESH_HOOK_COMMAND_MAX]; /* Command line, truncated */
+        unsigned coalesced;       /* Earlier events of the job merged into
+                                     this one, for ESH_HOOK_COALESCE */
+        unsigned long dropped;    /* Events dropped since the previous one
+                                     delivered, for ESH_HOOK_DROP */
+};
+
+/* What the shell does with an event when a plugin's queue is full */
+enum esh_hook_policy {
+        ESH_HOOK_DROP,            /* Discard it, and count it */
+        ESH_HOOK_BLOCK,           /* Wait until the plugin catches up */
+        ESH_HOOK_COALESCE,        /* Keep only the latest event of each job
+                                     until the plugin catches up */
+};
+
+/*
+ * Hooks of a plugin that are called on a thread the shell starts for
+ * the plugin, one event at a time, in the order of the events.  The
+ * shell goes on while they run; events wait in a bounded queue.
+ * They must not use the shell object or the job list.
+ */
+struct esh_plugin_hooks {
+        enum esh_hook_policy policy;
+        unsigned queue_size;      /* Events; 0 means 256 */
+
+        void (* pipeline_forked)(const struct esh_hook_event *);
+        void (* command_status_change)(const struct esh_hook_event *);
+};
+
 /* A command line may contain multiple pipelines. */
 struct esh_command_line {
         struct list /* <esh_pipeline> */ pipes;   /* List of pipelines */
@@ -120,6 +244,13 @@ enum job_status {
                           and requires exclusive terminal access */
 };
 
+/* How a pipeline follows the previous one on its command line */
+enum esh_connector {
+        ESH_CONNECT_ALWAYS,  /* After ';' or '&', or first */
+        ESH_CONNECT_AND,     /* After '&&': only if $? is 0 */
+        ESH_CONNECT_OR,      /* After '||': only if $? is not 0 */
+};
+
 /* A pipeline is a list of one or more commands.
  * For the purposes of job control, a pipeline forms one job.
  */
@@ -131,6 +262,7 @@ struct esh_pipeline {
                                 file 'iored_output' */
         bool append_to_output; /* True if user typed >> to append */
         bool bg_job;         /* True if user entered & */
+        enum esh_connector connector; /* Whether it runs depends on $? */
         struct list_elem elem; /* Link element. */
 
         int jid;             /* Job id. */
@@ -139,9 +271,39 @@ struct esh_pipeline {
         struct termios saved_tty_state; /* The state of the terminal when this job was
                                            stopped after having been in foreground */
 
+        struct list /* <esh_procsub> */ procsubs; /* Process substitutions
+                                                     started for this job */
+
+        struct timespec started; /* When the job was launched, CLOCK_REALTIME */
+
+        int stages_running;  /* Commands and process substitutions that have
+                                not ended yet; the job is done at 0 */
+        int stages_stopped;  /* How many of these are stopped; the job is
+                                stopped once all of them are */
+
+        struct esh_sched *sched; /* Scheduling attributes given in front
+                                    of the pipeline, or NULL */
+
+        bool quiet;          /* A background job started on the shell's
+                                behalf, as by dag: neither its start nor
+                                its end is announced */
+
         /* Add additional fields here if needed. */
 };
 
+/* A process substitution: a subshell in the process group of the
+ * pipeline that runs 'text', connected to 'consumer' through the
+ * pipe end 'fd', which 'consumer' accesses as /dev/fd/<fd>. */
+struct esh_procsub {
+        struct list_elem elem;    /* Link element for pipeline's procsubs */
+        char *text;               /* Inner command line */
+        pid_t pid;                /* Process id of the subshell */
+        int fd;                   /* Shell's end of the pipe, or -1 once
+                                     the consumer has been forked */
+        struct esh_command *consumer; /* Command that names the pipe */
+        bool stopped;             /* True while the subshell is stopped */
+};
+
 /* A command is part of a pipeline. */
 struct esh_command {
         char **argv;         /* NULL terminated array of pointers to words
@@ -157,9 +319,74 @@ struct esh_command {
         struct esh_pipeline * pipeline;
         /* The pipeline of which this job is a part. */
 
+        struct esh_deferred_word *deferred; /* Words of argv that are
+                                               expanded at launch time,
+                                               in increasing argv order. */
+
+        struct esh_redirect *redirects; /* Redirections in the order the
+                                           user typed them.  Also
+                                           includes <, > and >>, whose
+                                           file names stay in iored_input
+                                           and iored_output. */
+
+        int batch_jobs;      /* If > 0, an argv too long for ARG_MAX is
+                                split over several execs, with at most
+                                batch_jobs of them running at a time. */
+
+        int waitstatus;      /* The last status waitpid(2) reported. */
+        bool stopped;        /* True while the process is stopped. */
+
+        struct esh_watch *watch; /* If non-NULL, the process runs the
+                                    watch loop of esh-watch.c instead of
+                                    exec'ing argv. */
+        char *watched;       /* For 'watch ... --', the unexpanded text
+                                of the pipeline that follows '--'. */
+
         /* Add additional fields here if needed. */
 };
 
+/* Ways in which a file descriptor can be redirected. */
+enum esh_redirect_mode {
+        ESH_REDIRECT_INPUT,       /* N< file */
+        ESH_REDIRECT_OUTPUT,      /* N> file */
+        ESH_REDIRECT_APPEND,      /* N>> file */
+        ESH_REDIRECT_READWRITE,   /* N<> file */
+        ESH_REDIRECT_DUP,         /* N>&M or N<&M */
+        ESH_REDIRECT_HERESTRING,  /* <<< word */
+};
+
+/* A redirection of one file descriptor of a command. */
+struct esh_redirect {
+        struct esh_redirect *next;
+        int fd;                   /* Descriptor that is redirected */
+        enum esh_redirect_mode mode;
+        char *target;             /* File name or here-string, whose
+                                     variables are expanded at launch.
+                                     NULL for ESH_REDIRECT_DUP, and for
+                                     plain <, > and >>, which use the
+                                     command's iored_input or
+                                     iored_output. */
+        int dup_source;           /* Descriptor copied by ESH_REDIRECT_DUP */
+};
+
+/* Kinds of words whose value is only known when a command is launched. */
+enum esh_word_kind {
+        ESH_WORD_COMMAND_SUBST,   /* A word with $(...) or `...` in it */
+        ESH_WORD_PROCESS_INPUT,   /* <(...), read from /dev/fd/N */
+        ESH_WORD_PROCESS_OUTPUT,  /* >(...), written to /dev/fd/N */
+        ESH_WORD_PARAMETERS,      /* A word with $NAME or $? in it */
+};
+
+/* A word of a command's argv that the parser could not expand.  Its
+ * placeholder in argv holds the whole word for command substitutions
+ * and parameters, and the text between the parentheses for process
+ * substitutions. */
+struct esh_deferred_word {
+        struct esh_deferred_word *next;
+        int index;                /* Position of the placeholder in argv */
+        enum esh_word_kind kind;
+};
+
 /** ----------------------------------------------------------- */
 
 /* Create new command structure and initialize it */
@@ -181,6 +408,15 @@ struct esh_command_line * esh_command_line_create_empty(void);
 /* Create a command line with a single pipeline */
 struct esh_command_line * esh_command_line_create(struct esh_pipeline *pipe);
 
+/* Create a redirection; 'target' becomes owned by it */
+struct esh_redirect * esh_redirect_create(int fd, enum esh_redirect_mode mode,
+                                          char *target, int dup_source);
+
+/* Apply the redirections of cmd to the calling process, which is
+ * about to exec it.  Return false if one of them failed.
+ * Implemented in esh-redirect.c */
+bool esh_command_redirect(struct esh_command *cmd);
+
 /* Deallocation functions */
 void esh_command_line_free(struct esh_command_line *);
 void esh_pipeline_free(struct esh_pipeline *);
@@ -194,6 +430,291 @@ void esh_command_line_print(struct esh_command_line *line);
 /* Parse a command line.  Implemented in esh-grammar.y */
 struct esh_command_line * esh_parse_command_line(char * line);
 
+/* Run all pipelines of a command line, waiting for foreground jobs.
+ * Pipelines are removed from the command line as they are run.
+ * Implemented in esh.c */
+void esh_command_line_run(struct esh_command_line *cline);
+
+/* Run the command line 'text' as if it was typed, and return the exit
+ * status of its last foreground job.  Implemented in esh.c */
+int esh_command_string_run(char *text);
+
+/* Run a single pipeline of a command line as esh_command_line_run
+ * does.  Return true if it was launched as a job, which then belongs to
+ * the job table; otherwise the caller frees it, and *status is its exit
+ * status.  Implemented in esh.c */
+bool esh_pipeline_run(struct esh_pipeline *pipeline, int *status);
+
+/* Run pipeline as a background job, unless its command is a builtin,
+ * which would run in the shell.  Return the job launched, or NULL if
+ * there is none; the caller then frees pipeline.  Implemented in esh.c */
+struct esh_pipeline * esh_pipeline_run_job(struct esh_pipeline *pipeline);
+
+/* Return the exit status of a job that has ended, as $? would report
+ * it.  Implemented in esh.c */
+int esh_pipeline_exit_status(struct esh_pipeline *pipeline);
+
+/* If cmd is a built-in provided by the shell or a plugin, execute it
+ * and return true.  Implemented in esh.c */
+bool esh_command_run_builtin(struct esh_command *cmd);
+
+/* False in subshells, whose children stay in the subshell's process
+ * group and never own the terminal.  Implemented in esh.c */
+extern bool esh_job_control;
+
+/* Replace the command substitutions and parameters of cmd, and those
+ * of its redirections, by their expansion.  Return false if an
+ * expansion failed.  Implemented in esh-expand.c */
+bool esh_command_expand(struct esh_command *cmd);
+
+/* Run the command line 'text' and return its output, with trailing
+ * newlines removed, in a malloc'd buffer.  Implemented in esh-expand.c */
+char * esh_command_substitute(char *text);
+
+/* Let $(name ...) run builtin 'name' in the shell; see
+ * shell->register_printing_builtin.  Implemented in esh-expand.c */
+void esh_register_printing_builtin(const char *name);
+
+/* Start the process substitutions of cmd in the process group of its
+ * pipeline, setting the pipeline's pgrp if it is still -1.
+ * SIGCHLD must be blocked.  Implemented in esh-expand.c */
+bool esh_command_start_procsubs(struct esh_command *cmd);
+
+/* Replace the words of cmd that contain *, ? or [...] by the sorted
+ * paths they match.  Return false if the expanded command would exceed
+ * ARG_MAX.  Implemented in esh-glob.c */
+bool esh_command_glob(struct esh_command *cmd);
+
+/* Handle a 'batch [-j N]' prefix of cmd, or mark cmd as batchable if
+ * it is named in ESH_BATCHABLE.  Return false on a usage error.
+ * Implemented in esh-batch.c */
+bool esh_command_batch_prefix(struct esh_command *cmd);
+
+/* Exec cmd in a child of the shell, splitting the argv of a batchable
+ * command that exceeds ARG_MAX over several runs.  Does not return.
+ * Implemented in esh-batch.c */
+void esh_command_exec(struct esh_command *cmd);
+
+/* Tab completion.  Implemented in esh-complete.c */
+
+/* Make 'name' available to completion as a command name */
+void esh_complete_register(const char *name);
+
+/* Install the completion function and start indexing PATH */
+void esh_complete_init(void);
+
+/* Machine-readable job table.  Implemented in esh-jobs.c */
+
+/* Print the jobs to out as a JSON array, one object per job */
+void esh_jobs_print_json(FILE *out, struct list *jobs);
+
+/* Copy the command line of pipe into buf, truncating it.
+ * Async-signal-safe. */
+void esh_pipeline_format(char *buf, size_t size, struct esh_pipeline *pipe);
+
+/* Update the shared memory copy of the job table, if there is one.
+ * Async-signal-safe, so that the reaper can call it. */
+void esh_jobs_shm_export(struct list *jobs);
+
+/* Create or remove the shared memory object /esh-<pid> according to
+ * the jobshm option */
+void esh_jobs_shm_sync(struct list *jobs);
+
+/* The event loop.  Implemented in esh-event.c */
+
+typedef void (*esh_event_handler)(int fd, void *arg);
+
+/* Call handler(fd, arg) from the main loop whenever fd is readable.
+ * Return false if too many descriptors are registered. */
+bool esh_event_add(int fd, esh_event_handler handler, void *arg);
+
+/* Stop watching fd */
+void esh_event_remove(int fd);
+
+/* Wait up to timeout_ms (-1: forever) for the registered descriptors
+ * and 'extra_fd', if not -1, and run the handlers of those that are
+ * ready.  Return 1 if extra_fd is readable, 0 if not, and -1 if the
+ * wait was interrupted by a signal. */
+int esh_event_poll(int extra_fd, int timeout_ms);
+
+/* Wait for the registered descriptors or for a signal, with the signal
+ * mask set to 'mask' while waiting, as sigsuspend(2) does, and run the
+ * handlers of the descriptors that are ready */
+void esh_event_wait(const sigset_t *mask);
+
+/* readline's rl_getc_function: serve events until the terminal has
+ * input */
+int esh_event_getc(FILE *stream);
+
+/* Open or close the control socket according to the control option.
+ * Implemented in esh-control.c */
+void esh_control_sync(void);
+
+/* Serve esh-client requests on the socket 'path'.  Does not return.
+ * Implemented in esh-server.c */
+void esh_server_run(const char *path);
+
+/* Asynchronous plugin hooks.  Implemented in esh-hooks.c */
+
+/* Start the threads of the plugins that have async_hooks */
+void esh_hooks_start(void);
+
+/* Queue the events for the async hooks.  Async-signal-safe. */
+void esh_hooks_pipeline_forked(struct esh_pipeline *pipe);
+void esh_hooks_status_change(struct esh_pipeline *pipe, pid_t pid, int waitstatus);
+
+/* Prompts.  Implemented in esh-prompt.c */
+
+/* Assemble the prompt from the plugins' fragments; the default
+ * shell.build_prompt */
+char * esh_prompt_build(void);
+
+/* The default shell.invalidate_prompt */
+void esh_prompt_invalidate(struct esh_plugin *plugin);
+
+/* Persistent history.  Implemented in esh-history.c */
+
+/* readline(3) with a persistent history; the default shell.readline */
+char * esh_history_readline(const char *prompt);
+
+/* Record the line last returned by esh_history_readline, which ran
+ * to completion with exit status 'status' */
+void esh_history_finish(int status);
+
+/* The history builtin: 'history [N]' */
+void esh_history_builtin(char **argv);
+
+/* Shell variables.  Implemented in esh-vars.c */
+
+/* Import the environment the shell was started with */
+void esh_vars_init(char **envp);
+
+/* Remove all variables */
+void esh_vars_clear(void);
+
+/* Return the value of variable name, or NULL if it is not set */
+const char * esh_var_get(const char *name);
+
+/* Return true if shell option name is on */
+bool esh_option_get(const char *name);
+
+/* Turn shell option name on or off */
+void esh_option_set(const char *name, bool on);
+
+/* Set variable name to value */
+void esh_var_set(const char *name, const char *value);
+
+/* Mark variable name for export to commands, defining it if needed */
+void esh_var_export(const char *name);
+
+/* Remove variable name */
+void esh_var_unset(const char *name);
+
+/* Return the environment for commands, rebuilt only if an exported
+ * variable changed since the last call */
+char ** esh_vars_envp(void);
+
+/* Return a malloc'd copy of word with $NAME, ${NAME}, ${NAME[N]} and $?
+ * expanded */
+char * esh_vars_expand(const char *word);
+
+/* Record the exit status of the last pipeline and of its n commands,
+ * for $? and PIPESTATUS */
+void esh_vars_set_status(int status, const int *statuses, int n);
+
+/* The set, export and unset builtins */
+void esh_vars_set_builtin(char **argv);
+void esh_vars_export_builtin(char **argv);
+void esh_vars_unset_builtin(char **argv);
+
+/* Coprocesses.  Implemented in esh-coproc.c */
+
+/* Turn a pipeline that starts with 'coproc NAME' into a background job
+ * connected to the shell by pipes.  Return false on a usage error. */
+bool esh_coproc_prepare(struct esh_pipeline *pipeline);
+
+/* Called once the pipeline prepared by esh_coproc_prepare is launched */
+void esh_coproc_launched(struct esh_pipeline *pipeline);
+
+/* The sendline and readline-from builtins; return their exit status */
+int esh_coproc_sendline(char **argv);
+int esh_coproc_readline(char **argv);
+
+/* Memoized commands.  Implemented in esh-memo.c */
+
+/* Handle a pipeline that starts with 'memo'.  Return false, with the
+ * exit status in *status, if its output was replayed from the store or
+ * it cannot be memoized; otherwise it is set up to be captured and must
+ * be run. */
+bool esh_memo_prepare(struct esh_pipeline *pipeline, int *status);
+
+/* Called once the pipeline prepared by esh_memo_prepare is launched */
+void esh_memo_launched(void);
+
+/* Called instead if it is not launched after all */
+void esh_memo_cancel(void);
+
+/* Called when the wait for it is over: show the rest of its output
+ * and store it */
+void esh_memo_finish(struct esh_pipeline *pipeline);
+
+/* Finish a memoized command that was stopped, once it has ended.
+ * SIGCHLD must be blocked. */
+void esh_memo_poll(void);
+
+/* Watch mode.  Implemented in esh-watch.c */
+
+/* If pipeline is 'watch ... -- cmd...', keep the text of what follows
+ * '--' for its runs to parse, and remove it from pipeline.  Called
+ * before the pipeline is expanded. */
+void esh_watch_split(struct esh_pipeline *pipeline);
+
+/* Turn a pipeline that starts with 'watch' into the job that runs it
+ * whenever the paths change.  Return the job, or NULL on a usage
+ * error. */
+struct esh_pipeline * esh_watch_prepare(struct esh_pipeline *pipeline);
+
+/* The body of the watch job, in its process; does not return */
+void esh_watch_run(struct esh_watch *watch);
+
+/* The input of builtins.  Implemented in esh-input.c */
+
+/* Open the standard input of builtin cmd: the file, here-string or
+ * descriptor of its last redirection of descriptor 0, or the shell's
+ * own.  Regular files are mapped into memory.  Return NULL, after
+ * saying why, if it cannot be opened. */
+struct esh_input * esh_input_open(struct esh_command *cmd);
+
+/* Set *data to the next block of input and return its length, 0 at
+ * the end.  A mapped file comes in a single block. */
+ssize_t esh_input_read(struct esh_input *in, const char **data);
+
+/* Set *line to the next line, without its newline and not
+ * NUL-terminated, valid until the next call, and return its length,
+ * or -1 at the end of input. */
+ssize_t esh_input_getline(struct esh_input *in, const char **line);
+
+void esh_input_close(struct esh_input *in);
+
+/* Scheduling attributes.  Implemented in esh-sched.c */
+
+/* Remove the attributes such as cpus=0-3 and nice=10 in front of the
+ * first command of pipeline and keep them in pipeline->sched.  Return
+ * false if one is invalid. */
+bool esh_pipeline_sched_prefix(struct esh_pipeline *pipeline);
+
+/* Apply them to the calling process, which is about to exec the
+ * turn-th command of the job, or part of a batch command.  Exits on
+ * failure. */
+void esh_sched_apply(struct esh_sched *sched, int turn);
+
+/* The renice builtin: 'renice N [%JOB]'.  Return its exit status. */
+int esh_sched_renice(char **argv);
+
+/* The dag builtin: 'dag [-j N] [-k] FILE'.  Return its exit status.
+ * Implemented in esh-dag.c */
+int esh_dag_builtin(char **argv);
+
 /* Load plugins from directory dir */
 void esh_plugin_load_from_directory(char *dirname);
 
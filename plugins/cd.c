@@ -14,6 +14,8 @@ static bool
 init_plugin(struct esh_shell *shell)
 {
     printf("Plugin 'cd' initialized...\n");
+    if (shell->register_completion)
+        shell->register_completion("cd");
     return true;
 }
 
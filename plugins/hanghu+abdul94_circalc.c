@@ -3,21 +3,315 @@
  * invocation: circalc < raduis > 
  * calculates the circumference and area.
  * Authors: (hanghu + abdul94)
+ *
+ * Batch mode: circalc -f FILE, circalc -f - (the shell's standard
+ * input), or circalc with its input redirected, reads radii separated
+ * by white space, floating point ones included, and prints a line for
+ * each.  The radii are computed in batches, with AVX2 or NEON when the
+ * CPU has them, and the output goes through a buffer of our own.
  */
  
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>           /* isfinite, a macro: no -lm */
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef __aarch64__
+#include <arm_neon.h>
+#endif
 #include "../esh.h"
 #include "../esh-sys-utils.h"
 #define PI 3.1416
 
+#define BATCH 1024              /* Radii computed at a time */
+#define OUTPUT_BUFFER (64 * 1024)
+#define MAX_LINE 700            /* Longest line, for a radius near DBL_MAX */
+
+static struct esh_shell *shell;
+
 static bool 
-init_plugin(struct esh_shell *shell)
+init_plugin(struct esh_shell *esh)
 {
     printf("Plugin 'circalc' initialized...\n");
+    shell = esh;
+    if (shell->register_completion)
+        shell->register_completion("circalc");
+    /* it only prints, so $(circalc ...) need not fork */
+    if (shell->register_printing_builtin)
+        shell->register_printing_builtin("circalc");
     return true;
 }
 
+/* Compute area and circumference for n radii, the same way as a
+ * single radius is: r * PI * r and 2 * PI * r, without fused
+ * multiply-adds, so that both give the same digits. */
+typedef void compute_fn(const double *r, double *area, double *circ, size_t n);
+
+static void
+compute_scalar(const double *r, double *area, double *circ, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++) {
+        area[i] = r[i] * PI * r[i];
+        circ[i] = 2 * PI * r[i];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void
+compute_avx2(const double *r, double *area, double *circ, size_t n)
+{
+    const __m256d pi = _mm256_set1_pd(PI), two_pi = _mm256_set1_pd(2 * PI);
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256d v = _mm256_loadu_pd(r + i);
+        _mm256_storeu_pd(area + i, _mm256_mul_pd(_mm256_mul_pd(v, pi), v));
+        _mm256_storeu_pd(circ + i, _mm256_mul_pd(two_pi, v));
+    }
+    compute_scalar(r + i, area + i, circ + i, n - i);
+}
+#endif
+
+#ifdef __aarch64__
+static void
+compute_neon(const double *r, double *area, double *circ, size_t n)
+{
+    const float64x2_t pi = vdupq_n_f64(PI), two_pi = vdupq_n_f64(2 * PI);
+    size_t i;
+    for (i = 0; i + 2 <= n; i += 2) {
+        float64x2_t v = vld1q_f64(r + i);
+        vst1q_f64(area + i, vmulq_f64(vmulq_f64(v, pi), v));
+        vst1q_f64(circ + i, vmulq_f64(two_pi, v));
+    }
+    compute_scalar(r + i, area + i, circ + i, n - i);
+}
+#endif
+
+/* Pick the widest kernel the CPU runs */
+static compute_fn *
+choose_compute(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return compute_avx2;
+#endif
+#ifdef __aarch64__
+    return compute_neon;
+#endif
+    return compute_scalar;
+}
+
+/* Buffered output to a file descriptor, or to stdout if that has none,
+ * as when $(circalc ...) captures it in memory */
+struct writer {
+    int fd;
+    size_t len;
+    bool failed;
+    char buf[OUTPUT_BUFFER];
+};
+
+static void
+writer_flush(struct writer *w)
+{
+    size_t done = 0;
+    if (w->fd < 0 && !w->failed && fwrite(w->buf, 1, w->len, stdout) != w->len) {
+        esh_sys_error("circalc: write: ");
+        w->failed = true;
+    }
+    while (w->fd >= 0 && done < w->len && !w->failed) {
+        ssize_t n = write(w->fd, w->buf + done, w->len - done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            esh_sys_error("circalc: write: ");
+            w->failed = true;
+        } else
+            done += n;
+    }
+    w->len = 0;
+}
+
+static void
+writer_string(struct writer *w, const char *s, size_t len)
+{
+    memcpy(w->buf + w->len, s, len);
+    w->len += len;
+}
+
+/* Append v as %.2f does.  v * 100 is rounded to an integer and printed
+ * directly, unless it is too large for that to be exact or too close
+ * to a tie, where snprintf decides. */
+static void
+writer_fixed2(struct writer *w, double v)
+{
+    double x = v * 100;
+    if (!(x >= 0 && x < 0x1p43)) {
+        w->len += snprintf(w->buf + w->len, sizeof w->buf - w->len, "%.2f", v);
+        return;
+    }
+    uint64_t n = (uint64_t) x;
+    double fraction = x - n;
+    if (fraction > 0.5 - 1.0 / 256 && fraction < 0.5 + 1.0 / 256) {
+        w->len += snprintf(w->buf + w->len, sizeof w->buf - w->len, "%.2f", v);
+        return;
+    }
+    if (fraction > 0.5)
+        n++;
+
+    char digits[24], *p = digits + sizeof digits;
+    *--p = '0' + n % 10;
+    n /= 10;
+    *--p = '0' + n % 10;
+    n /= 10;
+    *--p = '.';
+    do {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    writer_string(w, p, digits + sizeof digits - p);
+}
+
+static void
+print_batch(struct writer *w, compute_fn *compute, const double *r, size_t n)
+{
+    double area[BATCH], circ[BATCH];
+    compute(r, area, circ, n);
+
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if (sizeof w->buf - w->len < MAX_LINE)
+            writer_flush(w);
+        writer_string(w, "area = ", 7);
+        writer_fixed2(w, area[i]);
+        writer_string(w, " , circumference = ", 19);
+        writer_fixed2(w, circ[i]);
+        writer_string(w, " \n", 2);
+    }
+}
+
+/* Exact powers of ten, for the fast path of parse_radius */
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Parse the radius in [p, end), which is not NUL-terminated, into *r:
+ * digits with an optional fraction and exponent.  A mantissa of at
+ * most 15 digits with a small exponent is converted exactly with one
+ * multiplication or division; anything else goes to strtod.  Return
+ * false if it is not a radius. */
+static bool
+parse_radius(const char *p, const char *end, double *r)
+{
+    const char *start = p;
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+
+    if (p < end && *p == '+')
+        p++;
+    for (; p < end && *p >= '0' && *p <= '9'; p++, digits++)
+        mantissa = mantissa * 10 + (*p - '0');
+    if (p < end && *p == '.')
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++, exponent--)
+            mantissa = mantissa * 10 + (*p - '0');
+    if (digits == 0)
+        return false;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        int sign = 1, e = 0;
+        p++;
+        if (p < end && (*p == '+' || *p == '-'))
+            sign = *p++ == '-' ? -1 : 1;
+        if (p == end || *p < '0' || *p > '9')
+            return false;
+        for (; p < end && *p >= '0' && *p <= '9'; p++)
+            if (e < 100000)
+                e = e * 10 + (*p - '0');
+        exponent += sign * e;
+    }
+    if (p != end)
+        return false;
+
+    if (digits <= 15 && exponent >= -22 && exponent <= 22) {
+        *r = exponent < 0 ? mantissa / powers_of_ten[-exponent] : mantissa * powers_of_ten[exponent];
+        return true;
+    }
+
+    char copy[128];
+    if (end - start >= (ptrdiff_t) sizeof copy)
+        return false;
+    memcpy(copy, start, end - start);
+    copy[end - start] = '\0';
+    *r = strtod(copy, NULL);
+    return isfinite(*r);
+}
+
+/* Batch mode: a line of output for each radius of the input of cmd */
+static void
+circalc_batch(struct esh_command *cmd, const char *name)
+{
+    struct esh_input *in = shell->open_input(cmd);
+    if (in == NULL)
+        return;
+
+    fflush(stdout);
+    static struct writer w;
+    w.fd = fileno(stdout);
+    w.len = 0;
+    w.failed = false;
+    compute_fn *compute = choose_compute();
+
+    double radii[BATCH];
+    size_t n = 0;
+    long lineno = 0;
+    const char *line;
+    ssize_t len;
+    while ((len = shell->read_input_line(in, &line)) != -1 && !w.failed) {
+        const char *p = line, *end = line + len;
+        lineno++;
+        for (;;) {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+                p++;
+            if (p == end)
+                break;
+            const char *word = p;
+            while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+                p++;
+            if (!parse_radius(word, p, &radii[n])) {
+                fprintf(stderr, "circalc: %s:%ld: invalid raduis '%.*s'\n",
+                        name, lineno, (int) (p - word), word);
+                continue;
+            }
+            if (++n == BATCH) {
+                print_batch(&w, compute, radii, n);
+                n = 0;
+            }
+        }
+    }
+    print_batch(&w, compute, radii, n);
+    writer_flush(&w);
+    shell->close_input(in);
+}
+
+/* Does cmd have its standard input redirected? */
+static bool
+input_redirected(struct esh_command *cmd)
+{
+    struct esh_redirect *r;
+    for (r = cmd->redirects; r; r = r->next)
+        if (r->fd == 0 && r->mode != ESH_REDIRECT_OUTPUT && r->mode != ESH_REDIRECT_APPEND)
+            return true;
+    return false;
+}
+
 /* Implement the calculations 
  * Returns true if handled correctly, false otherwise. */
 static bool
@@ -28,6 +322,27 @@ circalc(struct esh_command *cmd)
 
     int r;
     char *argument = cmd->argv[1];
+    if (argument && !strcmp(argument, "-f")) {
+        char *file = cmd->argv[2];
+        if (file == NULL || cmd->argv[3]) {
+            fprintf(stderr, "usage: circalc -f FILE\n");
+            return true;
+        }
+        /* -f FILE is < FILE; -f - is the shell's standard input */
+        if (strcmp(file, "-")) {
+            struct esh_redirect **last = &cmd->redirects;
+            while (*last)
+                last = &(*last)->next;
+            *last = esh_redirect_create(0, ESH_REDIRECT_INPUT, strdup(file), -1);
+        }
+        circalc_batch(cmd, strcmp(file, "-") ? file : "stdin");
+        return true;
+    }
+    if (argument == NULL && input_redirected(cmd)) {
+        circalc_batch(cmd, "stdin");
+        return true;
+    }
+
     // if no argument is given doesn't work
     if (argument == NULL) {
 		esh_sys_error("You have to provide the raduis as an argument.\n");
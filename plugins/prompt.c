@@ -16,8 +16,17 @@ prompt(void)
         return strdup("custom prompt> ");
 }
 
+// the prompt never changes, so it is made only once
+static struct esh_prompt_fragment fragment = {
+        .make = prompt,
+        .invalidate_on = 0
+};
+
+// prompt_fragment is a field of version 2 plugins
+const int esh_module_version = ESH_PLUGIN_VERSION;
+
 struct esh_plugin esh_module = {
         .rank = 10,
         .init = init_plugin,
-        .make_prompt = prompt
+        .prompt_fragment = &fragment
 };
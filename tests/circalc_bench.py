@@ -0,0 +1,70 @@
+#!/usr/bin/python
+#
+# Benchmark for the batch mode of the circalc plugin: the throughput of
+# 'circalc -f FILE' over many radii, against one 'circalc R' command
+# per radius.  Both must print the same lines for the same radii.
+#
+# usage: circalc_bench.py <definitions script> <plugin dir> [radii]
+#
+import sys, imp, atexit
+import shellio, time, os, subprocess, shlex, random
+
+definitions_scriptname = sys.argv[1]
+plugin_dir = sys.argv[2]
+radii = int(sys.argv[3]) if len(sys.argv) > 3 else 1000000
+single = min(radii, 2000)
+def_module = imp.load_source('', definitions_scriptname)
+
+shell = shlex.split(def_module.shell + plugin_dir)
+path = "/tmp/esh-circalc-bench-%d" % os.getpid()
+atexit.register(lambda: os.path.exists(path) and os.unlink(path))
+
+def run(command):
+	p = subprocess.run(shell + ["-c", command], stdout=subprocess.PIPE,
+		stderr=subprocess.PIPE, universal_newlines=True)
+	lines = [l for l in p.stdout.splitlines() if l.startswith("area = ")]
+	return lines, p.stderr
+
+# The time of a command, less that of starting the shell
+def timed(command):
+	times = []
+	for c in ["circalc 1", command]:
+		start = time.time()
+		subprocess.run(shell + ["-c", c], stdout=subprocess.DEVNULL,
+			stderr=subprocess.DEVNULL)
+		times.append(time.time() - start)
+	return max(times[1] - times[0], 1e-6)
+
+# Integer radii, which both ways accept, and the same lines from both
+random.seed(3214)
+ints = [random.randint(0, 99999) for i in range(single)]
+with open(path, "w") as f:
+	f.write("\n".join(str(r) for r in ints) + "\n")
+one_by_one = "; ".join("circalc %d" % r for r in ints)
+expected, errors = run(one_by_one)
+lines, errors = run("circalc -f " + path)
+assert lines == expected, "Error: circalc -f and circalc R print different lines"
+assert len(lines) == single, "Error: %d lines for %d radii" % (len(lines), single)
+
+# Then many radii, with fractions and exponents, in a file
+with open(path, "w") as f:
+	for i in range(radii):
+		if i % 3 == 0:
+			f.write("%d\n" % random.randint(0, 99999))
+		elif i % 3 == 1:
+			f.write("%.3f\n" % random.uniform(0, 1e5))
+		else:
+			f.write("%.6e\n" % random.uniform(0, 1e5))
+lines, errors = run("circalc -f " + path)
+assert len(lines) == radii and errors == "", \
+	"Error: %d lines for %d radii, errors '%s'" % (len(lines), radii, errors)
+other, errors = run("circalc < " + path)
+assert other == lines, "Error: circalc < FILE and circalc -f FILE print different lines"
+
+one_by_one = timed(one_by_one) / single
+batch = timed("circalc -f " + path) / radii
+print("circalc R, %d commands: %12.0f radii/s" % (single, 1 / one_by_one))
+print("circalc -f, %d radii: %12.0f radii/s" % (radii, 1 / batch))
+print("speedup of the batch mode: %.1fx" % (one_by_one / batch))
+
+shellio.success()
@@ -0,0 +1,165 @@
+#!/usr/bin/python
+#
+# Test for the control socket: many clients connect at once and list,
+# start and signal jobs while the shell sits at its prompt.  Every
+# request must get its own complete response, and the jobs the clients
+# start must show up in, and disappear from, the shell's job table.
+#
+# usage: control_test.py <definitions script> <plugin dir> [clients]
+#
+import sys, imp, atexit
+sys.path.append("/home/courses/cs3214/software/pexpect-dpty/");
+import pexpect, shellio, time, os, socket, threading, json, glob, shutil, subprocess, tempfile
+
+#Ensure the shell process is terminated
+def force_shell_termination(shell_process):
+	c.close(force=True)
+
+definitions_scriptname = sys.argv[1]
+plugin_dir = sys.argv[2]
+clients = int(sys.argv[3]) if len(sys.argv) > 3 else 16
+def_module = imp.load_source('', definitions_scriptname)
+logfile = None
+if hasattr(def_module, 'logfile'):
+    logfile = def_module.logfile
+
+# The plugins under test, and one whose builtins are not offered to
+# completion
+test_plugin_dir = tempfile.mkdtemp()
+atexit.register(shutil.rmtree, test_plugin_dir)
+for so in glob.glob(os.path.join(plugin_dir, "*.so")):
+	shutil.copy(so, test_plugin_dir)
+here = os.path.dirname(os.path.abspath(__file__))
+subprocess.check_call(["gcc", "-shared", "-fPIC", "-o",
+	os.path.join(test_plugin_dir, "input_reader.so"),
+	os.path.join(here, "plugins", "input_reader.c")])
+plugin_dir = test_plugin_dir
+
+path = "/tmp/esh-control-test-%d.sock" % os.getpid()
+c = pexpect.spawn(def_module.shell + plugin_dir, drainpty=True, logfile=logfile)
+atexit.register(force_shell_termination, shell_process=c)
+
+c.sendline("set ESH_CONTROL_SOCKET=" + path)
+c.sendline("set -o control")
+c.sendline("echo control-is-on")
+assert c.expect("control-is-on\r\n") == 0, "Shell did not turn on the control socket"
+deadline = time.time() + 5
+while not os.path.exists(path):
+	assert time.time() < deadline, "Shell did not create " + path
+	time.sleep(0.05)
+
+class Client:
+	def __init__(self):
+		self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+		self.sock.settimeout(10)
+		self.sock.connect(path)
+		self.file = self.sock.makefile("r")
+	def request(self, line):
+		self.sock.sendall((line + "\n").encode())
+		response = self.file.readline()
+		assert response.endswith("\n"), "Error: truncated response to " + line
+		status, _, payload = response.rstrip("\n").partition(" ")
+		return status, payload
+	def close(self):
+		self.file.close()
+		self.sock.close()
+
+errors = []
+
+# Each client starts a job, finds it in the job list, and kills it
+def exercise(n):
+	try:
+		client = Client()
+		for round in range(5):
+			status, jid = client.request("run sleep %d" % (100 + n))
+			assert status == "ok", "run failed: " + jid
+			status, jobs = client.request("jobs")
+			assert status == "ok", "jobs failed: " + jobs
+			mine = [j for j in json.loads(jobs) if j["jid"] == int(jid)]
+			assert len(mine) == 1 and mine[0]["stages"][0]["argv"] == ["sleep", str(100 + n)], \
+				"job %s is missing from %s" % (jid, jobs)
+			status, stats = client.request("stats")
+			assert status == "ok" and json.loads(stats)["pid"] > 0, "stats failed: " + stats
+			status, error = client.request("signal %%%s TERM" % jid)
+			assert status == "ok", "signal failed: " + error
+		status, error = client.request("signal %999 TERM")
+		assert status == "error", "signalled a job that does not exist"
+		status, error = client.request("frobnicate")
+		assert status == "error", "accepted an unknown request"
+		client.close()
+	except Exception as e:
+		errors.append("client %d: %s" % (n, e))
+
+threads = [threading.Thread(target=exercise, args=(n,)) for n in range(clients)]
+start = time.time()
+for t in threads:
+	t.start()
+for t in threads:
+	t.join()
+elapsed = time.time() - start
+assert not errors, "Error: " + "; ".join(errors)
+
+# All jobs were killed, so the shell must end up with none
+client = Client()
+deadline = time.time() + 5
+while True:
+	status, jobs = client.request("jobs")
+	if json.loads(jobs) == []:
+		break
+	assert time.time() < deadline, "Error: jobs left over: " + jobs
+	time.sleep(0.1)
+status, stats = client.request("stats")
+assert json.loads(stats)["requests"] >= clients * 22, "Error: requests went uncounted: " + stats
+
+# Builtins would run in the shell itself, so they are refused
+for line in ["exit", "cd /", "fg", "set X=1", "nice=5 exit", "memo exit", "input_lines"]:
+	status, error = client.request("run " + line)
+	assert status == "error", "Error: 'run %s' was accepted" % line
+status, error = client.request("run true; true")
+assert status == "error", "Error: 'run' accepted two jobs"
+client.close()
+
+# A second shell does not take the socket of a running one
+d = pexpect.spawn(def_module.shell + plugin_dir, drainpty=True, logfile=logfile)
+atexit.register(d.close, force=True)
+d.sendline("set ESH_CONTROL_SOCKET=" + path)
+d.sendline("set -o control")
+assert d.expect_exact("in use by another process") == 0, "Error: the second shell took " + path
+d.close(force=True)
+client = Client()
+assert client.request("jobs")[0] == "ok", "Error: the first shell lost its socket"
+client.close()
+
+# The shell is still usable, and removes the socket when asked
+c.sendline("set +o control")
+c.sendline("echo control-is-off")
+assert c.expect("control-is-off\r\n") == 0, "Shell did not run the last command"
+assert not os.path.exists(path), "Error: the shell left " + path + " behind"
+
+# A file in the way is kept, and the socket stays off
+with open(path, "w") as f:
+	f.write("precious\n")
+c.sendline("set -o control")
+assert c.expect_exact("exists and is not a socket") == 0, "Error: a file at " + path + " was accepted"
+with open(path) as f:
+	assert f.read() == "precious\n", "Error: the file at " + path + " was replaced"
+os.unlink(path)
+
+# A socket left by a shell that crashed is replaced
+stale = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+stale.bind(path)
+stale.close()
+c.sendline("set -o control")
+c.sendline("echo stale-replaced")
+assert c.expect("stale-replaced\r\n") == 0, "Shell did not run the last command"
+client = Client()
+assert client.request("jobs")[0] == "ok", "Error: the stale socket was not replaced"
+client.close()
+c.sendline("set +o control")
+c.sendline("echo control-is-off-again")
+assert c.expect("control-is-off-again\r\n") == 0, "Shell did not run the last command"
+assert not os.path.exists(path), "Error: the shell left " + path + " behind"
+
+print("%d clients, %d requests in %.2fs" % (clients, clients * 22, elapsed))
+
+shellio.success()
@@ -0,0 +1,67 @@
+#!/usr/bin/python
+#
+# Test for coprocesses: a bc started with coproc answers many requests
+# sent with sendline and read back with readline-from, into stdout or
+# a variable.  readline-from times out when bc has nothing to say, and
+# reports end of file, forgetting the coprocess, once bc has quit.
+#
+# usage: coproc_test.py <definitions script> <plugin dir> [requests]
+#
+import sys, imp, atexit
+sys.path.append("/home/courses/cs3214/software/pexpect-dpty/");
+import pexpect, shellio, time
+
+#Ensure the shell process is terminated
+def force_shell_termination(shell_process):
+	c.close(force=True)
+
+definitions_scriptname = sys.argv[1]
+plugin_dir = sys.argv[2]
+requests = int(sys.argv[3]) if len(sys.argv) > 3 else 100
+def_module = imp.load_source('', definitions_scriptname)
+logfile = None
+if hasattr(def_module, 'logfile'):
+    logfile = def_module.logfile
+
+c = pexpect.spawn(def_module.shell + plugin_dir, drainpty=True, logfile=logfile)
+atexit.register(force_shell_termination, shell_process=c)
+
+def run(command, marker):
+	c.sendline(command + "; echo " + marker)
+	c.expect_exact(command + "; echo " + marker)
+	assert c.expect_exact(marker + "\r\n", timeout=10) == 0, \
+		"Error: shell did not finish '%s'" % command
+	return c.before
+
+# The exit status of a command
+def status(command, marker):
+	return run(command + "; echo status-$?", marker)
+
+c.sendline("coproc calc bc")
+assert c.expect(r"\[\d+\] \d+") == 0, "Error: coproc did not start bc as a job"
+
+# Round trips, the answer printed
+start = time.time()
+for i in range(requests):
+	output = run("sendline calc %d+%d; readline-from calc" % (i, 1000), "req-%d" % i)
+	assert output.endswith("%d\r\n" % (i + 1000)), "Error: %d+1000 gave %r" % (i, output)
+elapsed = time.time() - start
+
+# The answer in a variable
+output = run("sendline calc 6+7; readline-from calc answer; echo got-$answer", "var-read")
+assert "got-13" in output, "Error: readline-from did not set the variable: %r" % output
+
+# Nothing to read: a timeout, with status 142
+output = status("readline-from -t 0.2 calc", "timed-out")
+assert "status-142" in output, "Error: readline-from -t did not time out: %r" % output
+
+# bc quits: end of file, then the coprocess is gone
+run("sendline calc quit", "quit-sent")
+output = status("readline-from calc", "eof-read")
+assert "status-1" in output, "Error: readline-from did not see end of file: %r" % output
+output = run("readline-from calc", "forgotten")
+assert "no such coprocess" in output, "Error: the coprocess was not forgotten: %r" % output
+
+print("%d round trips through bc in %.3f s" % (requests, elapsed))
+
+shellio.success()
@@ -0,0 +1,121 @@
+#!/usr/bin/python
+#
+# Test for dag: jobs start only after their dependencies have
+# succeeded, independent ones run at the same time, a failure stops
+# the graph or, with -k, only what depends on it, and a job that stops
+# is killed instead of holding the prompt forever.  Jobs start quietly.
+#
+# usage: dag_test.py <definitions script> <plugin dir>
+#
+import sys, imp, atexit
+sys.path.append("/home/courses/cs3214/software/pexpect-dpty/");
+import pexpect, shellio, os, re, shutil, tempfile
+
+#Ensure the shell process is terminated
+def force_shell_termination(shell_process):
+	c.close(force=True)
+
+definitions_scriptname = sys.argv[1]
+plugin_dir = sys.argv[2]
+def_module = imp.load_source('', definitions_scriptname)
+logfile = None
+if hasattr(def_module, 'logfile'):
+    logfile = def_module.logfile
+
+# Each step logs when it starts and ends
+work = tempfile.mkdtemp()
+atexit.register(shutil.rmtree, work)
+log = os.path.join(work, "log")
+step = os.path.join(work, "step.sh")
+with open(step, "w") as f:
+	f.write("echo start-$1 >> %s\nsleep $2\necho end-$1 >> %s\n" % (log, log))
+
+def graph(name, text):
+	path = os.path.join(work, name)
+	with open(path, "w") as f:
+		f.write(text.replace("STEP", "sh " + step))
+	if os.path.exists(log):
+		os.unlink(log)
+	return path
+
+def logged():
+	with open(log) as f:
+		return f.read().split()
+
+c = pexpect.spawn(def_module.shell + plugin_dir, drainpty=True, logfile=logfile)
+atexit.register(force_shell_termination, shell_process=c)
+
+def run(command, marker):
+	c.sendline(command + "; echo status-$?; echo " + marker)
+	c.expect_exact(command + "; echo status-$?; echo " + marker)
+	assert c.expect_exact(marker + "\r\n", timeout=20) == 0, \
+		"Error: shell did not finish '%s'" % command
+	return c.before
+
+# A diamond: a, then b and c at the same time, then d
+path = graph("diamond", """
+a:
+	STEP a 0
+b: a
+	STEP b 0.5
+c: a
+	STEP c 0.5
+d: b c
+	STEP d 0
+""")
+output = run("dag -j 2 " + path, "diamond-done")
+assert "status-0" in output, "Error: the diamond failed: %r" % output
+order = logged()
+assert order[:2] == ["start-a", "end-a"] and order[-2:] == ["start-d", "end-d"], \
+	"Error: jobs ran out of order: %r" % order
+assert order[2:4] in (["start-b", "start-c"], ["start-c", "start-b"]), \
+	"Error: b and c did not run at the same time: %r" % order
+assert output.count(" ok") == 4, "Error: the report was %r" % output
+assert "critical path" in output, "Error: no critical path in %r" % output
+assert not re.search(r"\[\d+\] \d+", output), "Error: dag jobs were announced: %r" % output
+
+# A failure stops the graph
+path = graph("failure", """
+bad:
+	false
+after: bad
+	STEP after 0
+other:
+	STEP other 0
+""")
+output = run("dag -j 1 " + path, "failure-done")
+assert "status-1" in output and "job 'bad' failed" in output, \
+	"Error: the failure was not reported: %r" % output
+assert not os.path.exists(log), "Error: jobs started after the failure"
+
+# With -k, only what depends on it is skipped
+output = run("dag -j 1 -k " + path, "keep-going-done")
+assert "status-1" in output, "Error: dag -k succeeded: %r" % output
+assert logged() == ["start-other", "end-other"], "Error: dag -k ran %r" % logged()
+assert re.search(r"after\s+[0-9.]+ s  skipped", output), "Error: 'after' was not skipped: %r" % output
+
+# A job that reads the terminal stops, and is killed
+path = graph("stopped", """
+reader:
+	cat
+""")
+output = run("dag " + path, "stopped-done")
+assert "job 'reader' stopped" in output and "status-1" in output, \
+	"Error: the stopped job was not killed: %r" % output
+
+# Graphs that cannot run
+path = graph("cycle", "x: y\n\tSTEP x 0\ny: x\n\tSTEP y 0\n")
+output = run("dag " + path, "cycle-done")
+assert "cycle" in output and "status-2" in output, "Error: the cycle was run: %r" % output
+path = graph("unknown", "x: nowhere\n\tSTEP x 0\n")
+output = run("dag " + path, "unknown-done")
+assert "unknown job" in output and "status-2" in output, "Error: 'nowhere' was accepted: %r" % output
+path = graph("empty", "# nothing to do\n")
+output = run("dag " + path, "empty-done")
+assert "no jobs" in output and "status-2" in output, "Error: the empty graph was accepted: %r" % output
+
+# The shell is still usable, with no job left over
+output = run("jobs", "jobs-done")
+assert "Running" not in output and "Stopped" not in output, "Error: jobs left over: %r" % output
+
+shellio.success()
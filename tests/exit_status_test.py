@@ -0,0 +1,84 @@
+#!/usr/bin/python
+#
+# Test for exit statuses: $?, PIPESTATUS, set -o pipefail, && and ||,
+# and redirections whose file names use them, which are expanded when
+# their command is launched rather than when the line is read.
+#
+# usage: exit_status_test.py <definitions script> <plugin dir>
+#
+import sys, imp, atexit
+sys.path.append("/home/courses/cs3214/software/pexpect-dpty/");
+import pexpect, shellio, os, shutil, tempfile
+
+#Ensure the shell process is terminated
+def force_shell_termination(shell_process):
+	c.close(force=True)
+
+definitions_scriptname = sys.argv[1]
+plugin_dir = sys.argv[2]
+def_module = imp.load_source('', definitions_scriptname)
+logfile = None
+if hasattr(def_module, 'logfile'):
+    logfile = def_module.logfile
+
+work = tempfile.mkdtemp()
+atexit.register(shutil.rmtree, work)
+with open(os.path.join(work, "exit3.sh"), "w") as f:
+	f.write("exit 3\n")
+
+c = pexpect.spawn(def_module.shell + plugin_dir, drainpty=True, logfile=logfile)
+atexit.register(force_shell_termination, shell_process=c)
+
+def run(command, marker):
+	c.sendline(command + "; echo " + marker)
+	c.expect_exact(command + "; echo " + marker)
+	c.expect_exact(marker + "\r\n")
+	return c.before
+
+def contents(name):
+	with open(os.path.join(work, name)) as f:
+		return f.read()
+
+c.sendline("cd " + work)
+
+# $? is the status of the last pipeline
+assert "status-1" in run("false; echo status-$?", "false"), "Error: false did not give 1"
+assert "status-0" in run("true; echo status-$?", "true"), "Error: true did not give 0"
+assert "status-3" in run("sh exit3.sh; echo status-$?", "exit3"), "Error: exit 3 did not give 3"
+output = run("no-such-command-here; echo status-$?", "not-found")
+assert "status-127" in output, "Error: a missing command gave %r" % output
+
+# PIPESTATUS has the status of every command, ${PIPESTATUS[N]} one of them
+output = run("sh exit3.sh | true | false; echo all-$PIPESTATUS-second-${PIPESTATUS[1]}", "pipestatus")
+assert "all-3 0 1-second-0" in output, "Error: PIPESTATUS gave %r" % output
+
+# With pipefail, the last failing command decides
+output = run("false | true; echo status-$?", "no-pipefail")
+assert "status-0" in output, "Error: false | true failed without pipefail: %r" % output
+run("set -o pipefail", "pipefail-on")
+output = run("sh exit3.sh | false | true; echo status-$?", "pipefail")
+assert "status-1" in output, "Error: pipefail gave %r" % output
+run("set +o pipefail", "pipefail-off")
+
+# && and || run the next pipeline depending on the status
+output = run("true && echo and-ran; false && echo and-skipped", "and")
+assert "and-ran" in output and "and-skipped" not in output, "Error: && gave %r" % output
+output = run("false || echo or-ran; true || echo or-skipped", "or")
+assert "or-ran" in output and "or-skipped" not in output, "Error: || gave %r" % output
+output = run("sh exit3.sh && echo skipped; echo kept-$?", "kept")
+assert "kept-3" in output, "Error: a skipped pipeline changed $?: %r" % output
+output = run("false && echo left-a || echo left-b", "left")
+assert "left-b" in output and "left-a" not in output, "Error: && || gave %r" % output
+
+# Redirection targets see $? and variables set earlier on the line
+run("false; echo failed > log.$?", "status-target")
+assert contents("log.1") == "failed\n", "Error: > log.$? did not see the status"
+run("set F=named; echo hi > $F; echo more >> $F", "variable-target")
+assert contents("named") == "hi\nmore\n", "Error: > $F wrote %r" % contents("named")
+output = run("cat < $F; cat <<<$F-$?", "input-target")
+assert "hi" in output and "named-0" in output, "Error: < $F and <<<$F gave %r" % output
+output = run("echo lost > $NO_SUCH_VARIABLE; echo status-$?", "empty-target")
+assert "Missing name for redirect." in output and "status-1" in output, \
+	"Error: an empty file name gave %r" % output
+
+shellio.success()
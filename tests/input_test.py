@@ -0,0 +1,98 @@
+#!/usr/bin/python
+#
+# Test for the input of builtins: a regular file is mapped and comes
+# in one block, a pipe is streamed in several, and both give the same
+# bytes and lines, including a line longer than a block and a last
+# line without a newline.  Builds tests/plugins/input_reader.c, along
+# with the plugins in <plugin dir>.
+#
+# usage: input_test.py <definitions script> <plugin dir>
+#
+import sys, imp, atexit
+sys.path.append("/home/courses/cs3214/software/pexpect-dpty/");
+import pexpect, shellio, os, re, glob, shutil, subprocess, tempfile
+
+#Ensure the shell process is terminated
+def force_shell_termination(shell_process):
+	c.close(force=True)
+
+definitions_scriptname = sys.argv[1]
+plugin_dir = sys.argv[2]
+def_module = imp.load_source('', definitions_scriptname)
+logfile = None
+if hasattr(def_module, 'logfile'):
+    logfile = def_module.logfile
+
+# The plugins under test, and the input reader
+test_plugin_dir = tempfile.mkdtemp()
+atexit.register(shutil.rmtree, test_plugin_dir)
+for so in glob.glob(os.path.join(plugin_dir, "*.so")):
+	shutil.copy(so, test_plugin_dir)
+here = os.path.dirname(os.path.abspath(__file__))
+subprocess.check_call(["gcc", "-shared", "-fPIC", "-o",
+	os.path.join(test_plugin_dir, "input_reader.so"),
+	os.path.join(here, "plugins", "input_reader.c")])
+
+# Short lines, one longer than a block, and a last line without a newline
+work = tempfile.mkdtemp()
+atexit.register(shutil.rmtree, work)
+data = os.path.join(work, "data")
+with open(data, "w") as f:
+	for i in range(20000):
+		f.write("line %05d\n" % i)
+	f.write("x" * 100000 + "\n")
+	f.write("the end")
+size = os.path.getsize(data)
+fifo = os.path.join(work, "fifo")
+os.mkfifo(fifo)
+empty = os.path.join(work, "empty")
+open(empty, "w").close()
+
+c = pexpect.spawn(def_module.shell + test_plugin_dir, drainpty=True, logfile=logfile)
+atexit.register(force_shell_termination, shell_process=c)
+
+def run(command, marker):
+	c.sendline(command + "; echo " + marker)
+	c.expect_exact(command + "; echo " + marker)
+	c.expect_exact(marker + "\r\n")
+	return c.before
+
+def blocks(output):
+	m = re.search(r"input: (\d+) blocks, (\d+) bytes, (\d+) newlines", output)
+	assert m, "Error: input_blocks said %r" % output
+	return [int(n) for n in m.groups()]
+
+lines = "input: 20002 lines, longest 100000, last 'the end'"
+
+# A regular file comes in one block
+n, nbytes, newlines = blocks(run("input_blocks < " + data, "file-blocks"))
+assert (n, nbytes, newlines) == (1, size, 20001), \
+	"Error: the file came in %d blocks of %d bytes, %d newlines" % (n, nbytes, newlines)
+output = run("input_lines < " + data, "file-lines")
+assert lines in output, "Error: the file had %r" % output
+
+# A pipe is streamed
+c.sendline("cat " + data + " > " + fifo + " &")
+c.expect("\[[0-9]+\] [0-9]+")
+n, nbytes, newlines = blocks(run("input_blocks < " + fifo, "pipe-blocks"))
+assert n > 1 and (nbytes, newlines) == (size, 20001), \
+	"Error: the pipe came in %d blocks of %d bytes, %d newlines" % (n, nbytes, newlines)
+c.sendline("cat " + data + " > " + fifo + " &")
+c.expect("\[[0-9]+\] [0-9]+")
+output = run("input_lines < " + fifo, "pipe-lines")
+assert lines in output, "Error: the pipe had %r" % output
+
+# A here-string, and an empty file
+output = run("input_lines <<< hello", "herestring")
+assert "input: 1 lines, longest 5, last 'hello'" in output, "Error: the here-string gave %r" % output
+assert blocks(run("input_blocks < " + empty, "empty-blocks")) == [0, 0, 0], \
+	"Error: the empty file was not empty"
+output = run("input_lines < " + empty, "empty-lines")
+assert "input: 0 lines" in output, "Error: the empty file had %r" % output
+
+# A file that cannot be opened is reported
+output = run("input_lines < " + os.path.join(work, "missing"), "missing")
+assert "No such file" in output and "input:" not in output, \
+	"Error: the missing file gave %r" % output
+
+shellio.success()
@@ -0,0 +1,126 @@
+#!/usr/bin/python
+#
+# Test for memoized commands: a second run with the same inputs
+# replays the output and exit status without running the command, and
+# changing an input declared with -i or -e, or the file read with <,
+# runs it again.  On a miss, the output is shown while the command
+# runs.  A memoized command that is stopped and resumed with fg shows
+# all of its output, and is not cached.
+#
+# usage: memo_test.py <definitions script> <plugin dir>
+#
+import sys, imp, atexit
+sys.path.append("/home/courses/cs3214/software/pexpect-dpty/");
+import pexpect, shellio, os, shutil, tempfile, time
+
+#Ensure the shell process is terminated
+def force_shell_termination(shell_process):
+	c.close(force=True)
+
+definitions_scriptname = sys.argv[1]
+plugin_dir = sys.argv[2]
+def_module = imp.load_source('', definitions_scriptname)
+logfile = None
+if hasattr(def_module, 'logfile'):
+    logfile = def_module.logfile
+
+# The store, and scripts that count how often they really run
+work = tempfile.mkdtemp()
+atexit.register(shutil.rmtree, work)
+runs = os.path.join(work, "runs")
+def script(name, body):
+	path = os.path.join(work, name)
+	with open(path, "w") as f:
+		f.write("echo run >> %s\n%s\n" % (runs, body))
+	return path
+count = script("count.sh", "echo out-$1\necho err-$1 1>&2\ncat\nexit 3")
+slow = script("slow.sh", "echo one\nsleep 1\necho two")
+stream = script("stream.sh", "echo early\necho early-err 1>&2\nsleep 2\necho late")
+data = os.path.join(work, "data")
+with open(data, "w") as f:
+	f.write("first\n")
+
+def run_count():
+	if not os.path.exists(runs):
+		return 0
+	with open(runs) as f:
+		return len(f.readlines())
+
+c = pexpect.spawn(def_module.shell + plugin_dir, drainpty=True, logfile=logfile)
+atexit.register(force_shell_termination, shell_process=c)
+
+def run(command, marker):
+	c.sendline(command + "; echo " + marker)
+	c.expect_exact(command + "; echo " + marker)
+	assert c.expect_exact(marker + "\r\n", timeout=10) == 0, \
+		"Error: shell did not finish '%s'" % command
+	return c.before
+
+# Run a memoized command; return its output and whether it ran
+def memo(args, marker, expected):
+	before = run_count()
+	output = run("memo " + args + "; echo status-$?", marker)
+	for line in expected + ["status-3"]:
+		assert line in output, "Error: 'memo %s' printed %r" % (args, output)
+	return run_count() > before
+
+run("set ESH_MEMO_DIR=" + os.path.join(work, "store"), "store-set")
+
+# A miss, then a hit with the same output, error output and status
+assert memo("sh %s A < %s" % (count, data), "miss", ["out-A", "err-A", "first"]), \
+	"Error: the first run was not run"
+assert not memo("sh %s A < %s" % (count, data), "hit", ["out-A", "err-A", "first"]), \
+	"Error: the second run was not replayed"
+
+# Other arguments, and other contents of the file read, are other entries
+assert memo("sh %s B < %s" % (count, data), "other-args", ["out-B"]), \
+	"Error: other arguments were replayed"
+with open(data, "w") as f:
+	f.write("second\n")
+assert memo("sh %s A < %s" % (count, data), "other-input", ["out-A", "second"]), \
+	"Error: the output for other input was replayed"
+
+# Declared inputs: a path's size and time, and a variable
+marker = os.path.join(work, "marker")
+with open(marker, "w") as f:
+	f.write("1")
+args = "-i %s -e COLOR sh %s C < %s" % (marker, count, data)
+run("set COLOR=red", "red")
+assert memo(args, "declared-miss", ["out-C"]), "Error: the first run was not run"
+assert not memo(args, "declared-hit", ["out-C"]), "Error: the second run was not replayed"
+with open(marker, "w") as f:
+	f.write("22")
+assert memo(args, "path-changed", ["out-C"]), "Error: a changed -i path was ignored"
+run("set COLOR=blue", "blue")
+assert memo(args, "var-changed", ["out-C"]), "Error: a changed -e variable was ignored"
+
+# A miss shows the output as it comes, not once the command has ended
+start = time.time()
+c.sendline("memo sh " + stream + "; echo streamed")
+c.expect_exact("memo sh " + stream + "; echo streamed")
+c.expect_exact("early-err")
+assert time.time() - start < 1.5, "Error: the output was held back until the end"
+c.expect_exact("late")
+c.expect_exact("streamed\r\n")
+output = run("memo sh " + stream, "stream-replayed")
+assert "early" in output and "early-err" in output and "late" in output, \
+	"Error: the streamed run was stored as %r" % output
+
+# Stopped and resumed: all of the output is shown, nothing is cached
+run("echo", "before-stop")
+c.sendline("memo sh " + slow)
+time.sleep(0.5)
+c.sendcontrol('z')
+assert c.expect_exact("one") == 0, "Error: the output up to the stop was not shown"
+assert c.expect("Stopped") == 0, "Error: the memoized command was not stopped"
+c.sendline("fg")
+assert c.expect_exact("two", timeout=5) == 0, "Error: output after fg was lost"
+before = run_count()
+output = run("memo sh " + slow, "after-stop")
+assert "one" in output and "two" in output, "Error: the second run printed %r" % output
+assert run_count() == before + 1, "Error: a stopped run was cached"
+output = run("memo sh " + slow, "after-full-run")
+assert "one" in output and "two" in output, "Error: the replay printed %r" % output
+assert run_count() == before + 1, "Error: a complete run was not cached"
+
+shellio.success()
@@ -0,0 +1,70 @@
+#!/usr/bin/python
+#
+# Benchmark for job notifications: background jobs complete while a
+# line is being typed.  With set -o notify the shell reports them as
+# they happen; the line typed must come out intact, and every job must
+# be reported exactly once.
+#
+# usage: notify_bench.py <definitions script> <plugin dir> [jobs]
+#
+import sys, imp, atexit
+sys.path.append("/home/courses/cs3214/software/pexpect-dpty/");
+import pexpect, shellio, time, re
+
+#Ensure the shell process is terminated
+def force_shell_termination(shell_process):
+	c.close(force=True)
+
+definitions_scriptname = sys.argv[1]
+plugin_dir = sys.argv[2]
+jobs = int(sys.argv[3]) if len(sys.argv) > 3 else 100
+def_module = imp.load_source('', definitions_scriptname)
+logfile = None
+if hasattr(def_module, 'logfile'):
+    logfile = def_module.logfile
+
+c = pexpect.spawn(def_module.shell + plugin_dir, drainpty=True, logfile=logfile)
+atexit.register(force_shell_termination, shell_process=c)
+
+# Everything the shell prints from now on
+class Recorder:
+	def __init__(self):
+		self.text = ""
+	def write(self, data):
+		self.text += data if isinstance(data, str) else data.decode("utf-8", "replace")
+	def flush(self):
+		pass
+output = Recorder()
+c.logfile_read = output
+
+c.sendline("set -o notify")
+
+# Start the jobs so that they end spread over the next few seconds
+for i in range(jobs):
+	c.sendline("sleep %.3f &" % (1 + 3.0 * i / jobs))
+	assert c.expect(r"\[\d+\] \d+") == 0, "Shell did not report the background job"
+
+# Type a long line slowly while the jobs complete
+line = "echo " + " ".join("word%d" % i for i in range(60))
+start = time.time()
+for ch in line:
+	c.send(ch)
+	time.sleep(0.01)
+c.send("\r")
+typing = time.time() - start
+
+expected = line[len("echo "):]
+assert c.expect("(?<!echo )" + re.escape(expected) + "\r\n", timeout=10) == 0, \
+	"Error: the line typed was garbled by job notifications"
+
+# Every job is reported once, either while typing or before the next prompt
+time.sleep(1)
+c.sendline("echo end-of-test")
+assert c.expect("end-of-test\r\n") == 0, "Shell did not run the last command"
+reported = len(re.findall(r"\[\d+\]\s+Done", output.text))
+assert reported == jobs, "Error: %d of %d jobs were reported" % (reported, jobs)
+
+print("%d jobs, %.2fs to type %d characters (%.1f ms per character)" %
+	(jobs, typing, len(line), 1000 * typing / len(line)))
+
+shellio.success()
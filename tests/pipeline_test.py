@@ -0,0 +1,70 @@
+#!/usr/bin/python
+#
+# Test for foreground waits on wide pipelines: a 64-stage pipeline must
+# be waited for until all of its stages have ended, whichever order
+# they end in, and must be reported once when it is stopped.
+#
+# usage: pipeline_test.py <definitions script> <plugin dir> [runs]
+#
+import sys, imp, atexit
+sys.path.append("/home/courses/cs3214/software/pexpect-dpty/");
+import pexpect, shellio, time
+
+#Ensure the shell process is terminated
+def force_shell_termination(shell_process):
+	c.close(force=True)
+
+definitions_scriptname = sys.argv[1]
+plugin_dir = sys.argv[2]
+runs = int(sys.argv[3]) if len(sys.argv) > 3 else 50
+def_module = imp.load_source('', definitions_scriptname)
+logfile = None
+if hasattr(def_module, 'logfile'):
+    logfile = def_module.logfile
+
+stages = 64
+c = pexpect.spawn(def_module.shell + plugin_dir, drainpty=True, logfile=logfile)
+atexit.register(force_shell_termination, shell_process=c)
+
+def run(command, marker):
+	c.sendline(command + "; echo " + marker)
+	c.expect_exact(command + "; echo " + marker)
+	assert c.expect_exact(marker + "\r\n", timeout=10) == 0, \
+		"Error: shell did not finish '%s...'" % command[:40]
+	return c.before
+
+# Stages end from the front: each cat sees end of file after the one before it
+pipeline = "echo hello" + " | cat" * (stages - 1)
+times = []
+for i in range(runs):
+	start = time.time()
+	output = run(pipeline, "run-%d-done" % i)
+	times.append(time.time() - start)
+	assert output.count("hello") == 1, "Error: %d-stage pipeline printed %r" % (stages, output)
+
+# Stages end from the back: head exits first, the others die of SIGPIPE
+output = run("yes" + " | cat" * (stages - 2) + " | head -1", "sigpipe-done")
+assert output.count("y\r\n") == 1, "Error: yes | ... | head -1 printed %r" % output
+
+# A stopped pipeline is reported once, can be resumed, and leaves the job table
+c.sendline("sleep 30" + " | cat" * (stages - 2) + " | sleep 30")
+time.sleep(1)
+c.sendcontrol('z')
+time.sleep(1)
+c.sendline("echo stopped")
+c.expect_exact("echo stopped")
+reported = c.before.count("Stopped")
+assert reported == 1, "Error: the stopped pipeline was reported %d times" % reported
+output = run("jobs", "jobs-done")
+assert output.count("Stopped") == 1, "Error: the stopped pipeline was listed as %r" % output
+c.sendline("fg")
+time.sleep(1)
+c.sendcontrol('c')
+output = run("jobs", "fg-done")
+assert output.count("sleep") == 0, "Error: the pipeline stayed in the job table: %r" % output
+
+times.sort()
+print("%d-stage pipeline, %d runs: mean %.2f ms  p50 %.2f ms  max %.2f ms" % (stages, runs,
+	1000 * sum(times) / len(times), 1000 * times[len(times) // 2], 1000 * times[-1]))
+
+shellio.success()
@@ -0,0 +1,78 @@
+/*
+ * A plug-in for input_test.py: 'input_blocks' reports how its input
+ * came, in blocks, through shell->read_input, and 'input_lines' how
+ * many lines shell->read_input_line found and what the longest and
+ * last ones were.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "../../esh.h"
+
+static struct esh_shell *shell;
+
+static bool
+init_plugin(struct esh_shell *esh)
+{
+    shell = esh;
+    printf("Plugin 'input_reader' initialized...\n");
+    return true;
+}
+
+static void
+input_blocks(struct esh_input *in)
+{
+    const char *data;
+    ssize_t len;
+    long blocks = 0, bytes = 0, newlines = 0;
+
+    while ((len = shell->read_input(in, &data)) > 0) {
+        const char *p;
+        for (p = data; (p = memchr(p, '\n', data + len - p)) != NULL; p++)
+            newlines++;
+        blocks++;
+        bytes += len;
+    }
+    printf("input: %ld blocks, %ld bytes, %ld newlines\n", blocks, bytes, newlines);
+}
+
+static void
+input_lines(struct esh_input *in)
+{
+    const char *line;
+    ssize_t len;
+    long lines = 0, longest = 0;
+    char last[64] = "";
+
+    while ((len = shell->read_input_line(in, &line)) != -1) {
+        lines++;
+        if (len > longest)
+            longest = len;
+        snprintf(last, sizeof last, "%.*s", (int) (len < 63 ? len : 63), line);
+    }
+    printf("input: %ld lines, longest %ld, last '%s'\n", lines, longest, last);
+}
+
+static bool
+input_builtin(struct esh_command *cmd)
+{
+    bool blocks = !strcmp(cmd->argv[0], "input_blocks");
+    if (!blocks && strcmp(cmd->argv[0], "input_lines"))
+        return false;
+
+    struct esh_input *in = shell->open_input(cmd);
+    if (in == NULL)
+        return true;
+    if (blocks)
+        input_blocks(in);
+    else
+        input_lines(in);
+    shell->close_input(in);
+    return true;
+}
+
+struct esh_plugin esh_module = {
+  .rank = 1,
+  .init = init_plugin,
+  .process_builtin = input_builtin
+};
@@ -0,0 +1,44 @@
+/*
+ * A plug-in for status_test.py: it counts the status changes it is
+ * told about, reports them itself, and prints the count with the
+ * 'status_events' command.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include "../../esh.h"
+
+/* Updated in the SIGCHLD handler */
+static volatile sig_atomic_t events;
+
+static bool
+init_plugin(struct esh_shell *shell)
+{
+    printf("Plugin 'status_counter' initialized...\n");
+    return true;
+}
+
+static bool
+count_status_change(struct esh_command *cmd, int waitstatus)
+{
+    events++;
+    return true;
+}
+
+static bool
+status_events_builtin(struct esh_command *cmd)
+{
+    if (strcmp(cmd->argv[0], "status_events"))
+        return false;
+
+    printf("status events: %d\n", (int) events);
+    return true;
+}
+
+struct esh_plugin esh_module = {
+  .rank = 1,
+  .init = init_plugin,
+  .process_builtin = status_events_builtin,
+  .command_status_change = count_status_change
+};
@@ -0,0 +1,131 @@
+#!/usr/bin/python
+#
+# Test for file-descriptor redirection: N>, N>>, N>&M, &>, N<> and <<<.
+# Here-strings are read from a memfd, or, where memfd_create fails, from
+# a pipe; a here-string larger than the pipe buffer then has a writer
+# process, which must not remain a child of the command.
+#
+# usage: redirect_test.py <definitions script> <plugin dir>
+#
+import sys, imp, atexit
+sys.path.append("/home/courses/cs3214/software/pexpect-dpty/");
+import pexpect, shellio, os, shutil, subprocess, tempfile, time
+
+#Ensure the shell process is terminated
+def force_shell_termination(shell_process):
+	shell_process.close(force=True)
+
+definitions_scriptname = sys.argv[1]
+plugin_dir = sys.argv[2]
+def_module = imp.load_source('', definitions_scriptname)
+logfile = None
+if hasattr(def_module, 'logfile'):
+    logfile = def_module.logfile
+
+work = tempfile.mkdtemp()
+atexit.register(shutil.rmtree, work)
+
+# A library that makes memfd_create fail, to take the pipe path
+shim = os.path.join(work, "no_memfd.so")
+shim_source = os.path.join(work, "no_memfd.c")
+with open(shim_source, "w") as f:
+	f.write("#include <errno.h>\n"
+		"int memfd_create(const char *name, unsigned int flags)\n"
+		"{ errno = ENOSYS; return -1; }\n")
+subprocess.check_call(["gcc", "-shared", "-fPIC", "-o", shim, shim_source])
+
+# The shell has no quoting, so the commands are scripts
+scripts = {
+	"to_err.sh": 'echo "$1" >&2\n',
+	"to_fd3.sh": 'echo on-three >&3\n',
+	"both.sh": 'echo out; echo err >&2\n',
+	"read_fd4.sh": 'cat <&4\n',
+	"stdin.sh": 'readlink /proc/self/fd/0\n',
+}
+for name, text in scripts.items():
+	with open(os.path.join(work, name), "w") as f:
+		f.write(text)
+
+# A here-string larger than a pipe buffer, passed in the environment
+big = "x" * 100000
+
+def spawn(preload):
+	env = "env BIG=" + big + " "
+	if preload:
+		env += "LD_PRELOAD=" + shim + " "
+	shell = pexpect.spawn(env + def_module.shell + plugin_dir, drainpty=True, logfile=logfile)
+	atexit.register(force_shell_termination, shell_process=shell)
+	shell.sendline("cd " + work)
+	return shell
+
+def run(command, marker):
+	c.sendline(command + "; echo " + marker)
+	c.expect_exact(command + "; echo " + marker)
+	c.expect_exact(marker + "\r\n")
+	return c.before
+
+def contents(name):
+	with open(os.path.join(work, name)) as f:
+		return f.read()
+
+c = spawn(False)
+
+# N> and N>>
+run("sh to_err.sh one 2> err", "fd-greater")
+assert contents("err") == "one\n", "Error: 2> wrote %r" % contents("err")
+run("sh to_err.sh two 2>> err", "fd-append")
+assert contents("err") == "one\ntwo\n", "Error: 2>> wrote %r" % contents("err")
+
+# N>&M, also into a pipe
+output = run("sh to_fd3.sh 3>&1", "dup")
+assert "on-three" in output, "Error: 3>&1 printed %r" % output
+output = run("sh to_err.sh piped 2>&1 | tr a-z A-Z", "dup-pipe")
+assert "PIPED" in output, "Error: 2>&1 | tr printed %r" % output
+
+# &> sends both standard output and error to the file
+run("sh both.sh &> both", "amp-greater")
+assert contents("both") == "out\nerr\n", "Error: &> wrote %r" % contents("both")
+
+# N<> opens for reading and writing, and creates the file
+with open(os.path.join(work, "rw"), "w") as f:
+	f.write("read-write\n")
+output = run("sh read_fd4.sh 4<> rw", "less-greater")
+assert "read-write" in output, "Error: 4<> read %r" % output
+run("true 5<> created", "create")
+assert os.path.exists(os.path.join(work, "created")), "Error: 5<> did not create the file"
+
+# <<< from a memfd
+output = run("cat <<< hello", "here-string")
+assert "hello" in output, "Error: <<< printed %r" % output
+output = run("sh stdin.sh <<< x", "memfd")
+assert "memfd:" in output, "Error: the here-string was not a memfd: %r" % output
+output = run("cat <<<$BIG | wc -c", "memfd-big")
+assert str(len(big) + 1) in output, "Error: a large here-string gave %r" % output
+c.sendline("exit")
+
+# <<< from a pipe, when memfd_create fails
+c = spawn(True)
+output = run("sh stdin.sh <<< x", "pipe")
+assert "pipe:" in output, "Error: the here-string was not a pipe: %r" % output
+output = run("cat <<< small", "pipe-small")
+assert "small" in output, "Error: <<< through a pipe printed %r" % output
+output = run("cat <<<$BIG | wc -c", "pipe-big")
+assert str(len(big) + 1) in output, "Error: a large here-string gave %r" % output
+
+# The writer of a large here-string is not a child of the command,
+# which would leave it a zombie
+c.sendline("sleep 2 <<<$BIG &")
+c.expect("\[[0-9]+\] ([0-9]+)")
+pid = c.match.group(1)
+time.sleep(0.5)
+children = []
+for entry in os.listdir("/proc"):
+	try:
+		with open("/proc/%s/stat" % entry) as f:
+			if f.read().rsplit(")", 1)[1].split()[1] == pid:
+				children.append(entry)
+	except (IOError, OSError, IndexError, ValueError):
+		pass
+assert children == [], "Error: the command has children %r" % children
+
+shellio.success()
@@ -0,0 +1,140 @@
+#!/usr/bin/python
+#
+# Test for the scheduling attributes of jobs: cpus=, nice= and sched=
+# are applied to every command of the job, as /proc/<pid> shows, renice
+# changes a running job, and invalid values are refused.
+#
+# usage: sched_test.py <definitions script> <plugin dir>
+#
+import sys, imp, atexit
+sys.path.append("/home/courses/cs3214/software/pexpect-dpty/");
+import pexpect, shellio, os, shutil, tempfile, time
+
+#Ensure the shell process is terminated
+def force_shell_termination(shell_process):
+	c.close(force=True)
+
+definitions_scriptname = sys.argv[1]
+plugin_dir = sys.argv[2]
+def_module = imp.load_source('', definitions_scriptname)
+logfile = None
+if hasattr(def_module, 'logfile'):
+    logfile = def_module.logfile
+
+c = pexpect.spawn(def_module.shell + plugin_dir, drainpty=True, logfile=logfile)
+atexit.register(force_shell_termination, shell_process=c)
+
+def run(command, marker):
+	c.sendline(command + "; echo " + marker)
+	c.expect_exact(command + "; echo " + marker)
+	c.expect_exact(marker + "\r\n")
+	return c.before
+
+def stat(pid):
+	with open("/proc/%d/stat" % pid) as f:
+		return f.read().rsplit(")", 1)[1].split()
+
+# Start 'command' in the background and return the pids of its job,
+# the processes in the process group of the one announced
+def background(command):
+	c.sendline(command + " &")
+	c.expect("\[([0-9]+)\] ([0-9]+)")
+	jid = int(c.match.group(1))
+	# let the commands exec
+	time.sleep(0.3)
+	pgrp = stat(int(c.match.group(2)))[2]
+	pids = []
+	for p in os.listdir("/proc"):
+		try:
+			if p.isdigit() and stat(int(p))[2] == pgrp:
+				pids.append(int(p))
+		except IOError:
+			pass
+	assert len(pids) == command.count("|") + 1, "Error: the job has processes %r" % pids
+	return jid, pids
+
+def cpus_allowed(pid):
+	with open("/proc/%d/status" % pid) as f:
+		for line in f:
+			if line.startswith("Cpus_allowed_list:"):
+				return line.split()[1]
+
+# niceness and policy, fields 19 and 41 of /proc/<pid>/stat
+def nice_and_policy(pid):
+	fields = stat(pid)
+	return int(fields[16]), int(fields[38])
+
+# The highest numbered CPU the shell may use
+cpu = max(os.sched_getaffinity(0))
+
+jid, pids = background("cpus=%d nice=5 sched=batch sleep 30 | sleep 30" % cpu)
+for pid in pids:
+	assert cpus_allowed(pid) == str(cpu), \
+		"Error: %d may use CPUs %s" % (pid, cpus_allowed(pid))
+	assert nice_and_policy(pid) == (5, 3), \
+		"Error: %d has niceness and policy %r" % (pid, nice_and_policy(pid))
+
+# renice changes every process of the job
+run("renice 9 %%%d" % jid, "renice-done")
+for pid in pids:
+	assert nice_and_policy(pid)[0] == 9, "Error: renice left %d at %d" % (pid, nice_and_policy(pid)[0])
+run("kill %%%d" % jid, "kill-done")
+
+# cpus=auto gives each command a CPU of its own
+jid, pids = background("cpus=auto sleep 30 | sleep 30")
+for pid in pids:
+	allowed = cpus_allowed(pid)
+	assert "," not in allowed and "-" not in allowed and int(allowed) in os.sched_getaffinity(0), \
+		"Error: cpus=auto let %d use %s" % (pid, allowed)
+run("kill %%%d" % jid, "auto-kill-done")
+
+# Each part of a batch command is pinned with cpus=auto, and gets the
+# niceness of an attribute in front of a command named in ESH_BATCHABLE
+work = tempfile.mkdtemp()
+atexit.register(shutil.rmtree, work)
+parts = os.path.join(work, "parts")
+script = os.path.join(work, "part.sh")
+with open(script, "w") as f:
+	f.write("#!/bin/sh\necho $# $(cut -d' ' -f19 /proc/$$/stat) "
+		"$(grep Cpus_allowed_list /proc/$$/status | cut -f2) >> %s\n" % parts)
+os.chmod(script, 0o755)
+
+def batch_parts(command, marker):
+	if os.path.exists(parts):
+		os.unlink(parts)
+	output = run(command + " $(seq 1 300000); echo status-$?", marker)
+	assert "status-0" in output, "Error: '%s' failed: %r" % (command, output)
+	with open(parts) as f:
+		runs = [line.split() for line in f]
+	assert len(runs) > 1 and sum(int(r[0]) for r in runs) == 300000, \
+		"Error: '%s' ran %r" % (command, runs)
+	return runs
+
+runs = batch_parts("cpus=auto batch -j 2 " + script, "batch-auto")
+cpus = [r[2] for r in runs]
+for allowed in cpus:
+	assert "," not in allowed and "-" not in allowed, "Error: a part may use CPUs %s" % allowed
+if len(os.sched_getaffinity(0)) > 1:
+	assert len(set(cpus)) > 1, "Error: every part ran on CPU %s" % cpus[0]
+run("set ESH_BATCHABLE=" + script, "batchable")
+runs = batch_parts("nice=7 " + script, "batch-nice")
+assert all(r[1] == "7" for r in runs), "Error: the parts had niceness %r" % [r[1] for r in runs]
+
+# The shell itself is untouched
+assert nice_and_policy(c.pid)[0] == os.getpriority(os.PRIO_PROCESS, 0), \
+	"Error: the attributes were applied to the shell"
+
+# A word with '=' that is the command is not an attribute
+output = run("nice=5", "command-done")
+assert "invalid value" not in output, "Error: 'nice=5' alone was taken as an attribute"
+
+for attribute in ("nice=20", "nice=low", "cpus=x", "ioprio=none:3", "ioprio=idle:1", "sched=fast"):
+	output = run(attribute + " true; echo status-$?", "invalid-done")
+	assert "invalid value" in output and "status-2" in output, \
+		"Error: %s was accepted: %r" % (attribute, output)
+
+for attribute in ("ioprio=none", "ioprio=idle", "ioprio=be:7"):
+	output = run(attribute + " true; echo status-$?", "valid-done")
+	assert "status-0" in output, "Error: %s failed: %r" % (attribute, output)
+
+shellio.success()
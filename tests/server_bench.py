@@ -0,0 +1,65 @@
+#!/usr/bin/python
+#
+# Benchmark for server mode: the latency of short invocations through
+# esh-client and a running 'esh --server', against starting the shell
+# with 'esh -c' each time.  Both must produce the same output and exit
+# status.
+#
+# usage: server_bench.py <definitions script> <plugin dir> [runs]
+#
+import sys, imp, atexit
+import shellio, time, os, subprocess, shlex
+
+definitions_scriptname = sys.argv[1]
+plugin_dir = sys.argv[2]
+runs = int(sys.argv[3]) if len(sys.argv) > 3 else 200
+def_module = imp.load_source('', definitions_scriptname)
+
+shell = shlex.split(def_module.shell + plugin_dir)
+client = os.path.join(os.path.dirname(shell[0]), "esh-client")
+path = "/tmp/esh-server-bench-%d.sock" % os.getpid()
+
+server = subprocess.Popen(shell + ["--server", path],
+	stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+atexit.register(server.terminate)
+deadline = time.time() + 5
+while not os.path.exists(path):
+	assert time.time() < deadline, "Server did not create " + path
+	time.sleep(0.05)
+
+def run(argv):
+	start = time.time()
+	p = subprocess.run(argv, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+	return time.time() - start, p.returncode, p.stdout
+
+def measure(argv):
+	times = []
+	for i in range(runs):
+		elapsed, status, output = run(argv)
+		times.append(elapsed)
+	times.sort()
+	return times
+
+# Same results both ways; a cold start also reports loading the plugins
+for command, status in [("echo hello", 0), ("ls /nonexistent", 2), ("cat /etc/hostname | wc -c", 0)]:
+	cold = run(shell + ["-c", command])
+	warm = run([client, path, "-c", command])
+	assert cold[1] == warm[1] and cold[2].endswith(warm[2]), \
+		"Error: '%s' gives %s cold but %s through the server" % (command, cold[1:], warm[1:])
+	assert warm[1] == status, "Error: '%s' exited with %d" % (command, warm[1])
+
+def report(name, times):
+	print("%-12s mean %7.2f ms  p50 %7.2f ms  p99 %7.2f ms" % (name,
+		1000 * sum(times) / len(times), 1000 * times[len(times) // 2],
+		1000 * times[min(len(times) - 1, len(times) * 99 // 100)]))
+
+# A command that is run, and a builtin, which leaves only the shell's own cost
+for command in ["true", "set +o notify"]:
+	cold = measure(shell + ["-c", command])
+	warm = measure([client, path, "-c", command])
+	print("'%s', %d runs:" % (command, runs))
+	report("esh -c", cold)
+	report("esh-client", warm)
+	print("speedup through the server: %.2fx" % (sum(cold) / sum(warm)))
+
+shellio.success()
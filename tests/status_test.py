@@ -0,0 +1,69 @@
+#!/usr/bin/python
+#
+# Test for plugins that implement command_status_change: every job
+# must still leave the job table when it ends, so that the table stays
+# small however many jobs run, and the plugin must hear about each of
+# them.  Builds tests/plugins/status_counter.c, along with the plugins
+# in <plugin dir>.
+#
+# usage: status_test.py <definitions script> <plugin dir> [jobs]
+#
+import sys, imp, atexit
+sys.path.append("/home/courses/cs3214/software/pexpect-dpty/");
+import pexpect, shellio, os, glob, shutil, subprocess, tempfile
+
+#Ensure the shell process is terminated
+def force_shell_termination(shell_process):
+	c.close(force=True)
+
+definitions_scriptname = sys.argv[1]
+plugin_dir = sys.argv[2]
+jobs = int(sys.argv[3]) if len(sys.argv) > 3 else 10000
+def_module = imp.load_source('', definitions_scriptname)
+logfile = None
+if hasattr(def_module, 'logfile'):
+    logfile = def_module.logfile
+
+# The plugins under test, and the status counter
+test_plugin_dir = tempfile.mkdtemp()
+atexit.register(shutil.rmtree, test_plugin_dir)
+for so in glob.glob(os.path.join(plugin_dir, "*.so")):
+	shutil.copy(so, test_plugin_dir)
+here = os.path.dirname(os.path.abspath(__file__))
+subprocess.check_call(["gcc", "-shared", "-fPIC", "-o",
+	os.path.join(test_plugin_dir, "status_counter.so"),
+	os.path.join(here, "plugins", "status_counter.c")])
+
+c = pexpect.spawn(def_module.shell + test_plugin_dir, drainpty=True, logfile=logfile)
+atexit.register(force_shell_termination, shell_process=c)
+
+def job_count():
+	c.sendline("jobs --json; echo end-of-jobs")
+	c.expect_exact("jobs --json; echo end-of-jobs")
+	assert c.expect("end-of-jobs", timeout=30) == 0, "Shell did not list the jobs"
+	return c.before.count('"jid"')
+
+# Start the jobs in batches, checking the job table as they go
+per_line = 100
+largest = 0
+for started in range(0, jobs, per_line):
+	c.sendline(" ".join(["true &"] * min(per_line, jobs - started)) + " echo batch-done")
+	assert c.expect("batch-done", timeout=30) == 0, "Shell did not start the jobs"
+	if started % (10 * per_line) == 0:
+		largest = max(largest, job_count())
+
+# Wait for the stragglers, then the table must be empty
+c.sendline("sleep 1")
+remaining = job_count()
+assert remaining == 0, "Error: %d of %d jobs stayed in the job table" % (remaining, jobs)
+assert largest < 2 * per_line, "Error: the job table grew to %d jobs" % largest
+
+# One status change, the exit, per job
+c.sendline("status_events")
+assert c.expect(r"status events: (\d+)") == 0, "Plugin did not report its count"
+events = int(c.match.group(1))
+assert events >= jobs, "Error: the plugin heard of %d of %d jobs" % (events, jobs)
+
+print("%d jobs, at most %d in the job table at a time" % (jobs, largest))
+
+shellio.success()
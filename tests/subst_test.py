@@ -0,0 +1,104 @@
+#!/usr/bin/python
+#
+# Test for command substitution: $(...) and `...` are replaced by the
+# words their command prints, text around a substitution is joined to
+# its first and last words, and a substitution cannot change the
+# shell, whether it runs in a subshell or, for a builtin that only
+# prints, in the shell itself.  Globs next to a process substitution
+# are expanded.
+#
+# usage: subst_test.py <definitions script> <plugin dir>
+#
+import sys, imp, atexit
+sys.path.append("/home/courses/cs3214/software/pexpect-dpty/");
+import pexpect, shellio, os, shutil, tempfile
+
+#Ensure the shell process is terminated
+def force_shell_termination(shell_process):
+	c.close(force=True)
+
+definitions_scriptname = sys.argv[1]
+plugin_dir = sys.argv[2]
+def_module = imp.load_source('', definitions_scriptname)
+logfile = None
+if hasattr(def_module, 'logfile'):
+    logfile = def_module.logfile
+
+work = tempfile.mkdtemp()
+atexit.register(shutil.rmtree, work)
+words = os.path.join(work, "words.sh")
+with open(words, "w") as f:
+	f.write('for w in "$@"; do echo "[$w]"; done\n')
+
+c = pexpect.spawn(def_module.shell + plugin_dir, drainpty=True, logfile=logfile)
+atexit.register(force_shell_termination, shell_process=c)
+
+def run(command, marker):
+	c.sendline(command + "; echo " + marker)
+	c.expect_exact(command + "; echo " + marker)
+	c.expect_exact(marker + "\r\n")
+	return c.before
+
+# The words 'command' passes to a script that prints each in brackets
+def argv(command, marker):
+	output = run("sh " + words + " " + command, marker)
+	lines = [line.strip().split("\r")[-1] for line in output.split("\n")]
+	return [line for line in lines if line.startswith("[")]
+
+c.sendline("cd " + work)
+
+# Substitutions on their own, split into words
+assert argv("$(echo a b)", "plain") == ["[a]", "[b]"], "Error: $(echo a b) was not two words"
+assert argv("`echo a b`", "backticks") == ["[a]", "[b]"], "Error: `echo a b` was not two words"
+assert argv("x $(true) y", "empty") == ["[x]", "[y]"], "Error: $(true) was a word"
+assert argv("$(echo $(echo nested))", "nested") == ["[nested]"], "Error: nesting failed"
+assert argv("$(echo a | tr a b)", "pipeline") == ["[b]"], "Error: a pipeline in $(...) failed"
+
+# Text around a substitution stays in the same word
+assert argv("--prefix=$(pwd)", "prefix") == ["[--prefix=%s]" % work], \
+	"Error: --prefix=$(pwd) was split"
+assert argv("x$(echo y)", "before") == ["[xy]"], "Error: x$(echo y) was split"
+assert argv("$(echo a)b", "after") == ["[ab]"], "Error: $(echo a)b was split"
+assert argv("x`echo y`z", "backtick-join") == ["[xyz]"], "Error: x`echo y`z was split"
+assert argv("x$(echo a b)y", "both") == ["[xa]", "[by]"], "Error: x$(echo a b)y was not xa by"
+assert argv("x$(true)y", "join-empty") == ["[xy]"], "Error: x$(true)y was not xy"
+assert argv("a$(echo b)c$(echo d)e", "two") == ["[abcde]"], "Error: two substitutions were split"
+output = run("set V=v; sh " + words + " $V-$(echo s)-$V", "variables")
+assert "[v-s-v]" in output, "Error: $V-$(echo s)-$V gave %r" % output
+
+# Globs on either side of a process substitution are expanded
+for name in ["g1.c", "g2.c"]:
+	open(os.path.join(work, name), "w").close()
+output = argv("g*.c <(echo p) g*.c", "glob-procsub")
+assert len(output) == 5 and output[:2] == output[3:] == ["[g1.c]", "[g2.c]"] \
+	and output[2].startswith("[/dev/fd/"), "Error: g*.c <(echo p) g*.c gave %r" % output
+
+# Builtins that change the shell run in a subshell
+run("echo $(cd /)", "cd")
+output = run("pwd", "pwd")
+assert work in output, "Error: $(cd /) changed the directory to %r" % output
+run("echo $(set LEAK=1)", "set")
+output = run("echo leak-$LEAK-", "leak")
+assert "leak--" in output, "Error: $(set LEAK=1) set the variable: %r" % output
+
+# and fg does not take a job of the shell
+c.sendline("sleep 30 &")
+c.expect("\[([0-9]+)\] [0-9]+")
+jid = c.match.group(1)
+output = run("echo fg-$(fg %" + jid + ")", "fg")
+assert "no job control" in output, "Error: $(fg) printed %r" % output
+output = run("jobs", "jobs-after-fg")
+assert "Running" in output and "sleep 30" in output, "Error: $(fg) took the job: %r" % output
+
+# jobs only prints, and runs in the shell: it sees the shell's jobs
+output = argv("$(jobs)", "jobs")
+assert "[Running]" in output and "[(sleep]" in output, "Error: $(jobs) printed %r" % output
+run("kill %" + jid, "kill")
+
+# An unterminated substitution is an error
+c.sendline("echo $(echo a")
+assert c.expect_exact("Unterminated substitution.") == 0, "Error: $(echo a was accepted"
+output = run("echo still-here", "after-unterminated")
+assert "still-here" in output, "Error: the shell did not recover"
+
+shellio.success()
@@ -0,0 +1,146 @@
+#!/usr/bin/python
+#
+# Test for watch: the command runs once at the start, again after a
+# watched file changes or is replaced by a rename, and only once for a
+# burst of changes.  Each run expands the command anew, directories made
+# in a watched one are watched too, and a run still in progress when a
+# change comes is cancelled.  The watch job is a single entry in jobs.
+#
+# usage: watch_test.py <definitions script> <plugin dir>
+#
+import sys, imp, atexit
+sys.path.append("/home/courses/cs3214/software/pexpect-dpty/");
+import pexpect, shellio, os, shutil, tempfile, time
+
+#Ensure the shell process is terminated
+def force_shell_termination(shell_process):
+	c.close(force=True)
+
+definitions_scriptname = sys.argv[1]
+plugin_dir = sys.argv[2]
+def_module = imp.load_source('', definitions_scriptname)
+logfile = None
+if hasattr(def_module, 'logfile'):
+    logfile = def_module.logfile
+
+# The command counts its runs outside the watched directory
+work = tempfile.mkdtemp()
+atexit.register(shutil.rmtree, work)
+watched = os.path.join(work, "src")
+os.mkdir(watched)
+source = os.path.join(watched, "main.c")
+with open(source, "w") as f:
+	f.write("1\n")
+runs = os.path.join(work, "runs")
+script = os.path.join(work, "build.sh")
+with open(script, "w") as f:
+	f.write("tail -n 1 %s >> %s\n" % (source, runs))
+
+def count():
+	if not os.path.exists(runs):
+		return 0
+	with open(runs) as f:
+		return len(f.readlines())
+
+def wait_for(n):
+	deadline = time.time() + 5
+	while count() < n and time.time() < deadline:
+		time.sleep(0.05)
+	assert count() == n, "Error: expected %d runs, got %d" % (n, count())
+
+c = pexpect.spawn(def_module.shell + plugin_dir, drainpty=True, logfile=logfile)
+atexit.register(force_shell_termination, shell_process=c)
+
+def run(command, marker):
+	c.sendline(command + "; echo " + marker)
+	c.expect_exact(command + "; echo " + marker)
+	c.expect_exact(marker + "\r\n")
+	return c.before
+
+c.sendline("watch -d 100 " + watched + " -- sh " + script + " &")
+c.expect("\[1\] [0-9]+")
+c.expect_exact("watch: run 1 started")
+wait_for(1)
+
+# A change to a watched file runs it again
+with open(source, "a") as f:
+	f.write("2\n")
+c.expect_exact("watch: run 2 started")
+wait_for(2)
+
+# A burst of changes is a single run
+for i in range(5):
+	with open(source, "a") as f:
+		f.write("burst\n")
+	time.sleep(0.01)
+c.expect_exact("watch: run 3 started")
+c.expect_exact("watch: run 3 exited with status 0")
+time.sleep(0.5)
+assert count() == 3, "Error: the burst led to %d runs" % (count() - 2)
+
+# A file replaced by a rename is noticed
+replacement = os.path.join(work, "main.c.new")
+with open(replacement, "w") as f:
+	f.write("renamed\n")
+os.rename(replacement, source)
+c.expect_exact("watch: run 4 started")
+wait_for(4)
+with open(runs) as f:
+	assert f.readlines()[-1] == "renamed\n", "Error: run 4 did not see the new file"
+
+# Changes elsewhere do not run it
+with open(os.path.join(work, "elsewhere"), "w") as f:
+	f.write("x\n")
+time.sleep(0.5)
+assert count() == 4, "Error: a change outside the watched paths ran it"
+
+# One job, which kill ends
+output = run("jobs", "jobs-done")
+assert output.count("Running") == 1 and "watch" in output, "Error: jobs showed %r" % output
+run("kill %1", "kill-done")
+time.sleep(0.3)
+output = run("jobs", "after-kill")
+assert "watch" not in output, "Error: the watch job survived kill: %r" % output
+
+# Each run globs anew, and a new subdirectory is watched
+listing = os.path.join(work, "listing")
+c.sendline("watch -d 50 " + watched + " -- ls " + watched + "/*.c > " + listing + " &")
+c.expect("\[([0-9]+)\] [0-9]+")
+job = c.match.group(1)
+c.expect_exact("watch: run 1 exited with status 0")
+with open(os.path.join(watched, "util.c"), "w") as f:
+	f.write("\n")
+c.expect_exact("watch: run 2 exited with status 0")
+with open(listing) as f:
+	assert "util.c" in f.read(), "Error: run 2 did not glob the new file"
+os.mkdir(os.path.join(watched, "lib"))
+c.expect_exact("watch: run 3 exited with status 0")
+time.sleep(0.3)
+with open(os.path.join(watched, "lib", "lib.c"), "w") as f:
+	f.write("\n")
+c.expect_exact("watch: run 4 started")
+run("kill %" + job, "kill-listing")
+
+# A change during a run cancels it, and a new run starts
+slow = os.path.join(work, "slow.sh")
+with open(slow, "w") as f:
+	f.write("echo started >> %s\nsleep 30\n" % runs)
+c.sendline("watch -d 50 " + watched + " -- sh " + slow + " &")
+c.expect("\[([0-9]+)\] [0-9]+")
+job = c.match.group(1)
+c.expect_exact("watch: run 1 started")
+wait_for(5)
+with open(source, "a") as f:
+	f.write("again\n")
+c.expect_exact("watch: run 1 cancelled")
+c.expect_exact("watch: run 2 started")
+wait_for(6)
+run("kill %" + job, "kill-slow")
+
+# Usage errors
+output = run("watch " + watched + " sh " + script + "; echo status-$?", "usage-done")
+assert "usage: watch" in output, "Error: a watch without -- was accepted: %r" % output
+output = run("watch -d soon " + watched + " -- true; echo status-$?", "debounce-done")
+assert "-d expects milliseconds" in output, "Error: a bad -d was accepted: %r" % output
+
+shellio.success()